@@ -0,0 +1,32 @@
+This file is part of drive-fuse-sync.
+
+drive-fuse-sync is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+drive-fuse-sync is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _BLKCACHE_H_
+#define _BLKCACHE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define BLKCACHE_BLOCK  (32 * 1024)
+
+int blkcache_setup(size_t);
+int blkcache_cleanup(void);
+
+int blkcache_read(const char *, int, char *, off_t, size_t);
+int blkcache_invalidate(const char *);
+
+int blkcache_stats(uint64_t *, uint64_t *, size_t *);
+
+#endif /* _BLKCACHE_H_ */
@@ -23,6 +23,11 @@ along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
 typedef int (dbcache_cb_t)(int64_t, const char *, const char *, int, size_t,
         mode_t, const struct timespec *, const struct timespec *,
         const struct timespec *, const char *, int64_t);
+typedef int (dbcache_fetch_cb_t)(const char *, const char *, int64_t);
+typedef int (dbcache_key_cb_t)(const char *);
+
+/* cache keys, as made by fscache_key() */
+#define DBCACHE_KEY_MAX 63
 
 int dbcache_open(const char *);
 int dbcache_close(void);
@@ -38,6 +43,24 @@ int dbcache_auth_store(const char *, const char *, const char *, int,
 int dbcache_update(const char *, const char *, int, int64_t,
                 const struct timespec *, const struct timespec *,
                 const char *, const char *);
+int dbcache_remove(const char *, dbcache_key_cb_t *);
+
+int dbcache_content_load(const char *, char *, size_t, char *, size_t);
+int dbcache_content_store(const char *, const char *, const char *,
+        const char *, dbcache_key_cb_t *);
+int dbcache_content_cached(dbcache_fetch_cb_t *);
+
+int dbcache_pin(int64_t, int);
+int dbcache_pinned(const char *);
+int dbcache_pin_pending(int64_t, dbcache_fetch_cb_t *);
+int dbcache_pin_status(int64_t, int *, int64_t *, int64_t *);
+
+int dbcache_access_record(const char *, const char **, int, time_t);
+int dbcache_access_top(int, time_t, dbcache_fetch_cb_t *);
+int dbcache_access_peers(const char *, int, dbcache_fetch_cb_t *);
+int dbcache_access_dir(int64_t, int, time_t, dbcache_fetch_cb_t *);
+
+int dbcache_dir_small(int64_t, int64_t, int, dbcache_fetch_cb_t *);
 
 int dbcache_mkdir(const char *, mode_t, dbcache_cb_t *);
 int dbcache_rmdir(const char *, dbcache_cb_t *);
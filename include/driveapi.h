@@ -16,14 +16,50 @@ along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef _DRIVE_API_H_
 #define _DRIVE_API_H_
 
-#include <stdio.h>
+#include <stdint.h>
 
+#include "fscache.h"
+
+/* kinds of drive request, told apart by url */
+#define DRIVE_REQ_TOKEN     0
+#define DRIVE_REQ_LIST      1
+#define DRIVE_REQ_METADATA  2
+#define DRIVE_REQ_MEDIA     3
+#define DRIVE_REQ_CHANGES   4
+#define DRIVE_REQ_OTHER     5
+#define DRIVE_REQS          6
+
+/* where the time of the requests of one kind went, from curl's timers;
+ * dns, connect and tls only add up over requests that opened a new
+ * connection, wait is from sending the request to the first byte back */
+struct _drive_timing
+{
+    uint64_t requests;
+    uint64_t failed;
+    uint64_t reused;
+    uint64_t slow;
+    uint64_t bytes;
+    double dns;
+    double connect;
+    double tls;
+    double wait;
+    double total;
+};
+typedef struct _drive_timing drive_timing_t;
+
+void drive_endpoints(const char *, const char *);
+void drive_slowlog(long);
 int drive_setup(void);
 
 int drive_start(void);
 int drive_stop(void);
 
-int drive_download(const char *, FILE *);
+int drive_download(const char *, fscache_sink_t *, const int *);
+int drive_download_batch(const char **, fscache_sink_t **, int *, int);
+int drive_revision(const char *, char *, size_t, int);
+
+int drive_timing(drive_timing_t *);
+const char *drive_req_name(int);
 
 #endif /* _DRIVE_API_H_ */
 
@@ -0,0 +1,35 @@
+This file is part of drive-fuse-sync.
+
+drive-fuse-sync is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+drive-fuse-sync is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _FETCH_H_
+#define _FETCH_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* background download workers */
+#define FETCH_WORKERS   2
+
+int fetch_setup(int, size_t);
+int fetch_cleanup(void);
+
+int fetch_file(const char *, const char *, const char *, size_t, int);
+int fetch_adopt(const char *, const char *, const char *);
+int fetch_evict(const char *);
+int fetch_queue(const char *, const char *, const char *, size_t);
+int fetch_pinned(int64_t);
+int fetch_dir(int64_t);
+
+#endif /* _FETCH_H_ */
@@ -20,8 +20,16 @@ along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
 #include <sys/stat.h>
 #include <sys/types.h>
 
+/* objects up to this size are kept in the inline pack, not in files */
+#define FSCACHE_INLINE_MAX  (16 * 1024)
+
+#define FSCACHE_KEY_MAX     63
+
 int fscache_setup(const char *);
 int fscache_cleanup(void);
+int fscache_rekey(void);
+
+int fscache_key(const char *, const char *, size_t, char *, size_t);
 
 int fscache_create(const char *);
 int fscache_open(const char *, int);
@@ -34,8 +42,15 @@ int fscache_size(int, size_t *);
 int fscache_rm(const char *);
 
 int fscache_stat(const char *, struct stat *);
-FILE *fscache_fopen(const char *);
-void fscache_fclose(FILE *);
+
+int fscache_inline_size(const char *, size_t *);
+int fscache_inline_read(const char *, char *, off_t, size_t);
+
+typedef struct _fscache_sink fscache_sink_t;
+
+fscache_sink_t *fscache_sink_open(const char *, size_t);
+size_t fscache_sink_write(fscache_sink_t *, const char *, size_t);
+int fscache_sink_close(fscache_sink_t *, int);
 
 #endif /* _FSCACHE_H_ */
 
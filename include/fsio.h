@@ -0,0 +1,33 @@
+This file is part of drive-fuse-sync.
+
+drive-fuse-sync is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+drive-fuse-sync is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _FSIO_H_
+#define _FSIO_H_
+
+#include <sys/types.h>
+
+typedef void (fsio_cb_t)(void *, int);
+
+int fsio_setup(unsigned int);
+int fsio_cleanup(void);
+
+int fsio_read(int, void *, size_t, off_t, fsio_cb_t *, void *);
+int fsio_write(int, const void *, size_t, off_t, fsio_cb_t *, void *);
+int fsio_fsync(int, fsio_cb_t *, void *);
+int fsio_fallocate(int, off_t, off_t, fsio_cb_t *, void *);
+
+int fsio_submit(void);
+
+#endif /* _FSIO_H_ */
@@ -0,0 +1,29 @@
+This file is part of drive-fuse-sync.
+
+drive-fuse-sync is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+drive-fuse-sync is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _FSPACK_H_
+#define _FSPACK_H_
+
+#include <sys/types.h>
+
+int fspack_setup(int);
+int fspack_cleanup(void);
+
+int fspack_store(const char *, const char *, size_t);
+int fspack_read(const char *, char *, off_t, size_t);
+int fspack_size(const char *, size_t *);
+int fspack_rm(const char *);
+
+#endif /* _FSPACK_H_ */
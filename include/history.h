@@ -0,0 +1,30 @@
+This file is part of drive-fuse-sync.
+
+drive-fuse-sync is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+drive-fuse-sync is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _HISTORY_H_
+#define _HISTORY_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+int history_setup(size_t);
+int history_cleanup(void);
+
+void history_open(const char *);
+void history_dir(int64_t);
+
+int history_stats(uint64_t *, uint64_t *, uint64_t *);
+
+#endif /* _HISTORY_H_ */
@@ -22,27 +22,38 @@ along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <stdarg.h>
 
+#define LOG_ERROR       0
+#define LOG_WARNING     1
+#define LOG_INFO        2
+#define LOG_DEBUG       3
+
+/* levels above LOG_LEVEL_MAX are compiled out, those above log_level are
+ * skipped at run time before any argument is evaluated */
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX   LOG_DEBUG
+#endif /* LOG_LEVEL_MAX */
+
+extern int log_level;
+
 int log_init(const char *);
 int log_term(void);
 
 int log_context(void **, const char *);
+int log_set_level(int);
+int log_parse_level(const char *);
 
-/*#ifdef HAVE_LIBLOG4C*/
-#ifdef HAVE_LIBLOG4C_JUST_AS_EXAMPLE
+void log_write(int, const char *, ...) __attribute__((format(printf, 2, 3)));
 
-#define log_debug(...)      log4c_category_debug(appender, __VA_ARGS__)
-#define log_info(...)       log4c_category_info(appender, __VA_ARGS__)
-#define log_warning(...)    log4c_category_warning(appender, __VA_ARGS__)
-#define log_error(...)      log4c_category_error(appender, __VA_ARGS__)
+#define log_at(level, ...) \
+    do { \
+        if(((level) <= LOG_LEVEL_MAX) && ((level) <= log_level)) { \
+            log_write((level), __VA_ARGS__); \
+        } \
+    } while(0)
 
-#else /* HAVE_LIBLOG4C */
-
-#define log_debug(...)      printf( __VA_ARGS__); printf("\n")
-#define log_info(...)       printf( __VA_ARGS__); printf("\n")
-#define log_warning(...)    printf( __VA_ARGS__); printf("\n")
-#define log_error(...)      fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n")
-
-#endif /* HAVE_LIBLOG4C */
+#define log_debug(...)      log_at(LOG_DEBUG, __VA_ARGS__)
+#define log_info(...)       log_at(LOG_INFO, __VA_ARGS__)
+#define log_warning(...)    log_at(LOG_WARNING, __VA_ARGS__)
+#define log_error(...)      log_at(LOG_ERROR, __VA_ARGS__)
 
 #endif /* _LOG_H_ */
-
@@ -0,0 +1,37 @@
+This file is part of drive-fuse-sync.
+
+drive-fuse-sync is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+drive-fuse-sync is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _MD5_H_
+#define _MD5_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MD5_HEX_MAX 32
+
+struct _md5
+{
+    uint32_t state[4];
+    uint64_t len;
+    uint8_t buf[64];
+};
+typedef struct _md5 md5_t;
+
+void md5_init(md5_t *);
+void md5_update(md5_t *, const void *, size_t);
+void md5_hex(md5_t *, char *);
+
+#endif /* _MD5_H_ */
+
@@ -0,0 +1,57 @@
+This file is part of drive-fuse-sync.
+
+drive-fuse-sync is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+drive-fuse-sync is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* static tracepoints for bpftrace, perf or systemtap, all under provider
+ * drivefusesync; with no tracer attached each one is a single nop, and
+ * without <sys/sdt.h> they compile to nothing. Arguments:
+ *
+ *   fuse_entry         op name, path
+ *   fuse_return        op name, path, result
+ *   db_start           function name
+ *   db_done            function name, result as returned by sqlite or
+ *                      the function itself
+ *   cache_read         fd, offset, length
+ *   cache_read_done    fd, result
+ *   cache_write        fd, offset, length
+ *   cache_write_done   fd, result
+ *   download_start     file id, transfer class
+ *   download_progress  transfer class, bytes so far, bytes expected
+ *   download_done      file id, result
+ *   change_apply       file id, removed
+ *   change_page        page token, changes in the page
+ *
+ * e.g. bpftrace -e 'usdt:./drivefusesync:fuse_entry { @[str(arg0)] =
+ * count(); }' */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define PROBE1(name, a)         DTRACE_PROBE1(drivefusesync, name, a)
+#define PROBE2(name, a, b)      DTRACE_PROBE2(drivefusesync, name, a, b)
+#define PROBE3(name, a, b, c)   DTRACE_PROBE3(drivefusesync, name, a, b, c)
+#else
+#define PROBE1(name, a)         do { } while(0)
+#define PROBE2(name, a, b)      do { } while(0)
+#define PROBE3(name, a, b, c)   do { } while(0)
+#endif /* HAVE_SYS_SDT_H */
+
+#endif /* _PROBES_H_ */
@@ -0,0 +1,70 @@
+This file is part of drive-fuse-sync.
+
+drive-fuse-sync is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+drive-fuse-sync is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* latency histograms, kept per thread so recording takes no locks and
+ * summed when read; times are CLOCK_MONOTONIC ns, the same clock as
+ * trace_begin(), so one start time serves both */
+
+#define STATS_FUSE_GETATTR      0
+#define STATS_FUSE_MKDIR        1
+#define STATS_FUSE_RMDIR        2
+#define STATS_FUSE_OPEN         3
+#define STATS_FUSE_READ         4
+#define STATS_FUSE_RELEASE      5
+#define STATS_FUSE_READDIR      6
+#define STATS_FUSE_SETXATTR     7
+#define STATS_FUSE_GETXATTR     8
+#define STATS_FUSE_LISTXATTR    9
+#define STATS_DB_FINDBYPATH     10
+#define STATS_DB_LISTDIR        11
+#define STATS_DB_UPDATE         12
+#define STATS_DB_REMOVE         13
+#define STATS_DB_CONTENT        14
+#define STATS_DB_PIN            15
+#define STATS_DB_ACCESS         16
+#define STATS_DB_DIR            17
+#define STATS_DB_CHANGE         18
+#define STATS_DB_AUTH           19
+#define STATS_FS_OPEN           20
+#define STATS_FS_READ           21
+#define STATS_FS_WRITE          22
+#define STATS_FS_INLINE         23
+#define STATS_FS_COMMIT         24
+/* one per xfer class, STATS_HTTP + XFER_INTERACTIVE ... */
+#define STATS_HTTP              25
+#define STATS_HTTP_AUTH         29
+/* phases of drive requests, see drive_timing_t */
+#define STATS_HTTP_DNS          30
+#define STATS_HTTP_CONNECT      31
+#define STATS_HTTP_TLS          32
+#define STATS_HTTP_WAIT         33
+#define STATS_METRICS           34
+
+int stats_setup(void);
+int stats_cleanup(void);
+
+int64_t stats_begin(void);
+void stats_end(int, int64_t, int);
+void stats_add(int, int64_t, int);
+
+int stats_print(FILE *);
+
+#endif /* _STATS_H_ */
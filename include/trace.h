@@ -0,0 +1,70 @@
+This file is part of drive-fuse-sync.
+
+drive-fuse-sync is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+drive-fuse-sync is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* binary trace of fuse operations: a trace_header_t, then records of a
+ * trace_record_t followed by len - sizeof(trace_record_t) path bytes (no
+ * terminator); integers are host endian */
+
+#define TRACE_MAGIC         "DFSTRACE"
+#define TRACE_VERSION       1
+
+#define TRACE_GETATTR       1
+#define TRACE_MKDIR         2
+#define TRACE_RMDIR         3
+#define TRACE_OPEN          4
+#define TRACE_READ          5
+#define TRACE_RELEASE       6
+#define TRACE_READDIR       7
+#define TRACE_SETXATTR      8
+#define TRACE_GETXATTR      9
+#define TRACE_LISTXATTR     10
+#define TRACE_OPS           11
+
+struct _trace_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    int64_t epoch;          /* wall clock of start, ns */
+};
+typedef struct _trace_header trace_header_t;
+
+struct _trace_record
+{
+    uint16_t len;
+    uint8_t op;
+    uint8_t flags;
+    int32_t result;
+    int64_t start;          /* ns since the trace started */
+    int64_t duration;       /* ns */
+    int64_t off;
+    int64_t size;
+};
+typedef struct _trace_record trace_record_t;
+
+int trace_setup(const char *);
+int trace_cleanup(void);
+int trace_enabled(void);
+
+int64_t trace_begin(void);
+void trace_end(int, const char *, int64_t, int64_t, int64_t, int);
+
+#endif /* _TRACE_H_ */
@@ -0,0 +1,54 @@
+This file is part of drive-fuse-sync.
+
+drive-fuse-sync is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+drive-fuse-sync is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _XFER_H_
+#define _XFER_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* transfer priority classes, most urgent first */
+#define XFER_INTERACTIVE    0
+#define XFER_METADATA       1
+#define XFER_PREFETCH       2
+#define XFER_BULK           3
+#define XFER_CLASSES        4
+
+/* counted events */
+#define XFER_EV_THROTTLED   0
+#define XFER_EV_SERVER      1
+#define XFER_EV_TRANSPORT   2
+#define XFER_EV_RETRY       3
+#define XFER_EVENTS         4
+
+int xfer_setup(void);
+int xfer_cleanup(void);
+
+int xfer_enter(int);
+int xfer_try_enter(int);
+int xfer_leave(int);
+int xfer_yield(int);
+
+int xfer_token(void);
+int xfer_ok(void);
+int xfer_throttled(void);
+int xfer_count(int);
+int xfer_stats(uint64_t *, double *);
+
+int xfer_bwlimit(size_t, size_t, int, int);
+size_t xfer_cap(int, int);
+int xfer_consume(int, size_t);
+
+#endif /* _XFER_H_ */
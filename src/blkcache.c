@@ -0,0 +1,352 @@
+This file is part of drive-fuse-sync.
+
+drive-fuse-sync is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+drive-fuse-sync is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "blkcache.h"
+
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fscache.h"
+#include "log.h"
+
+/* cache of BLKCACHE_BLOCK sized blocks of cache objects, keyed by object
+ * key and block number; split in shards with a lock, a hash table and a
+ * clock hand each, so concurrent readers rarely contend */
+
+#define BLKCACHE_SHARDS     64
+#define BLKCACHE_NIL        (-1)
+
+struct _blkcache_slot
+{
+    char key[FSCACHE_KEY_MAX + 1];
+    uint64_t blk;
+    size_t len;
+    int valid;
+    int ref;
+    int next;
+};
+typedef struct _blkcache_slot blkcache_slot_t;
+
+struct _blkcache_shard
+{
+    pthread_mutex_t mutex;
+    blkcache_slot_t *slots;
+    char *data;
+    int *buckets;
+    int nslots;
+    int nbuckets;
+    int hand;
+    uint64_t hits;
+    uint64_t misses;
+};
+typedef struct _blkcache_shard blkcache_shard_t;
+
+static blkcache_shard_t blkcache_shards[BLKCACHE_SHARDS];
+static int blkcache_enabled = 0;
+static size_t blkcache_budget = 0;
+
+static uint32_t blkcache_hash(const char *, uint64_t);
+static int blkcache_find(blkcache_shard_t *, int, const char *, uint64_t);
+static void blkcache_unlink(blkcache_shard_t *, int);
+static int blkcache_victim(blkcache_shard_t *);
+static int blkcache_block(const char *, int, uint64_t, char *, size_t,
+        size_t);
+
+int blkcache_setup(size_t budget)
+{
+    int i;
+    int j;
+    int nslots;
+    blkcache_shard_t *sh;
+
+    nslots = budget / BLKCACHE_BLOCK / BLKCACHE_SHARDS;
+    if(0 == nslots) {
+        log_info("ram block cache disabled");
+        return 0;
+    }
+
+    for(i = 0; i < BLKCACHE_SHARDS; i++) {
+        sh = &blkcache_shards[i];
+        memset(sh, 0, sizeof(blkcache_shard_t));
+        pthread_mutex_init(&sh->mutex, NULL);
+        sh->nslots = nslots;
+        sh->nbuckets = nslots * 2;
+        sh->slots = malloc(nslots * sizeof(blkcache_slot_t));
+        sh->data = malloc((size_t)nslots * BLKCACHE_BLOCK);
+        sh->buckets = malloc(sh->nbuckets * sizeof(int));
+        if(!sh->slots || !sh->data || !sh->buckets) {
+            log_error("unable to allocate ram block cache");
+            blkcache_enabled = 1;
+            blkcache_cleanup();
+            return -ENOMEM;
+        }
+        memset(sh->slots, 0, nslots * sizeof(blkcache_slot_t));
+        for(j = 0; j < sh->nbuckets; j++) {
+            sh->buckets[j] = BLKCACHE_NIL;
+        }
+    }
+
+    blkcache_budget = (size_t)nslots * BLKCACHE_BLOCK * BLKCACHE_SHARDS;
+    blkcache_enabled = 1;
+    log_info("ram block cache: %lu bytes", (unsigned long)blkcache_budget);
+
+    return 0;
+}
+
+int blkcache_cleanup(void)
+{
+    int i;
+    blkcache_shard_t *sh;
+
+    if(!blkcache_enabled) {
+        return 0;
+    }
+
+    for(i = 0; i < BLKCACHE_SHARDS; i++) {
+        sh = &blkcache_shards[i];
+        free(sh->slots);
+        free(sh->data);
+        free(sh->buckets);
+        sh->slots = NULL;
+        sh->data = NULL;
+        sh->buckets = NULL;
+        pthread_mutex_destroy(&sh->mutex);
+    }
+    blkcache_enabled = 0;
+    blkcache_budget = 0;
+
+    return 0;
+}
+
+int blkcache_read(const char *key, int fd, char *buf, off_t off, size_t len)
+{
+    size_t done;
+    uint64_t blk;
+    size_t boff;
+    size_t n;
+    int rc;
+
+    if(!blkcache_enabled) {
+        return fscache_read(fd, buf, off, len);
+    }
+
+    done = 0;
+    while(done < len) {
+        blk = (uint64_t)(off + done) / BLKCACHE_BLOCK;
+        boff = (size_t)((off + done) % BLKCACHE_BLOCK);
+        n = BLKCACHE_BLOCK - boff;
+        if(n > len - done) {
+            n = len - done;
+        }
+        rc = blkcache_block(key, fd, blk, buf + done, boff, n);
+        if(rc < 0) {
+            return done > 0 ? (int)done : rc;
+        }
+        done += rc;
+        if((size_t)rc < n) {
+            /* end of object */
+            break;
+        }
+    }
+
+    return (int)done;
+}
+
+int blkcache_invalidate(const char *key)
+{
+    int i;
+    int j;
+    blkcache_shard_t *sh;
+
+    if(!blkcache_enabled) {
+        return 0;
+    }
+
+    /* content keyed objects never change, this is only needed for objects
+     * stored under their uuid */
+    for(i = 0; i < BLKCACHE_SHARDS; i++) {
+        sh = &blkcache_shards[i];
+        pthread_mutex_lock(&sh->mutex);
+        for(j = 0; j < sh->nslots; j++) {
+            if(sh->slots[j].valid && (0 == strcmp(sh->slots[j].key, key))) {
+                blkcache_unlink(sh, j);
+            }
+        }
+        pthread_mutex_unlock(&sh->mutex);
+    }
+
+    return 0;
+}
+
+int blkcache_stats(uint64_t *hits, uint64_t *misses, size_t *budget)
+{
+    int i;
+    blkcache_shard_t *sh;
+
+    *hits = 0;
+    *misses = 0;
+    *budget = blkcache_budget;
+    if(!blkcache_enabled) {
+        return 0;
+    }
+    for(i = 0; i < BLKCACHE_SHARDS; i++) {
+        sh = &blkcache_shards[i];
+        pthread_mutex_lock(&sh->mutex);
+        *hits += sh->hits;
+        *misses += sh->misses;
+        pthread_mutex_unlock(&sh->mutex);
+    }
+
+    return 0;
+}
+
+static uint32_t blkcache_hash(const char *key, uint64_t blk)
+{
+    uint32_t h;
+
+    h = 2166136261U;
+    while(*key) {
+        h ^= (uint8_t)*key;
+        h *= 16777619U;
+        key++;
+    }
+    h ^= (uint32_t)(blk * 2654435761U);
+    h *= 16777619U;
+    return h;
+}
+
+static int blkcache_find(blkcache_shard_t *sh, int bucket, const char *key,
+        uint64_t blk)
+{
+    int i;
+
+    for(i = sh->buckets[bucket]; i != BLKCACHE_NIL; i = sh->slots[i].next) {
+        if((sh->slots[i].blk == blk) && (0 == strcmp(sh->slots[i].key, key))) {
+            break;
+        }
+    }
+    return i;
+}
+
+static void blkcache_unlink(blkcache_shard_t *sh, int slot)
+{
+    int *pi;
+    blkcache_slot_t *s;
+
+    s = &sh->slots[slot];
+    pi = &sh->buckets[(blkcache_hash(s->key, s->blk) / BLKCACHE_SHARDS) %
+            sh->nbuckets];
+    for(; *pi != BLKCACHE_NIL; pi = &sh->slots[*pi].next) {
+        if(*pi == slot) {
+            *pi = s->next;
+            break;
+        }
+    }
+    s->valid = 0;
+    s->ref = 0;
+}
+
+static int blkcache_victim(blkcache_shard_t *sh)
+{
+    int slot;
+
+    /* clock: recently used blocks get a second chance */
+    for(;;) {
+        slot = sh->hand;
+        sh->hand = (sh->hand + 1) % sh->nslots;
+        if(!sh->slots[slot].valid) {
+            return slot;
+        }
+        if(sh->slots[slot].ref) {
+            sh->slots[slot].ref = 0;
+            continue;
+        }
+        blkcache_unlink(sh, slot);
+        return slot;
+    }
+}
+
+static int blkcache_block(const char *key, int fd, uint64_t blk, char *buf,
+        size_t boff, size_t len)
+{
+    uint32_t h;
+    blkcache_shard_t *sh;
+    int bucket;
+    int slot;
+    blkcache_slot_t *s;
+    char *tmp;
+    int rc;
+    size_t n;
+
+    h = blkcache_hash(key, blk);
+    sh = &blkcache_shards[h % BLKCACHE_SHARDS];
+    bucket = (h / BLKCACHE_SHARDS) % sh->nbuckets;
+
+    pthread_mutex_lock(&sh->mutex);
+    slot = blkcache_find(sh, bucket, key, blk);
+    if(slot != BLKCACHE_NIL) {
+        s = &sh->slots[slot];
+        s->ref = 1;
+        sh->hits++;
+        n = (boff < s->len) ? s->len - boff : 0;
+        if(n > len) {
+            n = len;
+        }
+        memcpy(buf, sh->data + (size_t)slot * BLKCACHE_BLOCK + boff, n);
+        pthread_mutex_unlock(&sh->mutex);
+        return (int)n;
+    }
+    sh->misses++;
+    pthread_mutex_unlock(&sh->mutex);
+
+    /* read the whole block without holding the shard */
+    tmp = malloc(BLKCACHE_BLOCK);
+    if(NULL == tmp) {
+        return fscache_read(fd, buf, blk * BLKCACHE_BLOCK + boff, len);
+    }
+    rc = fscache_read(fd, tmp, blk * BLKCACHE_BLOCK, BLKCACHE_BLOCK);
+    if(rc < 0) {
+        free(tmp);
+        return rc;
+    }
+
+    pthread_mutex_lock(&sh->mutex);
+    if(BLKCACHE_NIL == blkcache_find(sh, bucket, key, blk)) {
+        slot = blkcache_victim(sh);
+        s = &sh->slots[slot];
+        memset(s->key, 0, (FSCACHE_KEY_MAX + 1) * sizeof(char));
+        strncpy(s->key, key, FSCACHE_KEY_MAX);
+        s->blk = blk;
+        s->len = rc;
+        s->valid = 1;
+        s->ref = 0;
+        s->next = sh->buckets[bucket];
+        sh->buckets[bucket] = slot;
+        memcpy(sh->data + (size_t)slot * BLKCACHE_BLOCK, tmp, rc);
+    }
+    pthread_mutex_unlock(&sh->mutex);
+
+    n = ((size_t)rc > boff) ? (size_t)rc - boff : 0;
+    if(n > len) {
+        n = len;
+    }
+    memcpy(buf, tmp + boff, n);
+    free(tmp);
+
+    return (int)n;
+}
@@ -30,6 +30,8 @@ along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
 #endif
 
 #include "log.h"
+#include "probes.h"
+#include "stats.h"
 
 static sqlite3 *sql = NULL;
 
@@ -43,6 +45,21 @@ static sqlite3_stmt *selbypar = NULL;
 
 static sqlite3_stmt *selbyuuid = NULL;
 static sqlite3_stmt *updbyid = NULL;
+static sqlite3_stmt *updentry = NULL;
+static sqlite3_stmt *delbyuuid = NULL;
+
+static sqlite3_stmt *selcontent = NULL;
+static sqlite3_stmt *updcontent = NULL;
+static sqlite3_stmt *delcontent = NULL;
+static sqlite3_stmt *selgone = NULL;
+static sqlite3_stmt *keyrefs = NULL;
+static sqlite3_stmt *selcached = NULL;
+
+static sqlite3_stmt *pinsubtree = NULL;
+static sqlite3_stmt *pininherit = NULL;
+static sqlite3_stmt *pinbyuuid = NULL;
+static sqlite3_stmt *pinpending = NULL;
+static sqlite3_stmt *pinstatus = NULL;
 
 static sqlite3_stmt *insertentry = NULL;
 static sqlite3_stmt *irename = NULL;
@@ -57,6 +74,27 @@ static sqlite3_stmt *ichmtime = NULL;
 static sqlite3_stmt *selchange = NULL;
 static sqlite3_stmt *updchange = NULL;
 
+static sqlite3_stmt *accput = NULL;
+static sqlite3_stmt *coput = NULL;
+static sqlite3_stmt *coinc = NULL;
+static sqlite3_stmt *acctop = NULL;
+static sqlite3_stmt *accpeers = NULL;
+static sqlite3_stmt *accdir = NULL;
+static sqlite3_stmt *dirsmall = NULL;
+
+/* files whose content is missing from the cache, or out of date */
+#define DBCACHE_STALE   "( dfs_content.uuid IS NULL OR " \
+                        "ifnull(dfs_content.checksum, '') != " \
+                        "ifnull(dfs_entry.checksum, '') ) "
+
+/* access score, decaying over a day */
+#define DBCACHE_SCORE   "dfs_access.score / " \
+                        "( 1 + ( ?2 - dfs_access.last ) / 86400.0 ) "
+
+static void dbcache_pin_inherit(int64_t, int64_t);
+static int dbcache_fetch_rows(sqlite3_stmt *, dbcache_fetch_cb_t *);
+static int dbcache_key_refs(const char *);
+
 static void ts2r(double *, const struct timespec *);
 static void r2ts(struct timespec *, double);
 
@@ -134,6 +172,9 @@ int dbcache_setup_schema(void)
             "FOREIGN KEY ( parent ) REFERENCES dfs_entry ( id ) "
             "ON DELETE CASCADE "
             ")", NULL, NULL, NULL);
+    /* fails harmlessly when the column is already there */
+    sqlite3_exec(sql, "ALTER TABLE dfs_entry ADD COLUMN "
+            "pinned INTEGER NOT NULL DEFAULT 0", NULL, NULL, NULL);
     sqlite3_exec(sql, "CREATE INDEX IF NOT EXISTS dfs_entry_uuid "
             "ON dfs_entry ( uuid )", NULL, NULL, NULL);
     sqlite3_exec(sql, "CREATE INDEX IF NOT EXISTS dfs_entry_parent "
@@ -181,6 +222,48 @@ int dbcache_setup_schema(void)
     }
     sqlite3_finalize(sel);
 
+    /* what the cached content of each file was fetched from */
+    sqlite3_exec(sql, "CREATE TABLE IF NOT EXISTS dfs_content ( "
+            "uuid TEXT NOT NULL PRIMARY KEY, "
+            "checksum TEXT, "
+            "revision TEXT, "
+            "key TEXT "
+            ")", NULL, NULL, NULL);
+    /* fails harmlessly when the column is already there; rows written
+     * before it get the key their content is stored under, when it can
+     * still be told */
+    sqlite3_exec(sql, "ALTER TABLE dfs_content ADD COLUMN key TEXT",
+            NULL, NULL, NULL);
+    sqlite3_exec(sql, "UPDATE dfs_content SET key = CASE "
+            "WHEN ifnull(checksum, '') = '' THEN uuid "
+            "ELSE ( SELECT 'md5-' || dfs_entry.checksum || '-' || "
+            "dfs_entry.size FROM dfs_entry "
+            "WHERE dfs_entry.uuid = dfs_content.uuid "
+            "AND dfs_entry.checksum = dfs_content.checksum ) END "
+            "WHERE key IS NULL", NULL, NULL, NULL);
+    sqlite3_exec(sql, "CREATE INDEX IF NOT EXISTS dfs_content_key "
+            "ON dfs_content ( key )", NULL, NULL, NULL);
+
+    /* access history, forgetting files that are gone */
+    sqlite3_exec(sql, "CREATE TABLE IF NOT EXISTS dfs_access ( "
+            "uuid TEXT NOT NULL PRIMARY KEY, "
+            "opens INTEGER NOT NULL, "
+            "score REAL NOT NULL, "
+            "last REAL NOT NULL "
+            ")", NULL, NULL, NULL);
+    sqlite3_exec(sql, "CREATE TABLE IF NOT EXISTS dfs_coaccess ( "
+            "a TEXT NOT NULL, "
+            "b TEXT NOT NULL, "
+            "count INTEGER NOT NULL, "
+            "PRIMARY KEY ( a, b ) "
+            ")", NULL, NULL, NULL);
+    sqlite3_exec(sql, "DELETE FROM dfs_access WHERE uuid NOT IN "
+            "( SELECT uuid FROM dfs_entry WHERE uuid IS NOT NULL )",
+            NULL, NULL, NULL);
+    sqlite3_exec(sql, "DELETE FROM dfs_coaccess WHERE a NOT IN "
+            "( SELECT uuid FROM dfs_access ) OR b NOT IN "
+            "( SELECT uuid FROM dfs_access )", NULL, NULL, NULL);
+
     return 0;
 }
 
@@ -204,6 +287,134 @@ int dbcache_setup(void)
     sqlite3_prepare_v2(sql, "UPDATE dfs_entry SET uuid = ?, parent = ? "
         "WHERE id = ?", -1, &updbyid, NULL);
 
+    sqlite3_prepare_v2(sql, "UPDATE dfs_entry SET name = ?, size = ?, "
+        "mtime = ?, ctime = ?, checksum = ?, parent = ? "
+        "WHERE id = ?", -1, &updentry, NULL);
+
+    sqlite3_prepare_v2(sql, "WITH RECURSIVE tree ( id ) AS ( "
+        "SELECT id FROM dfs_entry WHERE uuid = ? "
+        "UNION ALL SELECT dfs_entry.id FROM dfs_entry, tree "
+        "WHERE dfs_entry.parent = tree.id ) "
+        "DELETE FROM dfs_entry WHERE id IN tree", -1, &delbyuuid, NULL);
+
+    /* content */
+    sqlite3_prepare_v2(sql, "SELECT checksum, revision, key FROM dfs_content "
+        "WHERE uuid = ?", -1, &selcontent, NULL);
+
+    sqlite3_prepare_v2(sql, "INSERT OR REPLACE INTO dfs_content ( uuid, "
+        "checksum, revision, key ) VALUES ( ?, ?, ?, ? )", -1, &updcontent,
+        NULL);
+
+    /* content of a subtree about to be removed */
+    sqlite3_prepare_v2(sql, "WITH RECURSIVE tree ( id ) AS ( "
+        "SELECT id FROM dfs_entry WHERE uuid = ?1 "
+        "UNION ALL SELECT dfs_entry.id FROM dfs_entry, tree "
+        "WHERE dfs_entry.parent = tree.id ) "
+        "SELECT DISTINCT key FROM dfs_content WHERE key IS NOT NULL AND "
+        "( uuid = ?1 OR uuid IN ( SELECT uuid FROM dfs_entry "
+        "WHERE id IN tree ) )", -1, &selgone, NULL);
+
+    sqlite3_prepare_v2(sql, "WITH RECURSIVE tree ( id ) AS ( "
+        "SELECT id FROM dfs_entry WHERE uuid = ?1 "
+        "UNION ALL SELECT dfs_entry.id FROM dfs_entry, tree "
+        "WHERE dfs_entry.parent = tree.id ) "
+        "DELETE FROM dfs_content WHERE uuid = ?1 OR uuid IN ( "
+        "SELECT uuid FROM dfs_entry WHERE id IN tree )", -1, &delcontent,
+        NULL);
+
+    sqlite3_prepare_v2(sql, "SELECT count(*) FROM dfs_content WHERE key = ?",
+        -1, &keyrefs, NULL);
+
+    /* files with a checksum, which is left empty if the cached content
+     * is out of date */
+    sqlite3_prepare_v2(sql, "SELECT dfs_entry.uuid, CASE WHEN "
+        DBCACHE_STALE "THEN '' ELSE dfs_entry.checksum END, "
+        "dfs_entry.size FROM dfs_entry LEFT JOIN dfs_content "
+        "ON dfs_content.uuid = dfs_entry.uuid "
+        "WHERE dfs_entry.type = 2 AND dfs_entry.uuid IS NOT NULL "
+        "AND ifnull(dfs_entry.checksum, '') != ''", -1, &selcached, NULL);
+
+    /* pinning */
+    sqlite3_prepare_v2(sql, "WITH RECURSIVE tree ( id ) AS ( "
+        "SELECT ? UNION ALL SELECT dfs_entry.id FROM dfs_entry, tree "
+        "WHERE dfs_entry.parent = tree.id ) "
+        "UPDATE dfs_entry SET pinned = ? WHERE id IN tree", -1, &pinsubtree,
+        NULL);
+
+    sqlite3_prepare_v2(sql, "UPDATE dfs_entry SET pinned = max(pinned, "
+        "( SELECT pinned FROM dfs_entry WHERE id = ? ) ) WHERE id = ?", -1,
+        &pininherit, NULL);
+
+    sqlite3_prepare_v2(sql, "SELECT pinned FROM dfs_entry WHERE uuid = ?", -1,
+        &pinbyuuid, NULL);
+
+    sqlite3_prepare_v2(sql, "WITH RECURSIVE tree ( id ) AS ( "
+        "SELECT ? UNION ALL SELECT dfs_entry.id FROM dfs_entry, tree "
+        "WHERE dfs_entry.parent = tree.id ) "
+        "SELECT dfs_entry.uuid, dfs_entry.checksum, dfs_entry.size "
+        "FROM dfs_entry LEFT JOIN dfs_content "
+        "ON dfs_content.uuid = dfs_entry.uuid "
+        "WHERE dfs_entry.id IN tree AND dfs_entry.type = 2 "
+        "AND dfs_entry.pinned AND dfs_entry.uuid IS NOT NULL "
+        "AND " DBCACHE_STALE, -1, &pinpending, NULL);
+
+    sqlite3_prepare_v2(sql, "WITH RECURSIVE tree ( id ) AS ( "
+        "SELECT ?1 UNION ALL SELECT dfs_entry.id FROM dfs_entry, tree "
+        "WHERE dfs_entry.parent = tree.id ) "
+        "SELECT ( SELECT pinned FROM dfs_entry WHERE id = ?1 ), "
+        "count(*), total(dfs_entry.size) "
+        "FROM dfs_entry LEFT JOIN dfs_content "
+        "ON dfs_content.uuid = dfs_entry.uuid "
+        "WHERE dfs_entry.id IN tree AND dfs_entry.type = 2 "
+        "AND dfs_entry.pinned AND dfs_entry.uuid IS NOT NULL "
+        "AND " DBCACHE_STALE, -1, &pinstatus, NULL);
+
+    /* access history */
+    sqlite3_prepare_v2(sql, "INSERT OR REPLACE INTO dfs_access ( uuid, "
+        "opens, score, last ) VALUES ( ?1, "
+        "ifnull( ( SELECT opens FROM dfs_access WHERE uuid = ?1 ), 0 ) + 1, "
+        "ifnull( ( SELECT " DBCACHE_SCORE "FROM dfs_access "
+        "WHERE uuid = ?1 ), 0 ) + 1, ?2 )", -1, &accput, NULL);
+
+    sqlite3_prepare_v2(sql, "INSERT OR IGNORE INTO dfs_coaccess ( a, b, "
+        "count ) VALUES ( ?, ?, 0 )", -1, &coput, NULL);
+
+    sqlite3_prepare_v2(sql, "UPDATE dfs_coaccess SET count = count + 1 "
+        "WHERE a = ? AND b = ?", -1, &coinc, NULL);
+
+    sqlite3_prepare_v2(sql, "SELECT dfs_entry.uuid, dfs_entry.checksum, "
+        "dfs_entry.size FROM dfs_access "
+        "JOIN dfs_entry ON dfs_entry.uuid = dfs_access.uuid "
+        "LEFT JOIN dfs_content ON dfs_content.uuid = dfs_entry.uuid "
+        "WHERE dfs_entry.type = 2 AND " DBCACHE_STALE
+        "ORDER BY " DBCACHE_SCORE "DESC LIMIT ?1", -1, &acctop, NULL);
+
+    sqlite3_prepare_v2(sql, "SELECT dfs_entry.uuid, dfs_entry.checksum, "
+        "dfs_entry.size FROM dfs_coaccess "
+        "JOIN dfs_entry ON dfs_entry.uuid = dfs_coaccess.b "
+        "LEFT JOIN dfs_content ON dfs_content.uuid = dfs_entry.uuid "
+        "WHERE dfs_coaccess.a = ?1 AND dfs_coaccess.count >= 2 "
+        "AND dfs_entry.type = 2 AND " DBCACHE_STALE
+        "ORDER BY dfs_coaccess.count DESC LIMIT ?2", -1, &accpeers, NULL);
+
+    sqlite3_prepare_v2(sql, "SELECT dfs_entry.uuid, dfs_entry.checksum, "
+        "dfs_entry.size FROM dfs_entry "
+        "JOIN dfs_access ON dfs_access.uuid = dfs_entry.uuid "
+        "LEFT JOIN dfs_content ON dfs_content.uuid = dfs_entry.uuid "
+        "WHERE dfs_entry.parent = ?3 AND dfs_entry.type = 2 "
+        "AND " DBCACHE_STALE
+        "ORDER BY " DBCACHE_SCORE "DESC LIMIT ?1", -1, &accdir, NULL);
+
+    /* sibling prefetch; checksum-less files would need a revision lookup
+     * each, they are left to be fetched on open */
+    sqlite3_prepare_v2(sql, "SELECT dfs_entry.uuid, dfs_entry.checksum, "
+        "dfs_entry.size FROM dfs_entry "
+        "LEFT JOIN dfs_content ON dfs_content.uuid = dfs_entry.uuid "
+        "WHERE dfs_entry.parent = ? AND dfs_entry.type = 2 "
+        "AND dfs_entry.size <= ? AND dfs_entry.uuid IS NOT NULL "
+        "AND ifnull(dfs_entry.checksum, '') != '' "
+        "AND " DBCACHE_STALE "LIMIT ?", -1, &dirsmall, NULL);
+
     /* entries */
     sqlite3_prepare_v2(sql, "SELECT uuid, type, size, mode, "
         "atime, mtime, ctime, sync, version, checksum, parent "
@@ -277,7 +488,10 @@ int dbcache_auth_load(char *token_type, size_t ttlen, char *access_token,
     int rc;
     const char *ctmp;
     int itmp;
+    int64_t t;
 
+    PROBE1(db_start, __func__);
+    t = stats_begin();
     pthread_mutex_lock(&dbcache_mutex);
 
     rc = sqlite3_reset(tselect);
@@ -299,6 +513,8 @@ int dbcache_auth_load(char *token_type, size_t ttlen, char *access_token,
     }
 
     pthread_mutex_unlock(&dbcache_mutex);
+    stats_end(STATS_DB_AUTH, t, rc < 0);
+    PROBE2(db_done, __func__, rc);
 
     return rc;
 }
@@ -309,7 +525,10 @@ int dbcache_auth_store(const char *token_type, const char *access_token,
 {
     int rc;
     int itmp;
+    int64_t t;
 
+    PROBE1(db_start, __func__);
+    t = stats_begin();
     pthread_mutex_lock(&dbcache_mutex);
 
     rc = sqlite3_reset(tupdate);
@@ -322,6 +541,8 @@ int dbcache_auth_store(const char *token_type, const char *access_token,
     rc = sqlite3_step(tupdate);
 
     pthread_mutex_unlock(&dbcache_mutex);
+    stats_end(STATS_DB_AUTH, t, SQLITE_DONE != rc);
+    PROBE2(db_done, __func__, rc);
 
     return SQLITE_DONE == rc ? 0 : -1;
 }
@@ -338,7 +559,10 @@ int dbcache_update(const char *uuid, const char *name, int isdir, int64_t size,
     int sync;
     int version;
     int64_t parentid;
+    int64_t t;
 
+    PROBE1(db_start, __func__);
+    t = stats_begin();
     pthread_mutex_lock(&dbcache_mutex);
 
     if(strlen(parent)) {
@@ -356,13 +580,28 @@ int dbcache_update(const char *uuid, const char *name, int isdir, int64_t size,
             if(SQLITE_ROW == rc) {
                 parentid = (int64_t)sqlite3_column_int64(selbyuuid, 0);
 
-                rc = sqlite3_reset(updbyid);
-                rc = sqlite3_bind_text(updbyid, 1, uuid, -1, NULL);
-                rc = sqlite3_bind_int64(updbyid, 2, (sqlite3_int64)parentid);
-                rc = sqlite3_bind_int64(updbyid, 3, (sqlite3_int64)id);
-                rc = sqlite3_step(updbyid);
+                /* metadata only, a rename or move leaves the checksum and
+                 * with it the cached content alone */
+                rc = sqlite3_reset(updentry);
+                rc = sqlite3_bind_text(updentry, 1, name, -1, NULL);
+                rc = sqlite3_bind_int64(updentry, 2, size);
+                ts2r(&dmtime, mtime);
+                rc = sqlite3_bind_double(updentry, 3, dmtime);
+                ts2r(&dctime, ctime);
+                rc = sqlite3_bind_double(updentry, 4, dctime);
+                if(cksum && strlen(cksum)) {
+                    rc = sqlite3_bind_text(updentry, 5, cksum, -1, NULL);
+                } else {
+                    rc = sqlite3_bind_null(updentry, 5);
+                }
+                rc = sqlite3_bind_int64(updentry, 6, (sqlite3_int64)parentid);
+                rc = sqlite3_bind_int64(updentry, 7, (sqlite3_int64)id);
+                rc = sqlite3_step(updentry);
 
                 rc = (SQLITE_DONE == rc) ? 0 : -1;
+                if(0 == rc) {
+                    dbcache_pin_inherit(id, parentid);
+                }
             } else {
                 rc = -1;
             }
@@ -398,6 +637,10 @@ int dbcache_update(const char *uuid, const char *name, int isdir, int64_t size,
                 rc = sqlite3_step(insertentry);
 
                 rc = (SQLITE_DONE == rc) ? 0 : -1;
+                if(0 == rc) {
+                    id = (int64_t)sqlite3_last_insert_rowid(sql);
+                    dbcache_pin_inherit(id, parentid);
+                }
             } else {
                 rc = -1;
             }
@@ -416,10 +659,445 @@ int dbcache_update(const char *uuid, const char *name, int isdir, int64_t size,
     }
 
     pthread_mutex_unlock(&dbcache_mutex);
+    stats_end(STATS_DB_UPDATE, t, rc < 0);
+    PROBE2(db_done, __func__, rc);
+
+    return rc;
+}
+
+int dbcache_remove(const char *uuid, dbcache_key_cb_t *cb)
+{
+    int rc;
+    char (*keys)[DBCACHE_KEY_MAX + 1];
+    char (*grown)[DBCACHE_KEY_MAX + 1];
+    const char *key;
+    int nkeys;
+    int cap;
+    int i;
+    int64_t t;
+
+    PROBE1(db_start, __func__);
+    t = stats_begin();
+    pthread_mutex_lock(&dbcache_mutex);
+
+    /* keys of the content going away, removed with the entries */
+    keys = NULL;
+    nkeys = 0;
+    cap = 0;
+    sqlite3_reset(selgone);
+    sqlite3_bind_text(selgone, 1, uuid, -1, NULL);
+    while(SQLITE_ROW == sqlite3_step(selgone)) {
+        key = (const char *)sqlite3_column_text(selgone, 0);
+        if(nkeys >= cap) {
+            grown = realloc(keys, (cap ? 2 * cap : 16) *
+                    sizeof(keys[0]));
+            if(NULL == grown) {
+                break;
+            }
+            keys = grown;
+            cap = cap ? 2 * cap : 16;
+        }
+        memset(keys[nkeys], 0, sizeof(keys[0]));
+        strncpy(keys[nkeys], key, DBCACHE_KEY_MAX);
+        nkeys++;
+    }
+    sqlite3_reset(selgone);
+
+    sqlite3_reset(delcontent);
+    sqlite3_bind_text(delcontent, 1, uuid, -1, NULL);
+    sqlite3_step(delcontent);
+
+    rc = sqlite3_reset(delbyuuid);
+    rc = sqlite3_bind_text(delbyuuid, 1, uuid, -1, NULL);
+    rc = sqlite3_step(delbyuuid);
+    rc = (SQLITE_DONE == rc) ? 0 : -1;
+
+    /* objects still shared with other files stay */
+    for(i = 0; i < nkeys; i++) {
+        if(cb && (0 == dbcache_key_refs(keys[i]))) {
+            cb(keys[i]);
+        }
+    }
+    free(keys);
+
+    pthread_mutex_unlock(&dbcache_mutex);
+    stats_end(STATS_DB_REMOVE, t, rc < 0);
+    PROBE2(db_done, __func__, rc);
+
+    return rc;
+}
+
+int dbcache_content_load(const char *uuid, char *cksum, size_t clen,
+        char *revision, size_t rlen)
+{
+    int rc;
+    const char *cptr;
+    int64_t t;
+
+    PROBE1(db_start, __func__);
+    t = stats_begin();
+    pthread_mutex_lock(&dbcache_mutex);
+
+    memset(cksum, 0, (clen + 1) * sizeof(char));
+    memset(revision, 0, (rlen + 1) * sizeof(char));
+    rc = sqlite3_reset(selcontent);
+    rc = sqlite3_bind_text(selcontent, 1, uuid, -1, NULL);
+    rc = sqlite3_step(selcontent);
+    if(SQLITE_ROW == rc) {
+        cptr = (const char *)sqlite3_column_text(selcontent, 0);
+        if(cptr) {
+            strncpy(cksum, cptr, clen);
+        }
+        cptr = (const char *)sqlite3_column_text(selcontent, 1);
+        if(cptr) {
+            strncpy(revision, cptr, rlen);
+        }
+        rc = 0;
+    } else {
+        rc = -ENOENT;
+    }
+
+    pthread_mutex_unlock(&dbcache_mutex);
+    stats_end(STATS_DB_CONTENT, t, rc < 0);
+    PROBE2(db_done, __func__, rc);
+
+    return rc;
+}
+
+int dbcache_content_store(const char *uuid, const char *cksum,
+        const char *revision, const char *key, dbcache_key_cb_t *cb)
+{
+    int rc;
+    char old[DBCACHE_KEY_MAX + 1];
+    const char *cptr;
+    int64_t t;
+
+    PROBE1(db_start, __func__);
+    t = stats_begin();
+    pthread_mutex_lock(&dbcache_mutex);
+
+    memset(old, 0, (DBCACHE_KEY_MAX + 1) * sizeof(char));
+    rc = sqlite3_reset(selcontent);
+    rc = sqlite3_bind_text(selcontent, 1, uuid, -1, NULL);
+    if(SQLITE_ROW == sqlite3_step(selcontent)) {
+        cptr = (const char *)sqlite3_column_text(selcontent, 2);
+        if(cptr) {
+            strncpy(old, cptr, DBCACHE_KEY_MAX);
+        }
+    }
+    sqlite3_reset(selcontent);
+
+    rc = sqlite3_reset(updcontent);
+    rc = sqlite3_bind_text(updcontent, 1, uuid, -1, NULL);
+    rc = sqlite3_bind_text(updcontent, 2, cksum, -1, NULL);
+    rc = sqlite3_bind_text(updcontent, 3, revision, -1, NULL);
+    rc = sqlite3_bind_text(updcontent, 4, key, -1, NULL);
+    rc = sqlite3_step(updcontent);
+
+    /* the object superseded by this one goes unless another file still
+     * has it */
+    if((SQLITE_DONE == rc) && cb && strlen(old) && strcmp(old, key) &&
+            (0 == dbcache_key_refs(old))) {
+        cb(old);
+    }
+
+    pthread_mutex_unlock(&dbcache_mutex);
+    stats_end(STATS_DB_CONTENT, t, SQLITE_DONE != rc);
+    PROBE2(db_done, __func__, rc);
+
+    return (SQLITE_DONE == rc) ? 0 : -1;
+}
+
+int dbcache_content_cached(dbcache_fetch_cb_t *cb)
+{
+    int rc;
+    int64_t t;
+
+    PROBE1(db_start, __func__);
+    t = stats_begin();
+    pthread_mutex_lock(&dbcache_mutex);
+
+    rc = dbcache_fetch_rows(selcached, cb);
+
+    pthread_mutex_unlock(&dbcache_mutex);
+    stats_end(STATS_DB_CONTENT, t, rc < 0);
+    PROBE2(db_done, __func__, rc);
+
+    return rc;
+}
+
+int dbcache_pin(int64_t id, int pinned)
+{
+    int rc;
+    int64_t t;
+
+    PROBE1(db_start, __func__);
+    t = stats_begin();
+    pthread_mutex_lock(&dbcache_mutex);
+
+    rc = sqlite3_reset(pinsubtree);
+    rc = sqlite3_bind_int64(pinsubtree, 1, (sqlite3_int64)id);
+    rc = sqlite3_bind_int(pinsubtree, 2, pinned ? 1 : 0);
+    rc = sqlite3_step(pinsubtree);
+
+    pthread_mutex_unlock(&dbcache_mutex);
+    stats_end(STATS_DB_PIN, t, SQLITE_DONE != rc);
+    PROBE2(db_done, __func__, rc);
+
+    return (SQLITE_DONE == rc) ? 0 : -1;
+}
+
+int dbcache_pinned(const char *uuid)
+{
+    int rc;
+    int64_t t;
+
+    PROBE1(db_start, __func__);
+    t = stats_begin();
+    pthread_mutex_lock(&dbcache_mutex);
+
+    rc = sqlite3_reset(pinbyuuid);
+    rc = sqlite3_bind_text(pinbyuuid, 1, uuid, -1, NULL);
+    rc = sqlite3_step(pinbyuuid);
+    if(SQLITE_ROW == rc) {
+        rc = sqlite3_column_int(pinbyuuid, 0);
+    } else {
+        rc = 0;
+    }
+
+    pthread_mutex_unlock(&dbcache_mutex);
+    stats_end(STATS_DB_PIN, t, rc < 0);
+    PROBE2(db_done, __func__, rc);
 
     return rc;
 }
 
+int dbcache_pin_pending(int64_t id, dbcache_fetch_cb_t *cb)
+{
+    int rc;
+    int64_t t;
+
+    PROBE1(db_start, __func__);
+    t = stats_begin();
+    pthread_mutex_lock(&dbcache_mutex);
+
+    rc = sqlite3_reset(pinpending);
+    rc = sqlite3_bind_int64(pinpending, 1, (sqlite3_int64)id);
+    rc = dbcache_fetch_rows(pinpending, cb);
+
+    pthread_mutex_unlock(&dbcache_mutex);
+    stats_end(STATS_DB_PIN, t, rc < 0);
+    PROBE2(db_done, __func__, rc);
+
+    return rc;
+}
+
+int dbcache_pin_status(int64_t id, int *pinned, int64_t *files,
+        int64_t *bytes)
+{
+    int rc;
+    int64_t t;
+
+    PROBE1(db_start, __func__);
+    t = stats_begin();
+    pthread_mutex_lock(&dbcache_mutex);
+
+    rc = sqlite3_reset(pinstatus);
+    rc = sqlite3_bind_int64(pinstatus, 1, (sqlite3_int64)id);
+    rc = sqlite3_step(pinstatus);
+    if(SQLITE_ROW == rc) {
+        *pinned = sqlite3_column_int(pinstatus, 0);
+        *files = (int64_t)sqlite3_column_int64(pinstatus, 1);
+        *bytes = (int64_t)sqlite3_column_double(pinstatus, 2);
+        rc = 0;
+    } else {
+        rc = -1;
+    }
+
+    pthread_mutex_unlock(&dbcache_mutex);
+    stats_end(STATS_DB_PIN, t, rc < 0);
+    PROBE2(db_done, __func__, rc);
+
+    return rc;
+}
+
+int dbcache_access_record(const char *uuid, const char **peers, int npeers,
+        time_t now)
+{
+    int rc;
+    int i;
+    int64_t t;
+
+    PROBE1(db_start, __func__);
+    t = stats_begin();
+    pthread_mutex_lock(&dbcache_mutex);
+
+    sqlite3_exec(sql, "BEGIN", NULL, NULL, NULL);
+    rc = sqlite3_reset(accput);
+    rc = sqlite3_bind_text(accput, 1, uuid, -1, NULL);
+    rc = sqlite3_bind_double(accput, 2, (double)now);
+    rc = sqlite3_step(accput);
+    rc = (SQLITE_DONE == rc) ? 0 : -1;
+
+    /* both ways, either one may be opened first next time */
+    for(i = 0; i < 2 * npeers; i++) {
+        sqlite3_reset(coput);
+        sqlite3_bind_text(coput, 1 + i % 2, uuid, -1, NULL);
+        sqlite3_bind_text(coput, 2 - i % 2, peers[i / 2], -1, NULL);
+        sqlite3_step(coput);
+        sqlite3_reset(coinc);
+        sqlite3_bind_text(coinc, 1 + i % 2, uuid, -1, NULL);
+        sqlite3_bind_text(coinc, 2 - i % 2, peers[i / 2], -1, NULL);
+        sqlite3_step(coinc);
+    }
+    sqlite3_exec(sql, "COMMIT", NULL, NULL, NULL);
+
+    pthread_mutex_unlock(&dbcache_mutex);
+    stats_end(STATS_DB_ACCESS, t, rc < 0);
+    PROBE2(db_done, __func__, rc);
+
+    return rc;
+}
+
+int dbcache_access_top(int limit, time_t now, dbcache_fetch_cb_t *cb)
+{
+    int rc;
+    int64_t t;
+
+    PROBE1(db_start, __func__);
+    t = stats_begin();
+    pthread_mutex_lock(&dbcache_mutex);
+
+    rc = sqlite3_reset(acctop);
+    rc = sqlite3_bind_int(acctop, 1, limit);
+    rc = sqlite3_bind_double(acctop, 2, (double)now);
+    rc = dbcache_fetch_rows(acctop, cb);
+
+    pthread_mutex_unlock(&dbcache_mutex);
+    stats_end(STATS_DB_ACCESS, t, rc < 0);
+    PROBE2(db_done, __func__, rc);
+
+    return rc;
+}
+
+int dbcache_access_peers(const char *uuid, int limit, dbcache_fetch_cb_t *cb)
+{
+    int rc;
+    int64_t t;
+
+    PROBE1(db_start, __func__);
+    t = stats_begin();
+    pthread_mutex_lock(&dbcache_mutex);
+
+    rc = sqlite3_reset(accpeers);
+    rc = sqlite3_bind_text(accpeers, 1, uuid, -1, NULL);
+    rc = sqlite3_bind_int(accpeers, 2, limit);
+    rc = dbcache_fetch_rows(accpeers, cb);
+
+    pthread_mutex_unlock(&dbcache_mutex);
+    stats_end(STATS_DB_ACCESS, t, rc < 0);
+    PROBE2(db_done, __func__, rc);
+
+    return rc;
+}
+
+int dbcache_access_dir(int64_t dir, int limit, time_t now,
+        dbcache_fetch_cb_t *cb)
+{
+    int rc;
+    int64_t t;
+
+    PROBE1(db_start, __func__);
+    t = stats_begin();
+    pthread_mutex_lock(&dbcache_mutex);
+
+    rc = sqlite3_reset(accdir);
+    rc = sqlite3_bind_int(accdir, 1, limit);
+    rc = sqlite3_bind_double(accdir, 2, (double)now);
+    rc = sqlite3_bind_int64(accdir, 3, (sqlite3_int64)dir);
+    rc = dbcache_fetch_rows(accdir, cb);
+
+    pthread_mutex_unlock(&dbcache_mutex);
+    stats_end(STATS_DB_ACCESS, t, rc < 0);
+    PROBE2(db_done, __func__, rc);
+
+    return rc;
+}
+
+int dbcache_dir_small(int64_t dir, int64_t maxsize, int limit,
+        dbcache_fetch_cb_t *cb)
+{
+    int rc;
+    int64_t t;
+
+    PROBE1(db_start, __func__);
+    t = stats_begin();
+    pthread_mutex_lock(&dbcache_mutex);
+
+    rc = sqlite3_reset(dirsmall);
+    rc = sqlite3_bind_int64(dirsmall, 1, (sqlite3_int64)dir);
+    rc = sqlite3_bind_int64(dirsmall, 2, (sqlite3_int64)maxsize);
+    rc = sqlite3_bind_int(dirsmall, 3, limit);
+    rc = dbcache_fetch_rows(dirsmall, cb);
+
+    pthread_mutex_unlock(&dbcache_mutex);
+    stats_end(STATS_DB_ACCESS, t, rc < 0);
+    PROBE2(db_done, __func__, rc);
+
+    return rc;
+}
+
+static int dbcache_key_refs(const char *key)
+{
+    int rc;
+
+    /* called with dbcache_mutex held */
+    rc = -1;
+    sqlite3_reset(keyrefs);
+    sqlite3_bind_text(keyrefs, 1, key, -1, NULL);
+    if(SQLITE_ROW == sqlite3_step(keyrefs)) {
+        rc = sqlite3_column_int(keyrefs, 0);
+    }
+    sqlite3_reset(keyrefs);
+    return rc;
+}
+
+static int dbcache_fetch_rows(sqlite3_stmt *stmt, dbcache_fetch_cb_t *cb)
+{
+    int rc;
+    const char *uuid;
+    const char *checksum;
+    int64_t size;
+
+    /* called with dbcache_mutex held, a non-zero callback stops early */
+    for(;;) {
+        rc = sqlite3_step(stmt);
+        if(rc != SQLITE_ROW) {
+            break;
+        }
+        uuid = (const char *)sqlite3_column_text(stmt, 0);
+        checksum = (const char *)sqlite3_column_text(stmt, 1);
+        size = (int64_t)sqlite3_column_int64(stmt, 2);
+        if(cb(uuid, checksum ? checksum : "", size) != 0) {
+            rc = SQLITE_DONE;
+            break;
+        }
+    }
+    sqlite3_reset(stmt);
+
+    return (SQLITE_DONE == rc) ? 0 : -1;
+}
+
+static void dbcache_pin_inherit(int64_t id, int64_t parent)
+{
+    /* entries showing up in, or moving to, a pinned directory are pinned
+     * too; called with dbcache_mutex held */
+    sqlite3_reset(pininherit);
+    sqlite3_bind_int64(pininherit, 1, (sqlite3_int64)parent);
+    sqlite3_bind_int64(pininherit, 2, (sqlite3_int64)id);
+    sqlite3_step(pininherit);
+}
+
 int dbcache_mkdir(const char *cpath, mode_t mode, dbcache_cb_t *cb)
 {
     char path[PATH_MAX + 1];
@@ -434,7 +1112,10 @@ int dbcache_mkdir(const char *cpath, mode_t mode, dbcache_cb_t *cb)
     int sync;
     int version;
     int64_t parent;
+    int64_t t;
 
+    PROBE1(db_start, __func__);
+    t = stats_begin();
     memset(path, 0, (PATH_MAX + 1) * sizeof(char));
     strncpy(path, cpath, PATH_MAX);
     pbegin = path;
@@ -468,7 +1149,8 @@ int dbcache_mkdir(const char *cpath, mode_t mode, dbcache_cb_t *cb)
             rc = sqlite3_bind_int64(insertentry, 12, parent);
             rc = sqlite3_step(insertentry);
             if(rc != SQLITE_DONE) {
-                return -EIO;
+                rc = -EIO;
+                break;
             }
             id = (int64_t)sqlite3_last_insert_rowid(sql);
 
@@ -482,10 +1164,13 @@ int dbcache_mkdir(const char *cpath, mode_t mode, dbcache_cb_t *cb)
         rc = sqlite3_bind_int64(selbynampar, 2, parent);
         rc = sqlite3_step(selbynampar);
         if(rc != SQLITE_ROW) {
-            return -ENOENT;
+            rc = -ENOENT;
+            break;
         }
         parent = sqlite3_column_int64(selbynampar, 12);
     }
+    stats_end(STATS_DB_DIR, t, rc < 0);
+    PROBE2(db_done, __func__, rc);
     return rc;
 }
 
@@ -504,7 +1189,10 @@ int dbcache_rmdir(const char *cpath, dbcache_cb_t *cb)
     struct timespec atime, mtime, ctime;
     const char *checksum;
     int64_t parent;
+    int64_t t;
 
+    PROBE1(db_start, __func__);
+    t = stats_begin();
     memset(path, 0, (PATH_MAX + 1) * sizeof(char));
     strncpy(path, cpath, PATH_MAX);
     pbegin = path;
@@ -521,7 +1209,8 @@ int dbcache_rmdir(const char *cpath, dbcache_cb_t *cb)
         rc = sqlite3_bind_int64(selbynampar, 2, parent);
         rc = sqlite3_step(selbynampar);
         if(rc != SQLITE_ROW) {
-            return -ENOENT;
+            rc = -ENOENT;
+            break;
         }
         parent = sqlite3_column_int64(selbynampar, 11);
         if(!pend) {
@@ -558,6 +1247,8 @@ int dbcache_rmdir(const char *cpath, dbcache_cb_t *cb)
             break;
         }
     }
+    stats_end(STATS_DB_DIR, t, rc < 0);
+    PROBE2(db_done, __func__, rc);
     return rc;
 }
 
@@ -664,7 +1355,10 @@ int dbcache_findbypath(const char *cpath, dbcache_cb_t *cb)
     struct timespec atime, mtime, ctime;
     const char *checksum;
     int64_t parent;
+    int64_t t;
 
+    PROBE1(db_start, __func__);
+    t = stats_begin();
     pthread_mutex_lock(&dbcache_mutex);
 
     if(0 == strcmp(cpath, "/")) {
@@ -737,6 +1431,8 @@ int dbcache_findbypath(const char *cpath, dbcache_cb_t *cb)
         }
     }
     pthread_mutex_unlock(&dbcache_mutex);
+    stats_end(STATS_DB_FINDBYPATH, t, rc < 0);
+    PROBE2(db_done, __func__, rc);
     return rc;
 }
 
@@ -800,7 +1496,10 @@ int dbcache_listdir(const char *cpath, dbcache_cb_t *cb)
     struct timespec atime, mtime, ctime;
     const char *checksum;
     int64_t parent;
+    int64_t t;
 
+    PROBE1(db_start, __func__);
+    t = stats_begin();
     pthread_mutex_lock(&dbcache_mutex);
 
     memset(path, 0, (PATH_MAX + 1) * sizeof(char));
@@ -874,6 +1573,8 @@ int dbcache_listdir(const char *cpath, dbcache_cb_t *cb)
     }
 
     pthread_mutex_unlock(&dbcache_mutex);
+    stats_end(STATS_DB_LISTDIR, t, rc < 0);
+    PROBE2(db_done, __func__, rc);
 
     return rc;
 }
@@ -1086,7 +1787,10 @@ int dbcache_change_load(char *changeid, size_t len)
 {
     int rc;
     const char *cptr;
+    int64_t t;
 
+    PROBE1(db_start, __func__);
+    t = stats_begin();
     rc = -1;
     if(changeid) {
         rc = sqlite3_reset(selchange);
@@ -1100,6 +1804,8 @@ int dbcache_change_load(char *changeid, size_t len)
             rc = -1;
         }
     }
+    stats_end(STATS_DB_CHANGE, t, rc < 0);
+    PROBE2(db_done, __func__, rc);
 
     return rc;
 }
@@ -1107,10 +1813,15 @@ int dbcache_change_load(char *changeid, size_t len)
 int dbcache_change_store(const char *changeid)
 {
     int rc;
+    int64_t t;
 
+    PROBE1(db_start, __func__);
+    t = stats_begin();
     rc = sqlite3_reset(updchange);
     rc = sqlite3_bind_text(updchange, 1, changeid, -1, NULL);
     rc = sqlite3_step(updchange);
+    stats_end(STATS_DB_CHANGE, t, SQLITE_DONE != rc);
+    PROBE2(db_done, __func__, rc);
     return (SQLITE_ROW == rc) ? 0 : -1;
 }
 
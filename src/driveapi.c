@@ -15,7 +15,9 @@ along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "driveapi.h"
 
+#include <errno.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -27,7 +29,11 @@ along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
 #include <json.h>
 
 #include "dbcache.h"
+#include "fetch.h"
 #include "log.h"
+#include "probes.h"
+#include "stats.h"
+#include "xfer.h"
 
 #define TOKENTYPE_MAX   31
 static char token_type[TOKENTYPE_MAX + 1];
@@ -44,13 +50,89 @@ static int refresh_tokens(void);
 static int get_start_token(char *, size_t);
 static int get_changes(char *, size_t, int *);
 
+#define BASEURL_MAX     255
+#define DRIVE_API_URL   "https://www.googleapis.com/drive/v3"
+#define DRIVE_OAUTH_URL "https://accounts.google.com/o/oauth2"
+static char api_url[BASEURL_MAX + 1] = DRIVE_API_URL;
+static char oauth_url[BASEURL_MAX + 1] = DRIVE_OAUTH_URL;
+
 static pthread_t drive_thread;
 
+/* requests slower than this many ms get logged, 0 for none */
+#define DRIVE_SLOW_MS       2000L
+static long slow_ms = DRIVE_SLOW_MS;
+
+static pthread_mutex_t timing_mutex = PTHREAD_MUTEX_INITIALIZER;
+static drive_timing_t timing[DRIVE_REQS];
+static const char *timing_names[DRIVE_REQS] = {
+    "token", "list", "metadata", "media", "changes", "other"
+};
+
 static int keep_running;
 static void *drive_run(void *);
 
-static pthread_mutex_t auth_mutex;
-static struct curl_slist *auth_chunk;
+/* credentials are published as immutable snapshots: requests pin the
+ * current one with a reference, the auth thread swaps in a new one and
+ * frees retired ones once unreferenced and past a grace period that covers
+ * a reader caught between loading the pointer and taking its reference */
+struct _drive_auth
+{
+    struct curl_slist *chunk;
+    int refs;
+    time_t retired;
+    struct _drive_auth *next;
+};
+typedef struct _drive_auth drive_auth_t;
+
+#define DRIVE_AUTH_AHEAD    120
+#define DRIVE_AUTH_RETRY    30
+#define DRIVE_AUTH_GRACE    10
+
+static drive_auth_t *auth_current;
+static drive_auth_t *auth_retired;
+
+static pthread_t auth_thread;
+static pthread_mutex_t auth_timer_mutex;
+static pthread_cond_t auth_timer_cond;
+static int auth_kick;
+
+static void *auth_run(void *);
+static int auth_publish(void);
+static void auth_reap(int);
+static drive_auth_t *auth_get(void);
+static void auth_put(drive_auth_t *);
+static void auth_refresh_soon(void);
+
+#define FILEURL_MAX     511
+#define DRIVE_BATCH_CONNS   4
+#define DUUID_MAX       63
+#define DNAME_MAX       255
+#define DCKSUM_MAX      63
+#define DREV_MAX        127
+
+#define DRIVE_FILE_FIELDS   "id,name,mimeType,size,modifiedTime,createdTime," \
+                            "md5Checksum,headRevisionId,trashed,parents"
+
+struct _drive_file
+{
+    char uuid[DUUID_MAX + 1];
+    char name[DNAME_MAX + 1];
+    int isdir;
+    int exclude;
+    int trashed;
+    int64_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    char cksum[DCKSUM_MAX + 1];
+    char revision[DREV_MAX + 1];
+    char parent[DUUID_MAX + 1];
+};
+typedef struct _drive_file drive_file_t;
+
+static void parse_time(struct timespec *, const char *);
+static void parse_file(json_object *, drive_file_t *);
+static void apply_change(json_object *);
+static void refresh_content(const drive_file_t *);
 
 struct _json_context
 {
@@ -58,8 +140,76 @@ struct _json_context
     json_object **pointer;
 };
 typedef struct _json_context json_context_t;
+
+#define DERROR_MAX          511
+#define DRIVE_RETRIES       6
+#define DRIVE_BACKOFF_MIN   500L
+#define DRIVE_BACKOFF_MAX   32000L
+
+typedef size_t (drive_write_t)(void *, size_t, size_t, void *);
+
+struct _drive_call
+{
+    CURL *curl;
+    int cls;
+    const int *boost;
+    drive_write_t *write;
+    void *data;
+    long status;
+    size_t delivered;
+    char error[DERROR_MAX + 1];
+    size_t errlen;
+    unsigned int seed;
+    int authed;
+};
+typedef struct _drive_call drive_call_t;
+
+static CURLcode drive_perform(CURL *, int, const int *, drive_write_t *,
+        void *);
+static CURLcode drive_request(CURL *, int, const int *, drive_write_t *,
+        void *, int);
+static size_t drive_write(void *, size_t, size_t, void *);
+static long drive_retry(drive_call_t *, CURLcode, int);
+static void drive_timed(CURL *, int, CURLcode, long);
+static int drive_progress(void *, curl_off_t, curl_off_t, curl_off_t,
+        curl_off_t);
 size_t parse_json(void *, size_t, size_t, void *);
 
+void drive_endpoints(const char *api, const char *oauth)
+{
+    /* lets the daemon talk to a stand-in server instead of google */
+    if(api && (strlen(api) > 0)) {
+        memset(api_url, 0, (BASEURL_MAX + 1) * sizeof(char));
+        strncpy(api_url, api, BASEURL_MAX);
+    }
+    if(oauth && (strlen(oauth) > 0)) {
+        memset(oauth_url, 0, (BASEURL_MAX + 1) * sizeof(char));
+        strncpy(oauth_url, oauth, BASEURL_MAX);
+    }
+}
+
+void drive_slowlog(long ms)
+{
+    slow_ms = ms;
+}
+
+int drive_timing(drive_timing_t *out)
+{
+    pthread_mutex_lock(&timing_mutex);
+    memcpy(out, timing, DRIVE_REQS * sizeof(drive_timing_t));
+    pthread_mutex_unlock(&timing_mutex);
+
+    return 0;
+}
+
+const char *drive_req_name(int kind)
+{
+    if((kind < 0) || (kind >= DRIVE_REQS)) {
+        return "unknown";
+    }
+    return timing_names[kind];
+}
+
 int drive_setup(void)
 {
 #define DATA_MAX    511
@@ -71,13 +221,14 @@ int drive_setup(void)
 
     memset(data, 0, (DATA_MAX + 1) * sizeof(char));
     snprintf(data, DATA_MAX,
-            "https://accounts.google.com/o/oauth2/auth?"
+            "%s/auth?"
             "client_id=429614641440-42ueklua1v9vnhpacs5ml9h68hh6bv1c."
             "apps.googleusercontent.com&"
             "response_type=code&"
             "redirect_uri=urn:ietf:wg:oauth:2.0:oob&"
             "access_type=offline&"
-            "scope=https%%3A%%2F%%2Fwww.googleapis.com%%2Fauth%%2Fdrive");
+            "scope=https%%3A%%2F%%2Fwww.googleapis.com%%2Fauth%%2Fdrive",
+            oauth_url);
 
     printf("open a browser and go here: %s\n", data);
 
@@ -113,12 +264,31 @@ int drive_setup(void)
 
 int drive_start(void)
 {
-    auth_chunk = NULL;
+    time_t now;
+
+    auth_current = NULL;
+    auth_retired = NULL;
+    auth_kick = 0;
     curl_global_init(CURL_GLOBAL_ALL);
 
-    pthread_mutex_init(&auth_mutex, NULL);
+    pthread_mutex_init(&auth_timer_mutex, NULL);
+    pthread_cond_init(&auth_timer_cond, NULL);
+
+    /* the first snapshot is in place before any request can be issued */
+    dbcache_auth_load(token_type, TOKENTYPE_MAX, access_token, TOKEN_MAX,
+            refresh_token, TOKEN_MAX, &expires_in, &expiration_time);
+    time(&now);
+    if(now + DRIVE_AUTH_AHEAD >= expiration_time) {
+        refresh_tokens();
+        if(expires_in > 0) {
+            dbcache_auth_store(token_type, access_token, refresh_token,
+                    expires_in, &expiration_time);
+        }
+    }
+    auth_publish();
 
     keep_running = 1;
+    pthread_create(&auth_thread, NULL, auth_run, NULL);
     pthread_create(&drive_thread, NULL, drive_run, NULL);
 
     return 0;
@@ -126,21 +296,505 @@ int drive_start(void)
 
 int drive_stop(void)
 {
+    drive_auth_t *auth;
+
     keep_running = 0;
+    pthread_mutex_lock(&auth_timer_mutex);
+    pthread_cond_broadcast(&auth_timer_cond);
+    pthread_mutex_unlock(&auth_timer_mutex);
     pthread_join(drive_thread, NULL);
+    pthread_join(auth_thread, NULL);
+
+    /* no request is left in flight */
+    auth = __atomic_exchange_n(&auth_current, NULL, __ATOMIC_ACQ_REL);
+    if(auth) {
+        curl_slist_free_all(auth->chunk);
+        free(auth);
+    }
+    auth_reap(1);
 
-    pthread_mutex_destroy(&auth_mutex);
+    pthread_cond_destroy(&auth_timer_cond);
+    pthread_mutex_destroy(&auth_timer_mutex);
 
     curl_global_cleanup();
 
     return 0;
 }
 
-int drive_download(const char *id, FILE *f)
+static int auth_publish(void)
+{
+#define AUTH_MAX    1023
+    char header[AUTH_MAX + 1];
+    drive_auth_t *auth;
+    drive_auth_t *old;
+
+    if(0 == strlen(access_token)) {
+        return -EINVAL;
+    }
+    auth = malloc(sizeof(drive_auth_t));
+    if(NULL == auth) {
+        return -ENOMEM;
+    }
+    memset(auth, 0, sizeof(drive_auth_t));
+    memset(header, 0, (AUTH_MAX + 1) * sizeof(char));
+    snprintf(header, AUTH_MAX, "Authorization: %s %s", token_type,
+            access_token);
+    auth->chunk = curl_slist_append(NULL, header);
+    if(NULL == auth->chunk) {
+        free(auth);
+        return -ENOMEM;
+    }
+
+    old = __atomic_exchange_n(&auth_current, auth, __ATOMIC_ACQ_REL);
+    if(old) {
+        /* only the auth thread (or startup) publishes, so the retired
+         * list needs no lock */
+        time(&old->retired);
+        old->next = auth_retired;
+        auth_retired = old;
+    }
+    return 0;
+}
+
+static void auth_reap(int all)
+{
+    drive_auth_t **link;
+    drive_auth_t *auth;
+    time_t now;
+
+    time(&now);
+    link = &auth_retired;
+    while((auth = *link)) {
+        if(all || ((0 == __atomic_load_n(&auth->refs, __ATOMIC_ACQUIRE)) &&
+                    (now - auth->retired >= DRIVE_AUTH_GRACE))) {
+            *link = auth->next;
+            curl_slist_free_all(auth->chunk);
+            free(auth);
+        } else {
+            link = &auth->next;
+        }
+    }
+}
+
+static drive_auth_t *auth_get(void)
+{
+    drive_auth_t *auth;
+
+    for(;;) {
+        auth = __atomic_load_n(&auth_current, __ATOMIC_ACQUIRE);
+        if(NULL == auth) {
+            return NULL;
+        }
+        __atomic_add_fetch(&auth->refs, 1, __ATOMIC_ACQ_REL);
+        /* still current: the reference was taken before it could retire */
+        if(__atomic_load_n(&auth_current, __ATOMIC_ACQUIRE) == auth) {
+            return auth;
+        }
+        __atomic_sub_fetch(&auth->refs, 1, __ATOMIC_ACQ_REL);
+    }
+}
+
+static void auth_put(drive_auth_t *auth)
+{
+    if(auth) {
+        __atomic_sub_fetch(&auth->refs, 1, __ATOMIC_ACQ_REL);
+    }
+}
+
+static void auth_refresh_soon(void)
+{
+    pthread_mutex_lock(&auth_timer_mutex);
+    auth_kick = 1;
+    pthread_cond_broadcast(&auth_timer_cond);
+    pthread_mutex_unlock(&auth_timer_mutex);
+}
+
+static void *auth_run(void *opaque)
+{
+    struct timespec wake;
+    time_t due;
+    time_t now;
+    time_t tried;
+    int kicked;
+
+    (void)opaque;
+
+    tried = 0;
+    due = expiration_time - DRIVE_AUTH_AHEAD;
+    while(keep_running) {
+        /* sleep until the token is about to expire, a request saw it
+         * rejected, or shutdown; readers never wait on any of this */
+        memset(&wake, 0, sizeof(struct timespec));
+        wake.tv_sec = due;
+        pthread_mutex_lock(&auth_timer_mutex);
+        while(keep_running && !auth_kick && (time(NULL) < due)) {
+            if(auth_retired) {
+                /* come back to reap retired snapshots */
+                clock_gettime(CLOCK_REALTIME, &wake);
+                wake.tv_sec += DRIVE_AUTH_GRACE;
+                if(wake.tv_sec > due) {
+                    wake.tv_sec = due;
+                }
+            }
+            if(ETIMEDOUT == pthread_cond_timedwait(&auth_timer_cond,
+                        &auth_timer_mutex, &wake)) {
+                break;
+            }
+        }
+        kicked = auth_kick;
+        auth_kick = 0;
+        pthread_mutex_unlock(&auth_timer_mutex);
+        if(!keep_running) {
+            break;
+        }
+
+        time(&now);
+        if((now >= due) || (kicked && (now - tried >= DRIVE_AUTH_RETRY))) {
+            tried = now;
+            refresh_tokens();
+            if(expires_in > 0) {
+                dbcache_auth_store(token_type, access_token, refresh_token,
+                        expires_in, &expiration_time);
+                auth_publish();
+                due = expiration_time - DRIVE_AUTH_AHEAD;
+                log_debug("access token refreshed");
+            } else {
+                /* keep serving the old snapshot, try again shortly */
+                log_error("unable to refresh access token");
+                due = now + DRIVE_AUTH_RETRY;
+            }
+        }
+        auth_reap(0);
+    }
+
+    return NULL;
+}
+
+static void drive_timed(CURL *curl, int cls, CURLcode rc, long status)
+{
+    static const char *classes[XFER_CLASSES] = {
+        "interactive", "metadata", "prefetch", "bulk"
+    };
+    drive_timing_t *k;
+    char *url;
+    double dns;
+    double conn;
+    double tls;
+    double pre;
+    double first;
+    double total;
+    curl_off_t bytes;
+    curl_off_t speed;
+    long conns;
+    int kind;
+
+    /* curl's timers are all from the start of the transfer: resolved,
+     * connected, tls done, request about to go, first byte, done */
+    url = NULL;
+    dns = conn = tls = pre = first = total = 0;
+    bytes = speed = 0;
+    conns = 0;
+    curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME, &dns);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &conn);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME, &tls);
+    curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME, &pre);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &first);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+    curl_easy_getinfo(curl, CURLINFO_SPEED_DOWNLOAD_T, &speed);
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &conns);
+    if(0 == status) {
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    }
+    if(NULL == url) {
+        url = "";
+    }
+
+    if(0 == strncmp(url, oauth_url, strlen(oauth_url))) {
+        kind = DRIVE_REQ_TOKEN;
+    } else if(strstr(url, "alt=media")) {
+        kind = DRIVE_REQ_MEDIA;
+    } else if(strstr(url, "/changes")) {
+        kind = DRIVE_REQ_CHANGES;
+    } else if(strstr(url, "/files?")) {
+        kind = DRIVE_REQ_LIST;
+    } else if(strstr(url, "/files/")) {
+        kind = DRIVE_REQ_METADATA;
+    } else {
+        kind = DRIVE_REQ_OTHER;
+    }
+
+    /* turn the marks into phases; with no tls appconnect stays 0 */
+    tls = (tls > conn) ? tls - conn : 0;
+    conn = (conn > dns) ? conn - dns : 0;
+    first = (first > pre) ? first - pre : 0;
+
+    if(conns > 0) {
+        stats_add(STATS_HTTP_DNS, (int64_t)(dns * 1e9), 0);
+        stats_add(STATS_HTTP_CONNECT, (int64_t)(conn * 1e9), 0);
+        if(tls > 0) {
+            stats_add(STATS_HTTP_TLS, (int64_t)(tls * 1e9), 0);
+        }
+    }
+    if(CURLE_OK == rc) {
+        stats_add(STATS_HTTP_WAIT, (int64_t)(first * 1e9), 0);
+    }
+
+    pthread_mutex_lock(&timing_mutex);
+    k = &timing[kind];
+    k->requests++;
+    if((rc != CURLE_OK) || (status >= 400)) {
+        k->failed++;
+    }
+    if(0 == conns) {
+        k->reused++;
+    } else {
+        k->dns += dns;
+        k->connect += conn;
+        k->tls += tls;
+    }
+    if((slow_ms > 0) && (total * 1000.0 >= (double)slow_ms)) {
+        k->slow++;
+    }
+    k->bytes += (uint64_t)bytes;
+    k->wait += first;
+    k->total += total;
+    pthread_mutex_unlock(&timing_mutex);
+
+    if((slow_ms > 0) && (total * 1000.0 >= (double)slow_ms)) {
+        log_warning("slow %s request (%s): %.3fs status %ld rc %d, dns "
+                "%.3fs connect %.3fs tls %.3fs wait %.3fs, %s connection, "
+                "%lld bytes at %lld B/s: %s", timing_names[kind],
+                classes[cls % XFER_CLASSES], total, status, (int)rc, dns,
+                conn, tls, first, conns ? "new" : "reused", (long long)bytes,
+                (long long)speed,
+                url);
+    }
+}
+
+static int drive_progress(void *opaque, curl_off_t dltotal,
+        curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
+{
+    drive_call_t *call;
+    int cls;
+
+    (void)dltotal;
+    (void)dlnow;
+    (void)ultotal;
+    (void)ulnow;
+
+    /* a boost from a waiting open stops the yielding */
+    call = (drive_call_t *)opaque;
+    cls = call->cls;
+    if(call->boost && (*call->boost < cls)) {
+        cls = *call->boost;
+    }
+    PROBE3(download_progress, cls, dlnow, dltotal);
+    xfer_yield(cls);
+    return 0;
+}
+
+static size_t drive_write(void *ptr, size_t size, size_t n, void *opaque)
+{
+    drive_call_t *call;
+    size_t len;
+    int cls;
+
+    /* error bodies are kept for drive_retry() instead of being handed to
+     * the caller as data */
+    call = (drive_call_t *)opaque;
+    if(0 == call->status) {
+        curl_easy_getinfo(call->curl, CURLINFO_RESPONSE_CODE, &call->status);
+    }
+    if(call->status >= 400) {
+        len = size * n;
+        if(len > DERROR_MAX - call->errlen) {
+            len = DERROR_MAX - call->errlen;
+        }
+        memcpy(call->error + call->errlen, ptr, len);
+        call->errlen += len;
+        return size * n;
+    }
+    call->delivered += size * n;
+    cls = call->cls;
+    if(call->boost && (*call->boost < cls)) {
+        cls = *call->boost;
+    }
+    xfer_consume(cls, size * n);
+    return call->write(ptr, size, n, call->data);
+}
+
+static CURLcode drive_perform(CURL *curl, int cls, const int *boost,
+        drive_write_t *write, void *data)
+{
+    return drive_request(curl, cls, boost, write, data, 1);
+}
+
+static CURLcode drive_request(CURL *curl, int cls, const int *boost,
+        drive_write_t *write, void *data, int authed)
+{
+    drive_call_t call;
+    drive_auth_t *auth;
+    CURLcode rc;
+    long wait;
+    int attempt;
+    int64_t t;
+
+    /* every drive request goes through here: admitted by priority class
+     * and by the shared request rate, retried with backoff when throttled
+     * or on server errors; boost, when given, may be raised to a more
+     * urgent class while the transfer runs */
+    memset(&call, 0, sizeof(drive_call_t));
+    call.seed = (unsigned int)time(NULL) ^ (unsigned int)(uintptr_t)&call;
+    call.curl = curl;
+    call.cls = cls;
+    call.boost = boost;
+    if(boost && (*boost < cls)) {
+        call.cls = *boost;
+    }
+    call.write = write;
+    call.data = data;
+    call.authed = authed;
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, drive_write);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &call);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, drive_progress);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &call);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    if(NULL == boost) {
+        /* a boosted transfer must be able to speed up, so only the shared
+         * bucket in drive_write() holds those back */
+        curl_easy_setopt(curl, CURLOPT_MAX_RECV_SPEED_LARGE,
+                (curl_off_t)xfer_cap(call.cls, 0));
+        curl_easy_setopt(curl, CURLOPT_MAX_SEND_SPEED_LARGE,
+                (curl_off_t)xfer_cap(call.cls, 1));
+    }
+
+    for(attempt = 0; ; attempt++) {
+        call.status = 0;
+        call.errlen = 0;
+        memset(call.error, 0, (DERROR_MAX + 1) * sizeof(char));
+
+        /* each attempt picks up the credentials current at the time, so a
+         * retry after a refresh goes out with the new token */
+        auth = NULL;
+        if(authed) {
+            auth = auth_get();
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER,
+                    auth ? auth->chunk : NULL);
+        }
+        xfer_token();
+        xfer_enter(call.cls);
+        t = stats_begin();
+        rc = curl_easy_perform(curl);
+        xfer_leave(call.cls);
+        if(authed) {
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, NULL);
+            auth_put(auth);
+        }
+        if(CURLE_OK == rc) {
+            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &call.status);
+        }
+        stats_end(authed ? STATS_HTTP + call.cls : STATS_HTTP_AUTH, t,
+                (rc != CURLE_OK) || (call.status >= 400));
+        drive_timed(curl, call.cls, rc, call.status);
+
+        wait = drive_retry(&call, rc, attempt);
+        if(wait < 0) {
+            break;
+        }
+        usleep((useconds_t)wait * 1000);
+    }
+
+    if((CURLE_OK == rc) && (call.status >= 400)) {
+        log_error("drive request failed: %ld %s", call.status, call.error);
+        rc = CURLE_HTTP_RETURNED_ERROR;
+    }
+    return rc;
+}
+
+static long drive_retry(drive_call_t *call, CURLcode rc, int attempt)
+{
+    long cap;
+    long wait;
+    int throttled;
+
+    /* milliseconds to wait before retrying, -1 to give up */
+    throttled = 0;
+    if(CURLE_OK == rc) {
+        if((429 == call->status) || ((403 == call->status) &&
+                    strstr(call->error, "ateLimitExceeded"))) {
+            throttled = 1;
+            xfer_throttled();
+        } else if(call->status >= 500) {
+            xfer_count(XFER_EV_SERVER);
+        } else if((401 == call->status) && call->authed && (attempt < 2)) {
+            /* token rejected early, have it refreshed and try again */
+            auth_refresh_soon();
+        } else {
+            if(call->status < 400) {
+                xfer_ok();
+            }
+            return -1;
+        }
+    } else {
+        /* connection trouble, only worth retrying if nothing reached the
+         * caller yet */
+        switch(rc) {
+        case CURLE_COULDNT_RESOLVE_HOST:
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_GOT_NOTHING:
+        case CURLE_PARTIAL_FILE:
+            xfer_count(XFER_EV_TRANSPORT);
+            if(call->delivered > 0) {
+                return -1;
+            }
+            break;
+        default:
+            return -1;
+        }
+    }
+    if(attempt >= DRIVE_RETRIES) {
+        log_error("giving up after %d attempts", attempt + 1);
+        return -1;
+    }
+
+    /* exponential backoff, jittered over its upper half */
+    cap = DRIVE_BACKOFF_MIN << attempt;
+    if(cap > DRIVE_BACKOFF_MAX) {
+        cap = DRIVE_BACKOFF_MAX;
+    }
+    call->seed += (unsigned int)attempt;
+    wait = cap / 2 + rand_r(&call->seed) % (cap / 2 + 1);
+#if LIBCURL_VERSION_NUM >= 0x074200
+    if(throttled) {
+        curl_off_t after;
+        /* honour Retry-After when drive sends one */
+        if((CURLE_OK == curl_easy_getinfo(call->curl, CURLINFO_RETRY_AFTER,
+                        &after)) && (after * 1000 > wait)) {
+            wait = (long)after * 1000;
+        }
+    }
+#endif /* LIBCURL_VERSION_NUM */
+    xfer_count(XFER_EV_RETRY);
+    log_info("drive request %s (%ld, curl %d), retrying in %ld ms",
+            throttled ? "throttled" : "failed", call->status, (int)rc, wait);
+    return wait;
+}
+
+static size_t write_sink(void *ptr, size_t size, size_t n, void *stream)
+{
+    return fscache_sink_write((fscache_sink_t *)stream, (const char *)ptr,
+            size * n);
+}
+
+int drive_download(const char *id, fscache_sink_t *sink, const int *cls)
 {
     CURL *curl;
     CURLcode rc;
-#define FILEURL_MAX     255
     char fileurl[FILEURL_MAX + 1];
 
     curl = curl_easy_init();
@@ -148,27 +802,316 @@ int drive_download(const char *id, FILE *f)
         /*rc = curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);*/
         memset(fileurl, 0, (FILEURL_MAX + 1) * sizeof(char));
         snprintf(fileurl, FILEURL_MAX,
-                "https://www.googleapis.com/drive/v3/files/%s?alt=media", id);
+                "%s/files/%s?alt=media", api_url, id);
         rc = curl_easy_setopt(curl, CURLOPT_URL, fileurl);
-        pthread_mutex_lock(&auth_mutex);
-        rc = curl_easy_setopt(curl, CURLOPT_HTTPHEADER, auth_chunk);
-        pthread_mutex_unlock(&auth_mutex);
-        rc = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, fwrite);
-        rc = curl_easy_setopt(curl, CURLOPT_WRITEDATA, f);
-        rc = curl_easy_perform(curl);
-        (void)rc;
+        PROBE2(download_start, id, *cls);
+        rc = drive_perform(curl, *cls, cls, write_sink, sink);
+        PROBE2(download_done, id, (int)rc);
         curl_easy_cleanup(curl);
+        if(rc != CURLE_OK) {
+            log_error("download of %s failed: %s", id,
+                    curl_easy_strerror(rc));
+            return -EIO;
+        }
+        return 0;
     }
 
+    return -EIO;
+}
+
+static int64_t drive_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+#define BATCH_QUEUED    0
+#define BATCH_RUNNING   1
+#define BATCH_DONE      2
+
+int drive_download_batch(const char **ids, fscache_sink_t **sinks, int *rcs,
+        int n)
+{
+    CURLM *multi;
+    CURL **curls;
+    CURLMsg *msg;
+    drive_call_t *calls;
+    drive_call_t *call;
+    drive_auth_t **auths;
+    int *attempts;
+    int *state;
+    int64_t *due;
+    int64_t now;
+    int64_t nap;
+    CURLcode rc;
+    char fileurl[FILEURL_MAX + 1];
+    double total;
+    long wait;
+    int running;
+    int pending;
+    int active;
+    int left;
+    int i;
+
+    /* one burst over a few multiplexed connections instead of n
+     * serialized transfers; each handle is still admitted on its own, so
+     * the burst never runs more than the prefetch class allows, and goes
+     * through drive_retry() like any other request: throttled or failed
+     * handles are queued again after their backoff */
+    curls = calloc(n, sizeof(CURL *));
+    calls = calloc(n, sizeof(drive_call_t));
+    auths = calloc(n, sizeof(drive_auth_t *));
+    attempts = calloc(n, sizeof(int));
+    state = calloc(n, sizeof(int));
+    due = calloc(n, sizeof(int64_t));
+    multi = curl_multi_init();
+    if(!curls || !calls || !auths || !attempts || !state || !due ||
+            !multi) {
+        if(multi) {
+            curl_multi_cleanup(multi);
+        }
+        free(due);
+        free(state);
+        free(attempts);
+        free(auths);
+        free(calls);
+        free(curls);
+        return -ENOMEM;
+    }
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+            (long)DRIVE_BATCH_CONNS);
+
+    left = 0;
+    for(i = 0; i < n; i++) {
+        rcs[i] = -EIO;
+        state[i] = BATCH_DONE;
+        curls[i] = curl_easy_init();
+        if(NULL == curls[i]) {
+            continue;
+        }
+        call = &calls[i];
+        call->seed = (unsigned int)time(NULL) ^ (unsigned int)i;
+        call->curl = curls[i];
+        call->cls = XFER_PREFETCH;
+        call->write = write_sink;
+        call->data = sinks[i];
+        call->authed = 1;
+        memset(fileurl, 0, (FILEURL_MAX + 1) * sizeof(char));
+        snprintf(fileurl, FILEURL_MAX,
+                "%s/files/%s?alt=media", api_url, ids[i]);
+        rc = curl_easy_setopt(curls[i], CURLOPT_URL, fileurl);
+        rc = curl_easy_setopt(curls[i], CURLOPT_WRITEFUNCTION, drive_write);
+        rc = curl_easy_setopt(curls[i], CURLOPT_WRITEDATA, call);
+        rc = curl_easy_setopt(curls[i], CURLOPT_HTTP_VERSION,
+                (long)CURL_HTTP_VERSION_2TLS);
+        rc = curl_easy_setopt(curls[i], CURLOPT_PIPEWAIT, 1L);
+        rc = curl_easy_setopt(curls[i], CURLOPT_PRIVATE, (char *)call);
+        rc = curl_easy_setopt(curls[i], CURLOPT_XFERINFOFUNCTION,
+                drive_progress);
+        rc = curl_easy_setopt(curls[i], CURLOPT_XFERINFODATA, call);
+        rc = curl_easy_setopt(curls[i], CURLOPT_NOPROGRESS, 0L);
+        rc = curl_easy_setopt(curls[i], CURLOPT_MAX_RECV_SPEED_LARGE,
+                (curl_off_t)xfer_cap(XFER_PREFETCH, 0));
+        (void)rc;
+        state[i] = BATCH_QUEUED;
+        left++;
+    }
+
+    active = 0;
+    while(left > 0) {
+        /* start what is due and admission allows, blocking only when
+         * idle */
+        now = drive_now_ms();
+        nap = -1;
+        for(i = 0; i < n; i++) {
+            if(state[i] != BATCH_QUEUED) {
+                continue;
+            }
+            if(due[i] > now) {
+                if((nap < 0) || (due[i] - now < nap)) {
+                    nap = due[i] - now;
+                }
+                continue;
+            }
+            if(0 == active) {
+                xfer_enter(XFER_PREFETCH);
+            } else if(xfer_try_enter(XFER_PREFETCH) != 0) {
+                break;
+            }
+            /* each attempt picks up the credentials current at the time */
+            call = &calls[i];
+            call->status = 0;
+            call->errlen = 0;
+            memset(call->error, 0, (DERROR_MAX + 1) * sizeof(char));
+            auth_put(auths[i]);
+            auths[i] = auth_get();
+            curl_easy_setopt(curls[i], CURLOPT_HTTPHEADER,
+                    auths[i] ? auths[i]->chunk : NULL);
+            xfer_token();
+            PROBE2(download_start, ids[i], XFER_PREFETCH);
+            curl_multi_add_handle(multi, curls[i]);
+            state[i] = BATCH_RUNNING;
+            active++;
+        }
+        if(0 == active) {
+            /* everything left is backing off */
+            usleep((useconds_t)(nap > 0 ? nap : 1) * 1000);
+            continue;
+        }
+
+        curl_multi_perform(multi, &running);
+        while((msg = curl_multi_info_read(multi, &pending))) {
+            if(msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE,
+                    (char **)&call);
+            i = (int)(call - calls);
+            rc = msg->data.result;
+            curl_multi_remove_handle(multi, curls[i]);
+            xfer_leave(XFER_PREFETCH);
+            active--;
+            if(CURLE_OK == rc) {
+                curl_easy_getinfo(curls[i], CURLINFO_RESPONSE_CODE,
+                        &call->status);
+            }
+            total = 0;
+            curl_easy_getinfo(curls[i], CURLINFO_TOTAL_TIME, &total);
+            stats_add(STATS_HTTP + XFER_PREFETCH, (int64_t)(total * 1e9),
+                    (rc != CURLE_OK) || (call->status >= 400));
+            drive_timed(curls[i], XFER_PREFETCH, rc, call->status);
+
+            wait = drive_retry(call, rc, attempts[i]);
+            if(wait >= 0) {
+                attempts[i]++;
+                due[i] = drive_now_ms() + wait;
+                state[i] = BATCH_QUEUED;
+                continue;
+            }
+            if((CURLE_OK == rc) && (call->status < 400)) {
+                rcs[i] = 0;
+            } else {
+                log_error("batched download of %s failed: %ld %s", ids[i],
+                        call->status, call->error);
+            }
+            PROBE2(download_done, ids[i], (int)rc);
+            state[i] = BATCH_DONE;
+            left--;
+        }
+        if(running) {
+            curl_multi_wait(multi, NULL, 0, 1000, NULL);
+        }
+    }
+
+    for(i = 0; i < n; i++) {
+        if(curls[i]) {
+            curl_easy_cleanup(curls[i]);
+        }
+        auth_put(auths[i]);
+    }
+    curl_multi_cleanup(multi);
+    free(due);
+    free(state);
+    free(attempts);
+    free(auths);
+    free(calls);
+    free(curls);
+
     return 0;
 }
 
+static void parse_time(struct timespec *ts, const char *s)
+{
+    struct tm tm;
+    const char *frac;
+
+    /* RFC 3339, as returned by drive: 2016-01-31T12:34:56.789Z */
+    memset(ts, 0, sizeof(struct timespec));
+    memset(&tm, 0, sizeof(struct tm));
+    frac = strptime(s, "%Y-%m-%dT%H:%M:%S", &tm);
+    if(NULL == frac) {
+        return;
+    }
+    ts->tv_sec = timegm(&tm);
+    if('.' == *frac) {
+        ts->tv_nsec = (long)(strtod(frac, NULL) * 1000000000.0);
+    }
+}
+
+static void parse_file(json_object *jroot, drive_file_t *df)
+{
+    json_object *jval;
+    json_object *pitem;
+    json_bool found;
+    const char *sval;
+    int pn;
+
+    memset(df, 0, sizeof(drive_file_t));
+
+    found = json_object_object_get_ex(jroot, "id", &jval);
+    if(found) {
+        sval = json_object_get_string(jval);
+        strncpy(df->uuid, sval, DUUID_MAX);
+    }
+    found = json_object_object_get_ex(jroot, "name", &jval);
+    if(found) {
+        sval = json_object_get_string(jval);
+        strncpy(df->name, sval, DNAME_MAX);
+    }
+    found = json_object_object_get_ex(jroot, "mimeType", &jval);
+    if(found) {
+        sval = json_object_get_string(jval);
+        if(0 == strcmp(sval, "application/vnd.google-apps.folder")) {
+            df->isdir = 1;
+        } else if(0 == strncmp(sval, "application/vnd.google-apps.", 28)) {
+            df->exclude = 1;
+        }
+    }
+    found = json_object_object_get_ex(jroot, "size", &jval);
+    if(found) {
+        df->size = json_object_get_int64(jval);
+    }
+    found = json_object_object_get_ex(jroot, "modifiedTime", &jval);
+    if(found) {
+        parse_time(&df->mtime, json_object_get_string(jval));
+    }
+    found = json_object_object_get_ex(jroot, "createdTime", &jval);
+    if(found) {
+        parse_time(&df->ctime, json_object_get_string(jval));
+    }
+    found = json_object_object_get_ex(jroot, "md5Checksum", &jval);
+    if(found) {
+        sval = json_object_get_string(jval);
+        strncpy(df->cksum, sval, DCKSUM_MAX);
+    }
+    found = json_object_object_get_ex(jroot, "headRevisionId", &jval);
+    if(found) {
+        sval = json_object_get_string(jval);
+        strncpy(df->revision, sval, DREV_MAX);
+    }
+    found = json_object_object_get_ex(jroot, "trashed", &jval);
+    if(found) {
+        df->trashed = json_object_get_boolean(jval);
+    }
+    found = json_object_object_get_ex(jroot, "parents", &jval);
+    if(found) {
+        pn = json_object_array_length(jval);
+        if(pn > 0) {
+            pitem = json_object_array_get_idx(jval, 0);
+            sval = json_object_get_string(pitem);
+            strncpy(df->parent, sval, DUUID_MAX);
+        }
+    }
+}
+
 void recurse(const char *alias)
 {
     CURL *curl;
     CURLcode rc;
 
-#define FILEURL_MAX     255
     char fileurl[FILEURL_MAX + 1];
     json_context_t context;
     json_tokener *tokener;
@@ -179,42 +1122,10 @@ void recurse(const char *alias)
     json_bool found;
     const char *sval;
     int i, nfiles;
+    drive_file_t df;
 
-#define DUUID_MAX       63
-    char uuid[DUUID_MAX + 1];
-#define DNAME_MAX       255
-    char name[DNAME_MAX + 1];
-#define DMIME_MAX       63
-    char mime[DMIME_MAX + 1];
-    int isdir;
-    int exclude;
-    int64_t size;
-#define DTIME_MAX       31
-    char mtimes[DTIME_MAX + 1];
-    char ctimes[DTIME_MAX + 1];
-    struct timespec mtime;
-    struct timespec ctime;
-#define DCKSUM_MAX      63
-    char cksum[DCKSUM_MAX + 1];
-    int pn;
-    struct json_object *pitem;
-    char parent[DUUID_MAX + 1];
-
-    memset(uuid, 0, (DUUID_MAX + 1) * sizeof(char));
-    memset(name, 0, (DNAME_MAX + 1) * sizeof(char));
-    memset(mime, 0, (DMIME_MAX + 1) * sizeof(char));
-    isdir = 0;
-    exclude = 0;
-    size = 0LL;
-    memset(mtimes, 0, (DTIME_MAX + 1) * sizeof(char));
-    memset(ctimes, 0, (DTIME_MAX + 1) * sizeof(char));
-    memset(&mtime, 0, sizeof(struct timeval));
-    memset(&ctime, 0, sizeof(struct timeval));
-    memset(cksum, 0, (DCKSUM_MAX + 1) * sizeof(char));
-    pn = 0;
-    pitem = NULL;
-    memset(parent, 0, (DUUID_MAX + 1) * sizeof(char));
-    
+    memset(&df, 0, sizeof(drive_file_t));
+    df.exclude = 1;
 
     /* query details */
     curl = curl_easy_init();
@@ -223,101 +1134,33 @@ void recurse(const char *alias)
         if(tokener) {
             memset(fileurl, 0, (FILEURL_MAX + 1) * sizeof(char));
             snprintf(fileurl, FILEURL_MAX,
-                    "https://www.googleapis.com/drive/v3/files/%s?"
-                    "fields=id,name,mimeType,size,"
-                    "modifiedTime,createdTime,version,md5Checksum,parents",
-                    alias);
+                    "%s/files/%s?"
+                    "fields=" DRIVE_FILE_FIELDS, api_url, alias);
             log_debug("%s - %s\n", alias, fileurl);
             rc = curl_easy_setopt(curl, CURLOPT_URL, fileurl);
-            pthread_mutex_lock(&auth_mutex);
-            rc = curl_easy_setopt(curl, CURLOPT_HTTPHEADER, auth_chunk);
-            pthread_mutex_unlock(&auth_mutex);
-            rc = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, parse_json);
             context.tokener = tokener;
+            jroot = NULL;
             context.pointer = &jroot;
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &context);
-            rc = curl_easy_perform(curl);
+            rc = drive_perform(curl, XFER_BULK, NULL, parse_json,
+                    &context);
             if(CURLE_OK == rc) {
                 if(jroot) {
-                    found = json_object_object_get_ex(jroot, "id", &jval);
-                    if(found) {
-                        sval = json_object_get_string(jval);
-                        strncpy(uuid, sval, DUUID_MAX);
-                    }
-                    found = json_object_object_get_ex(jroot, "name", &jval);
-                    if(found) {
-                        sval = json_object_get_string(jval);
-                        strncpy(name, sval, DNAME_MAX);
-                    }
-                    found = json_object_object_get_ex(jroot, "mimeType", &jval);
-                    if(found) {
-                        sval = json_object_get_string(jval);
-                        strncpy(mime, sval, DMIME_MAX);
-                        if(0 == strcmp(mime,
-                                    "application/vnd.google-apps.folder")) {
-                            isdir = 1;
-                        } else if(0 == strncmp(mime,
-                                    "application/vnd.google-apps.", 20)) {
-                            exclude = 1;
-                        }
-                    }
-                    found = json_object_object_get_ex(jroot, "size", &jval);
-                    if(found) {
-                        size = json_object_get_int64(jval);
-                    }
-                    found = json_object_object_get_ex(jroot, "modifiedTime",
-                            &jval);
-                    if(found) {
-                        sval = json_object_get_string(jval);
-                        strncpy(mtimes, sval, DTIME_MAX);
-                    }
-                    found = json_object_object_get_ex(jroot, "createdTime",
-                            &jval);
-                    if(found) {
-                        sval = json_object_get_string(jval);
-                        strncpy(ctimes, sval, DTIME_MAX);
-                    }
-                    found = json_object_object_get_ex(jroot, "md5Checksum",
-                            &jval);
-                    if(found) {
-                        sval = json_object_get_string(jval);
-                        strncpy(cksum, sval, DCKSUM_MAX);
-                    }
-                    found = json_object_object_get_ex(jroot, "parents", &jval);
-                    if(found) {
-                        pn = json_object_array_length(jval);
-                        if(pn > 0) {
-                            pitem = json_object_array_get_idx(jval, 0);
-                            sval = json_object_get_string(pitem);
-                            strncpy(parent, sval, DUUID_MAX);
-                        }
-                    }
-
-                    /* insert/update entry */
-                    /*printf("id: %s\n", id);
-                      printf("name: %s\n", name);
-                      printf("isdir: %d\n", isdir);
-                      printf("size: %lld\n", (long long int)size);
-                      printf("mtime: %s\n", mtimes);
-                      printf("ctime: %s\n", ctimes);
-                      printf("version: %d\n", version);
-                      printf("cksum: %s\n", cksum);
-                      printf("parent: %s\n", parent);
-                      printf("\n");*/
+                    parse_file(jroot, &df);
                 }
             }
+            json_object_put(jroot);
             json_tokener_free(tokener);
         }
         curl_easy_cleanup(curl);
     }
 
-    if(!exclude) {
-        dbcache_update(uuid, name, isdir, size, &mtime, &ctime, cksum,
-                parent);
+    if(!df.exclude) {
+        dbcache_update(df.uuid, df.name, df.isdir, df.size, &df.mtime,
+                &df.ctime, df.cksum, df.parent);
     }
 
     /* scan directory */
-    if(isdir) {
+    if(df.isdir) {
 
         /* load all files */
         curl = curl_easy_init();
@@ -326,17 +1169,14 @@ void recurse(const char *alias)
             if(tokener) {
                 memset(fileurl, 0, (FILEURL_MAX + 1) * sizeof(char));
                 snprintf(fileurl, FILEURL_MAX,
-                        "https://www.googleapis.com/drive/v3/files?"
-                        "q=%%27%s%%27+in+parents", uuid);
+                        "%s/files?"
+                        "q=%%27%s%%27+in+parents", api_url, df.uuid);
                 rc = curl_easy_setopt(curl, CURLOPT_URL, fileurl);
-                pthread_mutex_lock(&auth_mutex);
-                rc = curl_easy_setopt(curl, CURLOPT_HTTPHEADER, auth_chunk);
-                pthread_mutex_unlock(&auth_mutex);
-                rc = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, parse_json);
                 context.tokener = tokener;
+                jroot = NULL;
                 context.pointer = &jroot;
-                rc = curl_easy_setopt(curl, CURLOPT_WRITEDATA, &context);
-                rc = curl_easy_perform(curl);
+                rc = drive_perform(curl, XFER_BULK, NULL, parse_json,
+                        &context);
 
                 if(jroot) {
                     found = json_object_object_get_ex(jroot, "kind", &jval);
@@ -363,6 +1203,7 @@ void recurse(const char *alias)
                             }
                         }
                     }
+                    json_object_put(jroot);
                 }
 
                 json_tokener_free(tokener);
@@ -375,10 +1216,6 @@ void recurse(const char *alias)
 
 static void *drive_run(void *opaque)
 {
-    time_t now;
-#define AUTH_MAX    1023
-    char auth[AUTH_MAX + 1];
-
 #define CHANGETOKEN_MAX 63
     char changeid[CHANGETOKEN_MAX + 1];
     int anychange;
@@ -389,26 +1226,8 @@ static void *drive_run(void *opaque)
 
     memset(changeid, 0, (CHANGETOKEN_MAX + 1) * sizeof(char));
 
-    dbcache_auth_load(token_type, TOKENTYPE_MAX, access_token, TOKEN_MAX,
-            refresh_token, TOKEN_MAX, &expires_in, &expiration_time);
-
+    /* credentials are kept fresh by auth_run() */
     while(keep_running) {
-        time(&now);
-        if(now >= expiration_time) {
-            refresh_tokens();
-            dbcache_auth_store(token_type, access_token, refresh_token,
-                expires_in, &expiration_time);
-        }
-
-        /* setup authorization */
-        pthread_mutex_lock(&auth_mutex);
-        auth_chunk = NULL;
-        memset(auth, 0, (AUTH_MAX + 1) * sizeof(char));
-        snprintf(auth, AUTH_MAX, "Authorization: %s %s", token_type,
-                access_token);
-        auth_chunk = curl_slist_append(auth_chunk, auth);
-        pthread_mutex_unlock(&auth_mutex);
-
         /* load changeid from db */
         dbcache_change_load(changeid, CHANGETOKEN_MAX);
 
@@ -430,6 +1249,9 @@ static void *drive_run(void *opaque)
                 continue;
             }
 
+            /* pinned content the queue could not take yet */
+            fetch_pinned(1);
+
             idle_loops = 0;
             while(keep_running) {
                 /* TODO: if activity detected exit loop */
@@ -443,12 +1265,6 @@ static void *drive_run(void *opaque)
             }
 
             /* TODO: if activity detected, reset flag and exit loop */
-
-            /* if token time expired, exit to outer loop */
-            time(&now);
-            if(now >= expiration_time) {
-                break;
-            }
         }
     }
 
@@ -497,6 +1313,7 @@ static int authorize(const char *grant_type, const char *key, const char *token)
 {
     CURL *curl;
     CURLcode rc;
+    char url[BASEURL_MAX + 1];
 #define DATA_MAX    511
     char data[DATA_MAX + 1];
     char body[DATA_MAX + 1];
@@ -512,12 +1329,16 @@ static int authorize(const char *grant_type, const char *key, const char *token)
     expires_in = 0;
     time(&expiration_time);
 
+    /* error bodies never reach parse_json(), jauth stays unset */
+    jauth = NULL;
+    rc = CURLE_FAILED_INIT;
     curl = curl_easy_init();
     if(curl) {
         tokener = json_tokener_new();
         if(tokener) {
-            rc = curl_easy_setopt(curl, CURLOPT_URL,
-                    "https://accounts.google.com/o/oauth2/token");
+            memset(url, 0, (BASEURL_MAX + 1) * sizeof(char));
+            snprintf(url, BASEURL_MAX, "%s/token", oauth_url);
+            rc = curl_easy_setopt(curl, CURLOPT_URL, url);
             (void)rc;
             memset(data, 0, (DATA_MAX + 1) * sizeof(char));
             snprintf(data, DATA_MAX,
@@ -530,14 +1351,13 @@ static int authorize(const char *grant_type, const char *key, const char *token)
                     "redirect_uri=urn:ietf:wg:oauth:2.0:oob&"
                     "%s=%s", grant_type, key, token);
             rc = curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data);
-            rc = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, parse_json);
             memset(body, 0, (DATA_MAX + 1) * sizeof(char));
             context.tokener = tokener;
             context.pointer = &jauth;
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &context);
-            rc = curl_easy_perform(curl);
+            rc = drive_request(curl, XFER_INTERACTIVE, NULL, parse_json,
+                    &context, 0);
 
-            if(jauth) {
+            if((CURLE_OK == rc) && jauth) {
                 found = json_object_object_get_ex(jauth, "token_type", &val);
                 if(found) {
                     sval = json_object_get_string(val);
@@ -559,6 +1379,7 @@ static int authorize(const char *grant_type, const char *key, const char *token)
                     expires_in = json_object_get_int(val);
                 }
             }
+            json_object_put(jauth);
             json_tokener_free(tokener);
         }
         curl_easy_cleanup(curl);
@@ -567,6 +1388,10 @@ static int authorize(const char *grant_type, const char *key, const char *token)
     /* do not wait until last minute before refreshing */
     expiration_time += (5 * expires_in) / 6;
 
+    if((rc != CURLE_OK) || (0 == strlen(access_token))) {
+        log_error("authorization failed: %s", curl_easy_strerror(rc));
+        return -EIO;
+    }
     return 0;
 }
 
@@ -583,27 +1408,22 @@ static int get_start_token(char *changeid, size_t len)
     json_bool found;
     const char *sval;
 
-    (void)rc;
-
+    rc = -EIO;
+    jbody = NULL;
     curl = curl_easy_init();
     if(curl) {
         tokener = json_tokener_new();
         if(tokener) {
             memset(fileurl, 0, (FILEURL_MAX + 1) * sizeof(char));
             snprintf(fileurl, FILEURL_MAX,
-                    "https://www.googleapis.com/drive/v3/changes/"
-                    "startPageToken");
+                    "%s/changes/startPageToken", api_url);
             cc = curl_easy_setopt(curl, CURLOPT_URL, fileurl);
-            pthread_mutex_lock(&auth_mutex);
-            cc = curl_easy_setopt(curl, CURLOPT_HTTPHEADER, auth_chunk);
-            pthread_mutex_unlock(&auth_mutex);
-            cc = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, parse_json);
             context.tokener = tokener;
             context.pointer = &jbody;
-            cc = curl_easy_setopt(curl, CURLOPT_WRITEDATA, &context);
-            cc = curl_easy_perform(curl);
+            cc = drive_perform(curl, XFER_METADATA, NULL, parse_json,
+                    &context);
 
-            if(jbody) {
+            if((CURLE_OK == cc) && jbody) {
                 found = json_object_object_get_ex(jbody, "kind", &jval);
                 if(found) {
                     sval = json_object_get_string(jval);
@@ -614,51 +1434,210 @@ static int get_start_token(char *changeid, size_t len)
                 if(found) {
                     sval = json_object_get_string(jval);
                     strncpy(changeid, sval, len);
+                    rc = 0;
                 }
             }
+            json_object_put(jbody);
             json_tokener_free(tokener);
         }
         curl_easy_cleanup(curl);
     }
-    return 0;
+    return rc;
 }
 
 static int get_changes(char *changeid, size_t len, int *anychange)
 {
     CURL *curl;
     CURLcode rc;
-#define FILEURL_MAX     255
-    char fileurl[FILEURL_MAX + 1];
-    FILE *f;
-
-    (void)changeid;
-    (void)len;
+#define CHANGEURL_MAX   1023
+    char changeurl[CHANGEURL_MAX + 1];
+    json_context_t context;
+    json_tokener *tokener;
+    json_object *jbody;
+    json_object *jchanges;
+    json_object *jval;
+    json_bool found;
+    const char *sval;
+    int i, nchanges;
 
     *anychange = 0;
+    jbody = NULL;
     curl = curl_easy_init();
     if(curl) {
-        memset(fileurl, 0, (FILEURL_MAX + 1) * sizeof(char));
-        snprintf(fileurl, FILEURL_MAX, "/tmp/%s.change", changeid);
-        f = fopen(fileurl, "w");
-        /*rc = curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);*/
-        memset(fileurl, 0, (FILEURL_MAX + 1) * sizeof(char));
-        snprintf(fileurl, FILEURL_MAX,
-                "https://www.googleapis.com/drive/v3/changes?"
-                "pageToken=%s&includeRemoved=true&"
-                "pageSize=1&restrictToMyDrive=true&"
-                "spaces=drive", changeid);
-        rc = curl_easy_setopt(curl, CURLOPT_URL, fileurl);
-        pthread_mutex_lock(&auth_mutex);
-        rc = curl_easy_setopt(curl, CURLOPT_HTTPHEADER, auth_chunk);
-        pthread_mutex_unlock(&auth_mutex);
-        rc = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, fwrite);
-        rc = curl_easy_setopt(curl, CURLOPT_WRITEDATA, f);
-        rc = curl_easy_perform(curl);
-        (void)rc;
-        fclose(f);
+        tokener = json_tokener_new();
+        if(tokener) {
+            memset(changeurl, 0, (CHANGEURL_MAX + 1) * sizeof(char));
+            snprintf(changeurl, CHANGEURL_MAX,
+                    "%s/changes?"
+                    "pageToken=%s&includeRemoved=true&"
+                    "pageSize=100&restrictToMyDrive=true&"
+                    "spaces=drive&fields=nextPageToken,newStartPageToken,"
+                    "changes(fileId,removed,file(" DRIVE_FILE_FIELDS "))",
+                    api_url, changeid);
+            rc = curl_easy_setopt(curl, CURLOPT_URL, changeurl);
+            context.tokener = tokener;
+            context.pointer = &jbody;
+            rc = drive_perform(curl, XFER_METADATA, NULL, parse_json,
+                    &context);
+
+            if((CURLE_OK == rc) && jbody) {
+                found = json_object_object_get_ex(jbody, "changes",
+                        &jchanges);
+                if(found) {
+                    nchanges = json_object_array_length(jchanges);
+                    for(i = 0; i < nchanges; i++) {
+                        apply_change(json_object_array_get_idx(jchanges, i));
+                    }
+                    PROBE2(change_page, changeid, nchanges);
+                }
+
+                /* more pages pending, or the token to poll next */
+                found = json_object_object_get_ex(jbody, "nextPageToken",
+                        &jval);
+                if(!found) {
+                    found = json_object_object_get_ex(jbody,
+                            "newStartPageToken", &jval);
+                }
+                if(found) {
+                    sval = json_object_get_string(jval);
+                    if(sval && strlen(sval) && strcmp(sval, changeid)) {
+                        memset(changeid, 0, len * sizeof(char));
+                        strncpy(changeid, sval, len);
+                        *anychange = 1;
+                    }
+                }
+            }
+            json_object_put(jbody);
+            json_tokener_free(tokener);
+        }
         curl_easy_cleanup(curl);
     }
 
     return 0;
 }
 
+static void apply_change(json_object *jchange)
+{
+    json_object *jval;
+    json_object *jfile;
+    json_bool found;
+    int removed;
+    const char *fileid;
+    drive_file_t df;
+
+    if(NULL == jchange) {
+        return;
+    }
+
+    removed = 0;
+    found = json_object_object_get_ex(jchange, "removed", &jval);
+    if(found) {
+        removed = json_object_get_boolean(jval);
+    }
+    fileid = NULL;
+    found = json_object_object_get_ex(jchange, "fileId", &jval);
+    if(found) {
+        fileid = json_object_get_string(jval);
+    }
+
+    found = json_object_object_get_ex(jchange, "file", &jfile);
+    if(!removed && found) {
+        parse_file(jfile, &df);
+        if(df.trashed) {
+            removed = 1;
+        } else if(!df.exclude) {
+            /* renames and moves keep the checksum, hence the cache key,
+             * only content changes make it point to a new object */
+            log_debug("change: %s %s", df.uuid, df.name);
+            dbcache_update(df.uuid, df.name, df.isdir, df.size, &df.mtime,
+                    &df.ctime, df.cksum, df.parent);
+            if(!df.isdir) {
+                refresh_content(&df);
+            }
+        }
+    }
+
+    if(removed && fileid) {
+        log_debug("change: %s removed", fileid);
+        dbcache_remove(fileid, fetch_evict);
+    }
+    PROBE2(change_apply, fileid, removed);
+}
+
+static void refresh_content(const drive_file_t *df)
+{
+    char cksum[DCKSUM_MAX + 1];
+    char revision[DREV_MAX + 1];
+    int stale;
+
+    /* only content we hold a copy of is worth keeping hot; fetch it in
+     * the background so the next open finds it in cache */
+    if(dbcache_content_load(df->uuid, cksum, DCKSUM_MAX, revision,
+                DREV_MAX) != 0) {
+        if(dbcache_pinned(df->uuid)) {
+            fetch_queue(df->uuid, df->cksum, df->revision, (size_t)df->size);
+        }
+        return;
+    }
+    if(strlen(df->cksum)) {
+        stale = strcmp(cksum, df->cksum);
+    } else {
+        stale = strlen(df->revision) && strcmp(revision, df->revision);
+    }
+    if(stale) {
+        log_debug("refreshing %s: %s -> %s", df->uuid,
+                strlen(cksum) ? cksum : revision,
+                strlen(df->cksum) ? df->cksum : df->revision);
+        fetch_queue(df->uuid, df->cksum, df->revision, (size_t)df->size);
+    }
+}
+
+int drive_revision(const char *id, char *revision, size_t len, int cls)
+{
+    CURL *curl;
+    CURLcode rc;
+    char fileurl[FILEURL_MAX + 1];
+    json_context_t context;
+    json_tokener *tokener;
+    json_object *jbody;
+    json_object *jval;
+    json_bool found;
+    int ret;
+
+    /* cheap freshness check for content without a checksum */
+    ret = -EIO;
+    jbody = NULL;
+    curl = curl_easy_init();
+    if(curl) {
+        tokener = json_tokener_new();
+        if(tokener) {
+            memset(fileurl, 0, (FILEURL_MAX + 1) * sizeof(char));
+            snprintf(fileurl, FILEURL_MAX,
+                    "%s/files/%s?"
+                    "fields=headRevisionId,md5Checksum", api_url, id);
+            rc = curl_easy_setopt(curl, CURLOPT_URL, fileurl);
+            context.tokener = tokener;
+            context.pointer = &jbody;
+            rc = drive_perform(curl, cls, NULL, parse_json,
+                    &context);
+            if((CURLE_OK == rc) && jbody) {
+                memset(revision, 0, (len + 1) * sizeof(char));
+                found = json_object_object_get_ex(jbody, "headRevisionId",
+                        &jval);
+                if(!found) {
+                    found = json_object_object_get_ex(jbody, "md5Checksum",
+                            &jval);
+                }
+                if(found) {
+                    strncpy(revision, json_object_get_string(jval), len);
+                }
+                ret = 0;
+            }
+            json_object_put(jbody);
+            json_tokener_free(tokener);
+        }
+        curl_easy_cleanup(curl);
+    }
+
+    return ret;
+}
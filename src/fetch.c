@@ -0,0 +1,597 @@
+This file is part of drive-fuse-sync.
+
+drive-fuse-sync is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+drive-fuse-sync is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "fetch.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "blkcache.h"
+#include "dbcache.h"
+#include "driveapi.h"
+#include "fscache.h"
+#include "log.h"
+#include "xfer.h"
+
+/* downloads into fscache: fetch_file() on behalf of an open, fetch_queue()
+ * for background workers; a key being downloaded is never downloaded
+ * twice at once, later callers wait for the first one; fetch_dir() has the
+ * workers get all small files of a directory in one multiplexed burst */
+
+#define FETCH_QUEUE_MAX     1024
+#define FETCH_WORKERS_MAX   16
+#define FETCH_NICE          10
+#define FETCH_UUID_MAX      63
+#define FETCH_REV_MAX       127
+#define FETCH_BATCH_MAX     64
+#define FETCH_DIRS          64
+#define FETCH_DIR_WINDOW    600
+
+struct _fetch_job
+{
+    char uuid[FETCH_UUID_MAX + 1];
+    char cksum[FSCACHE_KEY_MAX + 1];
+    char revision[FETCH_REV_MAX + 1];
+    size_t size;
+    int64_t dir;
+    struct _fetch_job *next;
+};
+typedef struct _fetch_job fetch_job_t;
+
+struct _fetch_item
+{
+    char uuid[FETCH_UUID_MAX + 1];
+    char cksum[FSCACHE_KEY_MAX + 1];
+    char key[FSCACHE_KEY_MAX + 1];
+    size_t size;
+};
+typedef struct _fetch_item fetch_item_t;
+
+struct _fetch_dir
+{
+    int64_t dir;
+    time_t ts;
+};
+typedef struct _fetch_dir fetch_dir_t;
+
+struct _fetch_flight
+{
+    char key[FSCACHE_KEY_MAX + 1];
+    int cls;
+    int done;
+    int rc;
+    int waiters;
+    struct _fetch_flight *next;
+};
+typedef struct _fetch_flight fetch_flight_t;
+
+static pthread_mutex_t fetch_mutex;
+static pthread_cond_t fetch_cond;
+static fetch_job_t *fetch_head = NULL;
+static fetch_job_t *fetch_tail = NULL;
+static int fetch_queued = 0;
+static fetch_flight_t *fetch_flights = NULL;
+
+/* directories whose small files were fetched lately */
+static fetch_dir_t fetch_dirs[FETCH_DIRS];
+static int fetch_ndirs = 0;
+static size_t fetch_sibling_max = 0;
+
+static pthread_t fetch_workers[FETCH_WORKERS_MAX];
+static int fetch_nworkers = 0;
+static int keep_running = 0;
+
+static void *fetch_run(void *);
+static int fetch_current(fetch_job_t *);
+static int fetch_have(const char *, size_t);
+static void fetch_siblings(int64_t);
+static fetch_flight_t *fetch_find(const char *);
+static fetch_flight_t *fetch_claim(const char *, int);
+static void fetch_release(fetch_flight_t *, int);
+static int fetch_download(const char *, const char *, const char *,
+        const char *, size_t, const int *);
+
+int fetch_setup(int workers, size_t sibling_max)
+{
+    int i;
+
+    pthread_mutex_init(&fetch_mutex, NULL);
+    pthread_cond_init(&fetch_cond, NULL);
+
+    memset(fetch_dirs, 0, FETCH_DIRS * sizeof(fetch_dir_t));
+    fetch_sibling_max = sibling_max;
+
+    if(workers > FETCH_WORKERS_MAX) {
+        workers = FETCH_WORKERS_MAX;
+    }
+    keep_running = 1;
+    for(i = 0; i < workers; i++) {
+        if(pthread_create(&fetch_workers[i], NULL, fetch_run, NULL) != 0) {
+            log_error("unable to start fetch worker %d", i);
+            break;
+        }
+        fetch_nworkers++;
+    }
+    log_debug("%d background fetch workers", fetch_nworkers);
+
+    return 0;
+}
+
+int fetch_cleanup(void)
+{
+    fetch_job_t *job;
+    int i;
+
+    pthread_mutex_lock(&fetch_mutex);
+    keep_running = 0;
+    pthread_cond_broadcast(&fetch_cond);
+    pthread_mutex_unlock(&fetch_mutex);
+
+    for(i = 0; i < fetch_nworkers; i++) {
+        pthread_join(fetch_workers[i], NULL);
+    }
+    fetch_nworkers = 0;
+
+    while(fetch_head) {
+        job = fetch_head;
+        fetch_head = job->next;
+        free(job);
+    }
+    fetch_tail = NULL;
+    fetch_queued = 0;
+
+    pthread_cond_destroy(&fetch_cond);
+    pthread_mutex_destroy(&fetch_mutex);
+
+    return 0;
+}
+
+int fetch_file(const char *uuid, const char *cksum, const char *revision,
+        size_t size, int cls)
+{
+    char key[FSCACHE_KEY_MAX + 1];
+    fetch_flight_t *flight;
+    int rc;
+
+    fscache_key(uuid, cksum, size, key, FSCACHE_KEY_MAX);
+
+    /* content shared with another file may be there already */
+    if(strlen(cksum) && fetch_have(key, size)) {
+        return fetch_adopt(uuid, cksum, key);
+    }
+
+    pthread_mutex_lock(&fetch_mutex);
+    flight = fetch_find(key);
+    if(flight) {
+        /* already on its way, wait for it, hurrying it up if need be */
+        if(cls < flight->cls) {
+            flight->cls = cls;
+        }
+        flight->waiters++;
+        while(!flight->done) {
+            pthread_cond_wait(&fetch_cond, &fetch_mutex);
+        }
+        rc = flight->rc;
+        flight->waiters--;
+        if(0 == flight->waiters) {
+            free(flight);
+        }
+        pthread_mutex_unlock(&fetch_mutex);
+        return rc;
+    }
+
+    flight = fetch_claim(key, cls);
+    pthread_mutex_unlock(&fetch_mutex);
+    if(NULL == flight) {
+        return -ENOMEM;
+    }
+
+    rc = fetch_download(key, uuid, cksum, revision, size, &flight->cls);
+    fetch_release(flight, rc);
+
+    return rc;
+}
+
+int fetch_adopt(const char *uuid, const char *cksum, const char *key)
+{
+    char have[FSCACHE_KEY_MAX + 1];
+    char revision[FETCH_REV_MAX + 1];
+
+    /* freshness is tracked per uuid: content downloaded for another file
+     * with the same checksum is recorded as this file's as well */
+    if((0 == dbcache_content_load(uuid, have, FSCACHE_KEY_MAX, revision,
+                FETCH_REV_MAX)) && (0 == strcmp(have, cksum))) {
+        return 0;
+    }
+    return dbcache_content_store(uuid, cksum, "", key, fetch_evict);
+}
+
+int fetch_evict(const char *key)
+{
+    /* no file refers to this object anymore, called with dbcache locked */
+    log_debug("evicting %s", key);
+    blkcache_invalidate(key);
+    return fscache_rm(key);
+}
+
+int fetch_queue(const char *uuid, const char *cksum, const char *revision,
+        size_t size)
+{
+    fetch_job_t *job;
+    fetch_job_t *prev;
+
+    if(0 == fetch_nworkers) {
+        return -ENOSYS;
+    }
+
+    job = malloc(sizeof(fetch_job_t));
+    if(NULL == job) {
+        return -ENOMEM;
+    }
+    memset(job, 0, sizeof(fetch_job_t));
+    strncpy(job->uuid, uuid, FETCH_UUID_MAX);
+    if(cksum) {
+        strncpy(job->cksum, cksum, FSCACHE_KEY_MAX);
+    }
+    if(revision) {
+        strncpy(job->revision, revision, FETCH_REV_MAX);
+    }
+    job->size = size;
+
+    pthread_mutex_lock(&fetch_mutex);
+    if(fetch_queued >= FETCH_QUEUE_MAX) {
+        pthread_mutex_unlock(&fetch_mutex);
+        log_debug("fetch queue full, dropping %s", uuid);
+        free(job);
+        return -EAGAIN;
+    }
+    for(prev = fetch_head; prev; prev = prev->next) {
+        if(0 == strcmp(prev->uuid, job->uuid)) {
+            /* already queued, just bring it up to date */
+            strcpy(prev->cksum, job->cksum);
+            strcpy(prev->revision, job->revision);
+            prev->size = job->size;
+            pthread_mutex_unlock(&fetch_mutex);
+            free(job);
+            return 0;
+        }
+    }
+    if(fetch_tail) {
+        fetch_tail->next = job;
+    } else {
+        fetch_head = job;
+    }
+    fetch_tail = job;
+    fetch_queued++;
+    pthread_cond_signal(&fetch_cond);
+    pthread_mutex_unlock(&fetch_mutex);
+
+    return 0;
+}
+
+static void *fetch_run(void *opaque)
+{
+    fetch_job_t *job;
+
+    (void)opaque;
+
+    /* background work must not compete with opens for cpu and disk */
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), FETCH_NICE);
+
+    pthread_mutex_lock(&fetch_mutex);
+    while(keep_running) {
+        if(NULL == fetch_head) {
+            pthread_cond_wait(&fetch_cond, &fetch_mutex);
+            continue;
+        }
+        job = fetch_head;
+        fetch_head = job->next;
+        if(NULL == fetch_head) {
+            fetch_tail = NULL;
+        }
+        fetch_queued--;
+        pthread_mutex_unlock(&fetch_mutex);
+
+        if(job->dir > 0) {
+            fetch_siblings(job->dir);
+        } else if(!fetch_current(job)) {
+            log_debug("background fetch of %s", job->uuid);
+            fetch_file(job->uuid, job->cksum, job->revision, job->size,
+                    XFER_PREFETCH);
+        }
+        free(job);
+
+        pthread_mutex_lock(&fetch_mutex);
+    }
+    pthread_mutex_unlock(&fetch_mutex);
+
+    return NULL;
+}
+
+int fetch_pinned(int64_t id)
+{
+    int pinned;
+    int64_t files;
+    int64_t bytes;
+
+    int cb(const char *uuid, const char *cksum, int64_t size) {
+        /* stop at a full queue, the next sweep picks up the rest */
+        return (-EAGAIN == fetch_queue(uuid, cksum, NULL, (size_t)size));
+    }
+
+    if(dbcache_pin_status(id, &pinned, &files, &bytes) != 0) {
+        return -EIO;
+    }
+    if(files > 0) {
+        log_info("pinned content pending: %ld files, %ld bytes",
+                (long)files, (long)bytes);
+        dbcache_pin_pending(id, cb);
+    }
+    return 0;
+}
+
+int fetch_dir(int64_t dir)
+{
+    fetch_job_t *job;
+    time_t now;
+    int i;
+
+    if((0 == fetch_sibling_max) || (0 == fetch_nworkers)) {
+        return 0;
+    }
+
+    /* once per directory and window, whichever of readdir and open comes
+     * first */
+    time(&now);
+    pthread_mutex_lock(&fetch_mutex);
+    for(i = 0; i < FETCH_DIRS; i++) {
+        if((fetch_dirs[i].dir == dir) &&
+                (now - fetch_dirs[i].ts < FETCH_DIR_WINDOW)) {
+            pthread_mutex_unlock(&fetch_mutex);
+            return 0;
+        }
+    }
+    fetch_dirs[fetch_ndirs % FETCH_DIRS].dir = dir;
+    fetch_dirs[fetch_ndirs % FETCH_DIRS].ts = now;
+    fetch_ndirs++;
+    pthread_mutex_unlock(&fetch_mutex);
+
+    job = malloc(sizeof(fetch_job_t));
+    if(NULL == job) {
+        return -ENOMEM;
+    }
+    memset(job, 0, sizeof(fetch_job_t));
+    job->dir = dir;
+
+    pthread_mutex_lock(&fetch_mutex);
+    if(fetch_queued >= FETCH_QUEUE_MAX) {
+        pthread_mutex_unlock(&fetch_mutex);
+        free(job);
+        return -EAGAIN;
+    }
+    if(fetch_tail) {
+        fetch_tail->next = job;
+    } else {
+        fetch_head = job;
+    }
+    fetch_tail = job;
+    fetch_queued++;
+    pthread_cond_signal(&fetch_cond);
+    pthread_mutex_unlock(&fetch_mutex);
+
+    return 0;
+}
+
+static void fetch_siblings(int64_t dir)
+{
+    fetch_item_t items[FETCH_BATCH_MAX];
+    fetch_flight_t *flights[FETCH_BATCH_MAX];
+    fscache_sink_t *sinks[FETCH_BATCH_MAX];
+    const char *ids[FETCH_BATCH_MAX];
+    int rcs[FETCH_BATCH_MAX];
+    int nitems;
+    int n;
+    int i;
+    int rc;
+
+    int cb(const char *uuid, const char *cksum, int64_t size) {
+        strncpy(items[nitems].uuid, uuid, FETCH_UUID_MAX);
+        strncpy(items[nitems].cksum, cksum, FSCACHE_KEY_MAX);
+        items[nitems].size = (size_t)size;
+        nitems++;
+        return (nitems >= FETCH_BATCH_MAX);
+    }
+
+    memset(items, 0, FETCH_BATCH_MAX * sizeof(fetch_item_t));
+    nitems = 0;
+    dbcache_dir_small(dir, (int64_t)fetch_sibling_max, FETCH_BATCH_MAX, cb);
+
+    /* skip whatever is cached under another file or being downloaded
+     * already */
+    n = 0;
+    for(i = 0; i < nitems; i++) {
+        fscache_key(items[i].uuid, items[i].cksum, items[i].size,
+                items[i].key, FSCACHE_KEY_MAX);
+        if(strlen(items[i].cksum) && fetch_have(items[i].key, items[i].size)) {
+            fetch_adopt(items[i].uuid, items[i].cksum, items[i].key);
+            continue;
+        }
+        pthread_mutex_lock(&fetch_mutex);
+        flights[n] = fetch_find(items[i].key) ? NULL :
+                fetch_claim(items[i].key, XFER_PREFETCH);
+        pthread_mutex_unlock(&fetch_mutex);
+        if(NULL == flights[n]) {
+            continue;
+        }
+        sinks[n] = fscache_sink_open(items[i].key, items[i].size);
+        if(NULL == sinks[n]) {
+            fetch_release(flights[n], -EIO);
+            continue;
+        }
+        if(n != i) {
+            memcpy(&items[n], &items[i], sizeof(fetch_item_t));
+        }
+        ids[n] = items[n].uuid;
+        n++;
+    }
+    if(0 == n) {
+        return;
+    }
+
+    log_debug("fetching %d small files of directory %ld", n, (long)dir);
+    drive_download_batch(ids, sinks, rcs, n);
+
+    for(i = 0; i < n; i++) {
+        if(0 == rcs[i]) {
+            rc = fscache_sink_close(sinks[i], 1);
+            blkcache_invalidate(items[i].key);
+        } else {
+            rc = rcs[i];
+            fscache_sink_close(sinks[i], 0);
+        }
+        if(0 == rc) {
+            dbcache_content_store(items[i].uuid, items[i].cksum, "",
+                    items[i].key, fetch_evict);
+        }
+        fetch_release(flights[i], rc);
+    }
+}
+
+static fetch_flight_t *fetch_find(const char *key)
+{
+    fetch_flight_t *flight;
+
+    /* called with fetch_mutex held */
+    for(flight = fetch_flights; flight; flight = flight->next) {
+        if(0 == strcmp(flight->key, key)) {
+            break;
+        }
+    }
+    return flight;
+}
+
+static fetch_flight_t *fetch_claim(const char *key, int cls)
+{
+    fetch_flight_t *flight;
+
+    /* called with fetch_mutex held */
+    flight = malloc(sizeof(fetch_flight_t));
+    if(NULL == flight) {
+        return NULL;
+    }
+    memset(flight, 0, sizeof(fetch_flight_t));
+    strncpy(flight->key, key, FSCACHE_KEY_MAX);
+    flight->cls = cls;
+    flight->waiters = 1;
+    flight->next = fetch_flights;
+    fetch_flights = flight;
+    return flight;
+}
+
+static void fetch_release(fetch_flight_t *flight, int rc)
+{
+    fetch_flight_t *prev;
+
+    pthread_mutex_lock(&fetch_mutex);
+    if(fetch_flights == flight) {
+        fetch_flights = flight->next;
+    } else {
+        for(prev = fetch_flights; prev->next != flight; prev = prev->next);
+        prev->next = flight->next;
+    }
+    flight->done = 1;
+    flight->rc = rc;
+    flight->waiters--;
+    if(0 == flight->waiters) {
+        free(flight);
+    }
+    pthread_cond_broadcast(&fetch_cond);
+    pthread_mutex_unlock(&fetch_mutex);
+}
+
+static int fetch_current(fetch_job_t *job)
+{
+    char cksum[FSCACHE_KEY_MAX + 1];
+    char revision[FETCH_REV_MAX + 1];
+
+    /* queued twice, or fetched by an open in the meantime */
+    if(dbcache_content_load(job->uuid, cksum, FSCACHE_KEY_MAX, revision,
+                FETCH_REV_MAX) != 0) {
+        return 0;
+    }
+    if(strlen(job->cksum)) {
+        return 0 == strcmp(cksum, job->cksum);
+    }
+    if(0 == strlen(job->revision)) {
+        /* checksum-less content queued for revalidation by an open: look
+         * up the head revision here, off the open path */
+        if((drive_revision(job->uuid, job->revision, FETCH_REV_MAX,
+                XFER_PREFETCH) != 0) || (0 == strlen(job->revision))) {
+            return 1;
+        }
+    }
+    return 0 == strcmp(revision, job->revision);
+}
+
+static int fetch_have(const char *key, size_t size)
+{
+    struct stat st;
+
+    if((size <= FSCACHE_INLINE_MAX) && (0 == fscache_inline_size(key, NULL))) {
+        return 1;
+    }
+    return 0 == fscache_stat(key, &st);
+}
+
+static int fetch_download(const char *key, const char *uuid,
+        const char *cksum, const char *revision, size_t size, const int *cls)
+{
+    fscache_sink_t *sink;
+    char rev[FETCH_REV_MAX + 1];
+    int rc;
+
+    /* checksum-less content is told apart by the revision it was
+     * downloaded at */
+    memset(rev, 0, (FETCH_REV_MAX + 1) * sizeof(char));
+    if(revision && strlen(revision)) {
+        strncpy(rev, revision, FETCH_REV_MAX);
+    } else if(0 == strlen(cksum)) {
+        drive_revision(uuid, rev, FETCH_REV_MAX, *cls);
+    }
+
+    /* the sink commits with a rename, so readers switch from the old
+     * object to the new one atomically */
+    sink = fscache_sink_open(key, size);
+    if(NULL == sink) {
+        return -EIO;
+    }
+    rc = drive_download(uuid, sink, cls);
+    if(0 == rc) {
+        rc = fscache_sink_close(sink, 1);
+        blkcache_invalidate(key);
+    } else {
+        fscache_sink_close(sink, 0);
+    }
+    if(0 == rc) {
+        dbcache_content_store(uuid, cksum, rev, key, fetch_evict);
+    }
+    return rc;
+}
@@ -15,6 +15,7 @@ along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "fscache.h"
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
@@ -22,98 +23,461 @@ along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
 #include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <sys/syscall.h>
 
 #include "dbcache.h"
 #include "driveapi.h"
+#include "fsio.h"
+#include "fspack.h"
 #include "log.h"
+#include "md5.h"
+#include "probes.h"
+#include "stats.h"
 
-static char fscachedir[PATH_MAX + 1];
+/* cache objects live in <cachedir>/<xx>/<yy>/<uuid>, where xx and yy are
+ * taken from a hash of the uuid; first level dirs are kept open and all
+ * accesses are relative to them */
+#define FSCACHE_FANOUT  256
+#define FSCACHE_REL_MAX 127
+/* present once objects cached under their uuid were moved to their md5 key */
+#define FSCACHE_REKEYED ".rekeyed"
+
+static int fscache_rootfd = -1;
+static int fscache_dirfd[FSCACHE_FANOUT];
+
+/* open descriptors are shared by all handles on the same object and
+ * access mode, idle ones are kept open until pushed out of the lru */
+#define FSCACHE_UUID_MAX    63
+#define FSCACHE_BUCKETS     256
+#define FSCACHE_IDLE_MAX    64
+
+struct _fscache_fd
+{
+    char uuid[FSCACHE_UUID_MAX + 1];
+    int mode;
+    int fd;
+    int refs;
+    int stale;
+    int idle;
+
+    struct _fscache_fd *unext;
+    struct _fscache_fd *fnext;
+    struct _fscache_fd *lprev;
+    struct _fscache_fd *lnext;
+};
+typedef struct _fscache_fd fscache_fd_t;
+
+static fscache_fd_t *fscache_byuuid[FSCACHE_BUCKETS];
+static fscache_fd_t *fscache_byfd[FSCACHE_BUCKETS];
+static fscache_fd_t *fscache_idle_head = NULL;
+static fscache_fd_t *fscache_idle_tail = NULL;
+static int fscache_nidle = 0;
+static pthread_mutex_t fscache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* downloads are staged in <uuid>.part.<tid>, written in aligned chunks
+ * through fsio and renamed over the object once complete; content stored
+ * under an md5 key is hashed on the way and only committed if it matches */
+#define FSCACHE_PART_MAX    (FSCACHE_REL_MAX + 32)
+#define FSCACHE_SINK_ALIGN  4096
+#define FSCACHE_SINK_CHUNK  (1024 * 1024)
+#define FSCACHE_SINK_SLOTS  4
+/* past this size written pages are dropped from the page cache, lagging
+ * FSCACHE_SINK_LAG chunks behind the download */
+#define FSCACHE_SINK_DROP   (64 * 1024 * 1024)
+#define FSCACHE_SINK_LAG    8
+
+struct _fscache_slot
+{
+    fscache_sink_t *sink;
+    char *buf;
+    off_t off;
+    size_t len;
+    int busy;
+};
+typedef struct _fscache_slot fscache_slot_t;
+
+struct _fscache_sink
+{
+    char uuid[FSCACHE_UUID_MAX + 1];
+    int dirfd;
+    char rel[FSCACHE_REL_MAX + 1];
+    char part[FSCACHE_PART_MAX + 1];
+    int fd;
+    size_t size;
+    off_t off;
+    off_t flushed;
+    int cur;
+    int inlined;
+    int reserving;
+    int error;
+    int verify;
+    char md5[MD5_HEX_MAX + 1];
+    md5_t ctx;
+    fscache_slot_t slot[FSCACHE_SINK_SLOTS];
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+static int fscache_sink_stage(fscache_sink_t *);
+static void fscache_sink_reserved(void *, int);
+static void fscache_sink_done(void *, int);
+static int fscache_sink_flush(fscache_sink_t *);
+static void fscache_sink_drain(fscache_sink_t *);
+static int fscache_sink_verify(fscache_sink_t *);
+static int fscache_sink_error(fscache_sink_t *);
+static void fscache_sink_free(fscache_sink_t *);
+
+static uint32_t fscache_hash(const char *);
+static int fscache_locate(const char *, char *, size_t);
+static int fscache_mkshard(int, const char *);
+static int fscache_migrate(void);
+
+static void fscache_idle_push(fscache_fd_t *);
+static void fscache_idle_pull(fscache_fd_t *);
+static void fscache_fd_drop(fscache_fd_t *);
+static void fscache_forget(const char *);
 
 int fscache_setup(const char *cachedir)
 {
-    memset(fscachedir, 0, (PATH_MAX + 1) * sizeof(char));
-    strncpy(fscachedir, cachedir, PATH_MAX);
-    return 0;
+    int i;
+    char name[3];
+    int rc;
+
+    for(i = 0; i < FSCACHE_FANOUT; i++) {
+        fscache_dirfd[i] = -1;
+    }
+
+    fscache_rootfd = open(cachedir, O_RDONLY | O_DIRECTORY);
+    if(fscache_rootfd < 0) {
+        rc = -errno;
+        log_error("unable to open cache dir %s: %d", cachedir, rc);
+        return rc;
+    }
+
+    for(i = 0; i < FSCACHE_FANOUT; i++) {
+        snprintf(name, sizeof(name), "%02x", i);
+        if((mkdirat(fscache_rootfd, name, (mode_t)0700) != 0) &&
+                (errno != EEXIST)) {
+            rc = -errno;
+            log_error("unable to create cache dir %s/%s: %d", cachedir, name,
+                    rc);
+            return rc;
+        }
+        fscache_dirfd[i] = openat(fscache_rootfd, name,
+                O_RDONLY | O_DIRECTORY);
+        if(fscache_dirfd[i] < 0) {
+            rc = -errno;
+            log_error("unable to open cache dir %s/%s: %d", cachedir, name,
+                    rc);
+            return rc;
+        }
+    }
+
+    /* objects left behind are only unreachable, they get fetched again */
+    rc = fscache_migrate();
+    if(rc != 0) {
+        log_warning("cache dir %s only partly migrated: %d", cachedir, rc);
+    }
+
+    return fspack_setup(fscache_rootfd);
 }
 
 int fscache_cleanup(void)
 {
+    int i;
+    fscache_fd_t *e;
+
+    pthread_mutex_lock(&fscache_mutex);
+    for(i = 0; i < FSCACHE_BUCKETS; i++) {
+        while(fscache_byuuid[i]) {
+            e = fscache_byuuid[i];
+            if(e->refs > 0) {
+                log_warning("closing cache object %s still in use", e->uuid);
+            }
+            fscache_fd_drop(e);
+        }
+    }
+    pthread_mutex_unlock(&fscache_mutex);
+
+    fspack_cleanup();
+
+    for(i = 0; i < FSCACHE_FANOUT; i++) {
+        if(fscache_dirfd[i] >= 0) {
+            close(fscache_dirfd[i]);
+            fscache_dirfd[i] = -1;
+        }
+    }
+    if(fscache_rootfd >= 0) {
+        close(fscache_rootfd);
+        fscache_rootfd = -1;
+    }
+    return 0;
+}
+
+int fscache_rekey(void)
+{
+    int fd;
+    int moved;
+    int rc;
+
+    /* content cached before objects were keyed by md5 is still under the
+     * uuid, move whatever is known to be current to its key and drop the
+     * rest, nothing with a checksum is looked up by uuid anymore */
+    int cb(const char *uuid, const char *cksum, int64_t size) {
+        char key[FSCACHE_KEY_MAX + 1];
+        char buf[FSCACHE_INLINE_MAX];
+        char rel[FSCACHE_REL_MAX + 1];
+        char krel[FSCACHE_REL_MAX + 1];
+        int dirfd;
+        int kdirfd;
+        struct stat st;
+        size_t len;
+        int n;
+
+        if(0 == strlen(cksum)) {
+            if(0 == fscache_rm(uuid)) {
+                moved++;
+            }
+            return 0;
+        }
+        fscache_key(uuid, cksum, (size_t)size, key, FSCACHE_KEY_MAX);
+
+        if((0 == fspack_size(uuid, &len)) && (len <= FSCACHE_INLINE_MAX)) {
+            n = fspack_read(uuid, buf, 0, len);
+            if((n >= 0) && (fspack_size(key, NULL) != 0)) {
+                fspack_store(key, buf, (size_t)n);
+            }
+            fspack_rm(uuid);
+            moved++;
+        }
+
+        fscache_forget(uuid);
+        dirfd = fscache_locate(uuid, rel, FSCACHE_REL_MAX);
+        kdirfd = fscache_locate(key, krel, FSCACHE_REL_MAX);
+        if(0 == fstatat(kdirfd, krel, &st, 0)) {
+            /* another file with the same content got there first */
+            if(0 == unlinkat(dirfd, rel, 0)) {
+                moved++;
+            }
+            return 0;
+        }
+        fscache_mkshard(kdirfd, krel);
+        if(0 == renameat(dirfd, rel, kdirfd, krel)) {
+            moved++;
+        } else if(errno != ENOENT) {
+            rc = -errno;
+            log_error("unable to rekey cache object %s: %d", uuid, rc);
+        }
+        return 0;
+    }
+
+    if(0 == faccessat(fscache_rootfd, FSCACHE_REKEYED, F_OK, 0)) {
+        return 0;
+    }
+
+    moved = 0;
+    rc = 0;
+    if(dbcache_content_cached(cb) != 0) {
+        rc = -EIO;
+    }
+    if(moved > 0) {
+        log_info("rekeyed %d cache objects by content", moved);
+    }
+    if(0 == rc) {
+        fd = openat(fscache_rootfd, FSCACHE_REKEYED,
+                O_WRONLY | O_CREAT | O_CLOEXEC, (mode_t)0600);
+        if(fd >= 0) {
+            close(fd);
+        }
+    }
+
+    return rc;
+}
+
+int fscache_key(const char *uuid, const char *checksum, size_t size,
+        char *key, size_t len)
+{
+    /* content with a known md5 is stored once, whatever file refers to
+     * it; the size guards against trivially colliding digests */
+    memset(key, 0, (len + 1) * sizeof(char));
+    if(checksum && strlen(checksum)) {
+        snprintf(key, len, "md5-%s-%lu", checksum, (unsigned long)size);
+    } else {
+        strncpy(key, uuid, len);
+    }
     return 0;
 }
 
 int fscache_create(const char *uuid)
 {
-    char path[PATH_MAX + 1];
+    int dirfd;
+    int fd;
+    char rel[FSCACHE_REL_MAX + 1];
 
-    memset(path, 0, (PATH_MAX + 1) * sizeof(char));
-    snprintf(path, PATH_MAX, "%s/%s", fscachedir, uuid);
-        
-    return creat(path, (mode_t)0600);
+    fscache_forget(uuid);
+
+    dirfd = fscache_locate(uuid, rel, FSCACHE_REL_MAX);
+    fd = openat(dirfd, rel, O_WRONLY | O_CREAT | O_TRUNC, (mode_t)0600);
+    if((fd < 0) && (ENOENT == errno)) {
+        fscache_mkshard(dirfd, rel);
+        fd = openat(dirfd, rel, O_WRONLY | O_CREAT | O_TRUNC, (mode_t)0600);
+    }
+
+    return fd;
 }
 
 int fscache_open(const char *uuid, int flags)
 {
-    char path[PATH_MAX + 1];
+    int dirfd;
+    char rel[FSCACHE_REL_MAX + 1];
+    uint32_t h;
+    int mode;
+    int fd;
+    fscache_fd_t *e;
+    int64_t t;
+
+    h = fscache_hash(uuid);
+    mode = flags & O_ACCMODE;
+
+    pthread_mutex_lock(&fscache_mutex);
+    for(e = fscache_byuuid[h % FSCACHE_BUCKETS]; e; e = e->unext) {
+        if(!e->stale && (e->mode == mode) && (0 == strcmp(e->uuid, uuid))) {
+            if(e->idle) {
+                fscache_idle_pull(e);
+            }
+            e->refs++;
+            fd = e->fd;
+            pthread_mutex_unlock(&fscache_mutex);
+            return fd;
+        }
+    }
+    pthread_mutex_unlock(&fscache_mutex);
+
+    dirfd = fscache_locate(uuid, rel, FSCACHE_REL_MAX);
+
+    log_debug("opening: %s", rel);
+    t = stats_begin();
+    fd = openat(dirfd, rel, mode | O_CLOEXEC);
+    stats_end(STATS_FS_OPEN, t, fd < 0);
+    if(fd < 0) {
+        return -errno;
+    }
+
+    e = malloc(sizeof(fscache_fd_t));
+    if(NULL == e) {
+        close(fd);
+        return -ENOMEM;
+    }
+    memset(e, 0, sizeof(fscache_fd_t));
+    strncpy(e->uuid, uuid, FSCACHE_UUID_MAX);
+    e->mode = mode;
+    e->fd = fd;
+    e->refs = 1;
 
-    memset(path, 0, (PATH_MAX + 1) * sizeof(char));
-    snprintf(path, PATH_MAX, "%s/%s", fscachedir, uuid);
+    pthread_mutex_lock(&fscache_mutex);
+    e->unext = fscache_byuuid[h % FSCACHE_BUCKETS];
+    fscache_byuuid[h % FSCACHE_BUCKETS] = e;
+    e->fnext = fscache_byfd[fd % FSCACHE_BUCKETS];
+    fscache_byfd[fd % FSCACHE_BUCKETS] = e;
+    pthread_mutex_unlock(&fscache_mutex);
 
-    log_debug("opening: %s", path);
-    return open(path, flags);
+    return fd;
 }
 
 int fscache_close(int fd)
 {
     int rc;
-    if(fd >= 0) {
-        rc = close(fd);
-        if(rc < 0) {
-            rc = -errno;
+    fscache_fd_t *e;
+
+    if(fd < 0) {
+        return -EIO;
+    }
+
+    pthread_mutex_lock(&fscache_mutex);
+    for(e = fscache_byfd[fd % FSCACHE_BUCKETS]; e; e = e->fnext) {
+        if(e->fd == fd) {
+            break;
         }
-    } else {
-        rc = -EIO;
+    }
+    if(e) {
+        rc = 0;
+        e->refs--;
+        if(e->refs <= 0) {
+            if(e->stale) {
+                fscache_fd_drop(e);
+            } else {
+                fscache_idle_push(e);
+            }
+        }
+        pthread_mutex_unlock(&fscache_mutex);
+        return rc;
+    }
+    pthread_mutex_unlock(&fscache_mutex);
+
+    rc = close(fd);
+    if(rc < 0) {
+        rc = -errno;
     }
     return rc;
 }
 
 int fscache_read(int fd, char *buf, off_t off, size_t len)
 {
-    off_t noff;
+    ssize_t rc;
+    int64_t t;
 
-    noff = lseek(fd, off, SEEK_SET);
-    if(noff != off) {
-        log_debug("unable to seek");
-        return -1;
+    PROBE3(cache_read, fd, off, len);
+    t = stats_begin();
+    rc = pread(fd, buf, len, off);
+    if(rc < 0) {
+        rc = -errno;
+        log_debug("unable to read: %d", (int)rc);
     }
+    stats_end(STATS_FS_READ, t, rc < 0);
+    PROBE2(cache_read_done, fd, rc);
 
-    return read(fd, buf, len);
+    return (int)rc;
 }
 
 int fscache_write(int fd, const char *buf, off_t off, size_t len)
 {
-    int rc;
+    ssize_t rc;
+    int64_t t;
 
-    rc = lseek(fd, off, SEEK_SET);
-    rc = write(fd, buf, len);
-    (void)rc;
+    PROBE3(cache_write, fd, off, len);
+    t = stats_begin();
+    rc = pwrite(fd, buf, len, off);
+    if(rc < 0) {
+        rc = -errno;
+    }
+    stats_end(STATS_FS_WRITE, t, rc < 0);
+    PROBE2(cache_write_done, fd, rc);
 
-    return 0;
+    return (int)rc;
 }
 
 int fscache_rm(const char *uuid)
 {
     int rc;
-    char path[PATH_MAX + 1];
+    int dirfd;
+    char rel[FSCACHE_REL_MAX + 1];
+
+    fscache_forget(uuid);
 
-    memset(path, 0, (PATH_MAX + 1) * sizeof(char));
-    snprintf(path, PATH_MAX, "%s/%s", fscachedir, uuid);
+    dirfd = fscache_locate(uuid, rel, FSCACHE_REL_MAX);
 
-    rc = unlink(path);
+    rc = unlinkat(dirfd, rel, 0);
     if(rc != 0) {
         rc = -errno;
     }
+    if(0 == fspack_rm(uuid)) {
+        rc = 0;
+    }
 
     return rc;
 }
@@ -135,30 +499,554 @@ int fscache_size(int fd, size_t *sz)
 int fscache_stat(const char *uuid, struct stat *st)
 {
     int rc;
-    char path[PATH_MAX + 1];
+    int dirfd;
+    char rel[FSCACHE_REL_MAX + 1];
 
-    memset(path, 0, (PATH_MAX + 1) * sizeof(char));
-    snprintf(path, PATH_MAX, "%s/%s", fscachedir, uuid);
+    dirfd = fscache_locate(uuid, rel, FSCACHE_REL_MAX);
 
-    rc = stat(path, st);
+    rc = fstatat(dirfd, rel, st, 0);
     if(-1 == rc) {
         rc = -errno;
     }
     return rc;
 }
 
-FILE *fscache_fopen(const char *uuid)
+int fscache_inline_size(const char *uuid, size_t *size)
+{
+    return fspack_size(uuid, size);
+}
+
+int fscache_inline_read(const char *uuid, char *buf, off_t off, size_t len)
+{
+    int64_t t;
+    int rc;
+
+    t = stats_begin();
+    rc = fspack_read(uuid, buf, off, len);
+    stats_end(STATS_FS_INLINE, t, rc < 0);
+    return rc;
+}
+
+fscache_sink_t *fscache_sink_open(const char *uuid, size_t size)
 {
-    char path[PATH_MAX + 1];
+    fscache_sink_t *sink;
+    int i;
+    int rc;
+
+    sink = malloc(sizeof(fscache_sink_t));
+    if(NULL == sink) {
+        return NULL;
+    }
+    memset(sink, 0, sizeof(fscache_sink_t));
+    strncpy(sink->uuid, uuid, FSCACHE_UUID_MAX);
+    sink->size = size;
+    sink->fd = -1;
+    if((0 == strncmp(uuid, "md5-", 4)) && (strlen(uuid) > 4 + MD5_HEX_MAX) &&
+            ('-' == uuid[4 + MD5_HEX_MAX])) {
+        sink->verify = 1;
+        strncpy(sink->md5, uuid + 4, MD5_HEX_MAX);
+        md5_init(&sink->ctx);
+    }
+
+    for(i = 0; i < FSCACHE_SINK_SLOTS; i++) {
+        sink->slot[i].sink = sink;
+        rc = posix_memalign((void **)&sink->slot[i].buf, FSCACHE_SINK_ALIGN,
+                FSCACHE_SINK_CHUNK);
+        if(rc != 0) {
+            sink->slot[i].buf = NULL;
+            sink->error = -rc;
+        }
+    }
+    pthread_mutex_init(&sink->mutex, NULL);
+    pthread_cond_init(&sink->cond, NULL);
+
+    /* small objects are collected in memory and go to the inline pack */
+    if(size <= FSCACHE_INLINE_MAX) {
+        sink->inlined = 1;
+        if(sink->error != 0) {
+            fscache_sink_close(sink, 0);
+            return NULL;
+        }
+        return sink;
+    }
 
-    memset(path, 0, (PATH_MAX + 1) * sizeof(char));
-    snprintf(path, PATH_MAX, "%s/%s", fscachedir, uuid);
+    if(0 == sink->error) {
+        sink->error = fscache_sink_stage(sink);
+    }
+    if(sink->error != 0) {
+        fscache_sink_close(sink, 0);
+        return NULL;
+    }
+
+    if(size > 0) {
+        /* reserve the whole object up front so it is laid out contiguously,
+         * failure (e.g. EOPNOTSUPP) is harmless */
+        sink->reserving = 1;
+        fsio_fallocate(sink->fd, 0, (off_t)size, fscache_sink_reserved, sink);
+        posix_fadvise(sink->fd, 0, (off_t)size, POSIX_FADV_SEQUENTIAL);
+    }
 
-    return fopen(path, "w");
+    return sink;
 }
 
-void fscache_fclose(FILE *f)
+size_t fscache_sink_write(fscache_sink_t *sink, const char *data, size_t len)
 {
-    fclose(f);
+    fscache_slot_t *slot;
+    size_t done;
+    size_t n;
+
+    done = 0;
+    while(done < len) {
+        if(fscache_sink_error(sink) != 0) {
+            /* short count aborts the transfer */
+            return 0;
+        }
+        slot = &sink->slot[sink->cur];
+        n = FSCACHE_SINK_CHUNK - slot->len;
+        if(n > len - done) {
+            n = len - done;
+        }
+        memcpy(slot->buf + slot->len, data + done, n);
+        if(sink->verify) {
+            md5_update(&sink->ctx, data + done, n);
+        }
+        slot->len += n;
+        done += n;
+        if(sink->inlined && (slot->len > FSCACHE_INLINE_MAX)) {
+            /* size in the metadata was missing or stale, spill to a file;
+             * what was collected so far is the head of slot 0 and goes out
+             * with its first flush */
+            sink->inlined = 0;
+            if(fscache_sink_stage(sink) != 0) {
+                return 0;
+            }
+        } else if(FSCACHE_SINK_CHUNK == slot->len) {
+            fscache_sink_flush(sink);
+        }
+    }
+
+    return len;
 }
 
+int fscache_sink_close(fscache_sink_t *sink, int commit)
+{
+    int rc;
+    int dirfd;
+    char rel[FSCACHE_REL_MAX + 1];
+    int64_t t;
+
+    /* commit covers waiting for the staged writes and the rename */
+    t = stats_begin();
+    if(sink->inlined) {
+        rc = fscache_sink_error(sink);
+        if(commit && (0 == rc)) {
+            rc = fscache_sink_verify(sink);
+        }
+        if(commit && (0 == rc)) {
+            rc = fspack_store(sink->uuid, sink->slot[0].buf, sink->slot[0].len);
+        }
+        if(commit && (0 == rc)) {
+            /* an older, bigger revision may still be stored as a file */
+            fscache_forget(sink->uuid);
+            dirfd = fscache_locate(sink->uuid, rel, FSCACHE_REL_MAX);
+            unlinkat(dirfd, rel, 0);
+        }
+        if(commit && (rc != 0)) {
+            log_error("unable to store download of %s: %d", sink->uuid, rc);
+        }
+        if(commit) {
+            stats_end(STATS_FS_COMMIT, t, rc != 0);
+        }
+        fscache_sink_free(sink);
+        return rc;
+    }
+
+    if(sink->fd >= 0) {
+        if(sink->slot[sink->cur].len > 0) {
+            fscache_sink_flush(sink);
+        }
+        fsio_submit();
+        fscache_sink_drain(sink);
+    }
+
+    rc = fscache_sink_error(sink);
+    if(commit && (0 == rc)) {
+        rc = fscache_sink_verify(sink);
+    }
+    if(commit && (0 == rc)) {
+        /* drop whatever fallocate reserved beyond the actual content */
+        if(ftruncate(sink->fd, sink->off) != 0) {
+            rc = -errno;
+        }
+    }
+    if(commit && (0 == rc)) {
+        fscache_forget(sink->uuid);
+        if(renameat(sink->dirfd, sink->part, sink->dirfd, sink->rel) != 0) {
+            rc = -errno;
+        } else {
+            fspack_rm(sink->uuid);
+        }
+    }
+    if(sink->fd >= 0) {
+        close(sink->fd);
+        if(!commit || (rc != 0)) {
+            unlinkat(sink->dirfd, sink->part, 0);
+        }
+    }
+    if(commit && (rc != 0)) {
+        log_error("unable to store download of %s: %d", sink->uuid, rc);
+    }
+    if(commit) {
+        stats_end(STATS_FS_COMMIT, t, rc != 0);
+    }
+
+    fscache_sink_free(sink);
+
+    return rc;
+}
+
+static int fscache_sink_stage(fscache_sink_t *sink)
+{
+    int rc;
+
+    sink->dirfd = fscache_locate(sink->uuid, sink->rel, FSCACHE_REL_MAX);
+    snprintf(sink->part, FSCACHE_PART_MAX, "%s.part.%ld", sink->rel,
+            (long)syscall(SYS_gettid));
+    sink->fd = openat(sink->dirfd, sink->part,
+            O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, (mode_t)0600);
+    if((sink->fd < 0) && (ENOENT == errno)) {
+        fscache_mkshard(sink->dirfd, sink->rel);
+        sink->fd = openat(sink->dirfd, sink->part,
+                O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, (mode_t)0600);
+    }
+    if(sink->fd < 0) {
+        rc = -errno;
+        log_error("unable to stage download of %s: %d", sink->uuid, rc);
+        pthread_mutex_lock(&sink->mutex);
+        sink->error = rc;
+        pthread_mutex_unlock(&sink->mutex);
+        return rc;
+    }
+    return 0;
+}
+
+static int fscache_sink_verify(fscache_sink_t *sink)
+{
+    char md5[MD5_HEX_MAX + 1];
+
+    /* drive may serve a newer revision than the metadata the key was
+     * derived from, such content must not be shared under that key */
+    if(!sink->verify) {
+        return 0;
+    }
+    md5_hex(&sink->ctx, md5);
+    if(strcasecmp(md5, sink->md5) != 0) {
+        log_error("content of %s does not match its checksum: %s", sink->uuid,
+                md5);
+        return -EIO;
+    }
+    return 0;
+}
+
+static int fscache_sink_error(fscache_sink_t *sink)
+{
+    int rc;
+
+    /* set by the fsio completions */
+    pthread_mutex_lock(&sink->mutex);
+    rc = sink->error;
+    pthread_mutex_unlock(&sink->mutex);
+    return rc;
+}
+
+static void fscache_sink_free(fscache_sink_t *sink)
+{
+    int i;
+
+    for(i = 0; i < FSCACHE_SINK_SLOTS; i++) {
+        free(sink->slot[i].buf);
+    }
+    pthread_cond_destroy(&sink->cond);
+    pthread_mutex_destroy(&sink->mutex);
+    free(sink);
+}
+
+static void fscache_sink_done(void *opaque, int res)
+{
+    fscache_slot_t *slot;
+    fscache_sink_t *sink;
+
+    slot = (fscache_slot_t *)opaque;
+    sink = slot->sink;
+
+    pthread_mutex_lock(&sink->mutex);
+    if(res < 0) {
+        sink->error = res;
+    } else if((size_t)res != slot->len) {
+        sink->error = -EIO;
+    }
+    slot->busy = 0;
+    slot->len = 0;
+    pthread_cond_broadcast(&sink->cond);
+    pthread_mutex_unlock(&sink->mutex);
+}
+
+static void fscache_sink_reserved(void *opaque, int res)
+{
+    fscache_sink_t *sink;
+
+    (void)res;
+    sink = (fscache_sink_t *)opaque;
+
+    pthread_mutex_lock(&sink->mutex);
+    sink->reserving = 0;
+    pthread_cond_broadcast(&sink->cond);
+    pthread_mutex_unlock(&sink->mutex);
+}
+
+static int fscache_sink_flush(fscache_sink_t *sink)
+{
+    fscache_slot_t *slot;
+    off_t lag;
+
+    slot = &sink->slot[sink->cur];
+    slot->off = sink->off;
+    slot->busy = 1;
+    sink->off += slot->len;
+    fsio_write(sink->fd, slot->buf, slot->len, slot->off, fscache_sink_done,
+            slot);
+
+    /* start writeback of the previous chunk, and for big objects wait for
+     * older ones and drop them so dirty pages do not pile up; chunks that
+     * far behind have completed since their slot was reused */
+    if(slot->off > 0) {
+        sync_file_range(sink->fd, slot->off - FSCACHE_SINK_CHUNK,
+                FSCACHE_SINK_CHUNK, SYNC_FILE_RANGE_WRITE);
+    }
+    lag = slot->off - (off_t)FSCACHE_SINK_LAG * FSCACHE_SINK_CHUNK;
+    if((sink->size > FSCACHE_SINK_DROP) && (lag > sink->flushed)) {
+        sync_file_range(sink->fd, sink->flushed, lag - sink->flushed,
+                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(sink->fd, sink->flushed, lag - sink->flushed,
+                POSIX_FADV_DONTNEED);
+        sink->flushed = lag;
+    }
+
+    /* wait for the next slot to come back from fsio */
+    sink->cur = (sink->cur + 1) % FSCACHE_SINK_SLOTS;
+    slot = &sink->slot[sink->cur];
+    pthread_mutex_lock(&sink->mutex);
+    if(slot->busy) {
+        pthread_mutex_unlock(&sink->mutex);
+        fsio_submit();
+        pthread_mutex_lock(&sink->mutex);
+    }
+    while(slot->busy) {
+        pthread_cond_wait(&sink->cond, &sink->mutex);
+    }
+    pthread_mutex_unlock(&sink->mutex);
+
+    return fscache_sink_error(sink);
+}
+
+static void fscache_sink_drain(fscache_sink_t *sink)
+{
+    int i;
+
+    pthread_mutex_lock(&sink->mutex);
+    while(sink->reserving) {
+        pthread_cond_wait(&sink->cond, &sink->mutex);
+    }
+    for(i = 0; i < FSCACHE_SINK_SLOTS; i++) {
+        while(sink->slot[i].busy) {
+            pthread_cond_wait(&sink->cond, &sink->mutex);
+        }
+    }
+    pthread_mutex_unlock(&sink->mutex);
+}
+
+static void fscache_idle_push(fscache_fd_t *e)
+{
+    e->lprev = NULL;
+    e->lnext = fscache_idle_head;
+    if(fscache_idle_head) {
+        fscache_idle_head->lprev = e;
+    } else {
+        fscache_idle_tail = e;
+    }
+    fscache_idle_head = e;
+    e->idle = 1;
+    fscache_nidle++;
+
+    while(fscache_nidle > FSCACHE_IDLE_MAX) {
+        fscache_fd_drop(fscache_idle_tail);
+    }
+}
+
+static void fscache_idle_pull(fscache_fd_t *e)
+{
+    if(e->lprev) {
+        e->lprev->lnext = e->lnext;
+    } else {
+        fscache_idle_head = e->lnext;
+    }
+    if(e->lnext) {
+        e->lnext->lprev = e->lprev;
+    } else {
+        fscache_idle_tail = e->lprev;
+    }
+    e->lprev = NULL;
+    e->lnext = NULL;
+    e->idle = 0;
+    fscache_nidle--;
+}
+
+static void fscache_fd_drop(fscache_fd_t *e)
+{
+    fscache_fd_t **pe;
+
+    /* called with fscache_mutex held; a stale entry closed by its last
+     * user was never put on the idle list */
+    if(e->idle) {
+        fscache_idle_pull(e);
+    }
+    for(pe = &fscache_byuuid[fscache_hash(e->uuid) % FSCACHE_BUCKETS]; *pe;
+            pe = &(*pe)->unext) {
+        if(*pe == e) {
+            *pe = e->unext;
+            break;
+        }
+    }
+    for(pe = &fscache_byfd[e->fd % FSCACHE_BUCKETS]; *pe;
+            pe = &(*pe)->fnext) {
+        if(*pe == e) {
+            *pe = e->fnext;
+            break;
+        }
+    }
+    close(e->fd);
+    free(e);
+}
+
+static void fscache_forget(const char *uuid)
+{
+    fscache_fd_t *e;
+    fscache_fd_t *next;
+
+    /* the object is about to be replaced or removed, cached descriptors
+     * must not be handed out anymore */
+    pthread_mutex_lock(&fscache_mutex);
+    for(e = fscache_byuuid[fscache_hash(uuid) % FSCACHE_BUCKETS]; e;
+            e = next) {
+        next = e->unext;
+        if(strcmp(e->uuid, uuid) != 0) {
+            continue;
+        }
+        if(0 == e->refs) {
+            fscache_fd_drop(e);
+        } else {
+            e->stale = 1;
+        }
+    }
+    pthread_mutex_unlock(&fscache_mutex);
+}
+
+static uint32_t fscache_hash(const char *uuid)
+{
+    uint32_t h;
+
+    /* FNV-1a, drive ids are not guaranteed to be evenly distributed */
+    h = 2166136261U;
+    while(*uuid) {
+        h ^= (uint8_t)*uuid;
+        h *= 16777619U;
+        uuid++;
+    }
+    return h;
+}
+
+static int fscache_locate(const char *uuid, char *rel, size_t len)
+{
+    uint32_t h;
+
+    h = fscache_hash(uuid);
+    memset(rel, 0, (len + 1) * sizeof(char));
+    snprintf(rel, len, "%02x/%s", (unsigned int)((h >> 8) & 0xff), uuid);
+
+    return fscache_dirfd[h & 0xff];
+}
+
+static int fscache_mkshard(int dirfd, const char *rel)
+{
+    char name[3];
+
+    memset(name, 0, sizeof(name));
+    strncpy(name, rel, 2);
+    if((mkdirat(dirfd, name, (mode_t)0700) != 0) && (errno != EEXIST)) {
+        return -errno;
+    }
+    return 0;
+}
+
+static int fscache_migrate(void)
+{
+    int fd;
+    DIR *dir;
+    struct dirent *de;
+    struct stat st;
+    int dirfd;
+    char rel[FSCACHE_REL_MAX + 1];
+    int moved;
+    int rc;
+
+    /* move objects left by the flat layout into their shard */
+    fd = dup(fscache_rootfd);
+    if(fd < 0) {
+        return -errno;
+    }
+    dir = fdopendir(fd);
+    if(NULL == dir) {
+        close(fd);
+        return -errno;
+    }
+
+    moved = 0;
+    rc = 0;
+    for(;;) {
+        de = readdir(dir);
+        if(NULL == de) {
+            break;
+        }
+        /* uuids never contain dots: skip ., .., packs and staging files */
+        if(strchr(de->d_name, '.')) {
+            continue;
+        }
+        if(de->d_type != DT_REG) {
+            if(de->d_type != DT_UNKNOWN) {
+                continue;
+            }
+            if((fstatat(fscache_rootfd, de->d_name, &st,
+                    AT_SYMLINK_NOFOLLOW) != 0) || !S_ISREG(st.st_mode)) {
+                continue;
+            }
+        }
+
+        dirfd = fscache_locate(de->d_name, rel, FSCACHE_REL_MAX);
+        fscache_mkshard(dirfd, rel);
+        if(renameat(fscache_rootfd, de->d_name, dirfd, rel) != 0) {
+            rc = -errno;
+            log_error("unable to migrate cache object %s: %d", de->d_name,
+                    rc);
+            continue;
+        }
+        moved++;
+    }
+    closedir(dir);
+
+    if(moved > 0) {
+        log_info("migrated %d cache objects to sharded layout", moved);
+    }
+
+    return rc;
+}
@@ -0,0 +1,362 @@
+This file is part of drive-fuse-sync.
+
+drive-fuse-sync is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+drive-fuse-sync is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "fsio.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif /* HAVE_LIBURING */
+
+#include "log.h"
+
+/* cache disk I/O; with io_uring requests are queued and completed from a
+ * reaper thread, otherwise they run synchronously and the callback is
+ * invoked before returning */
+
+#define FSIO_OP_READ        1
+#define FSIO_OP_WRITE       2
+#define FSIO_OP_FSYNC       3
+#define FSIO_OP_FALLOCATE   4
+
+static int fsio_blocking(int, int, void *, size_t, off_t, fsio_cb_t *,
+        void *);
+
+#ifdef HAVE_LIBURING
+
+/* sqes are only submitted once this many are queued or on fsio_submit() */
+#define FSIO_BATCH      8
+
+struct _fsio_req
+{
+    fsio_cb_t *cb;
+    void *opaque;
+};
+typedef struct _fsio_req fsio_req_t;
+
+static struct io_uring fsio_ring;
+static int fsio_enabled = 0;
+static unsigned int fsio_depth;
+static unsigned int fsio_queued;
+static unsigned int fsio_inflight;
+static pthread_mutex_t fsio_mutex;
+static pthread_cond_t fsio_cond;
+static pthread_t fsio_thread;
+
+static void *fsio_reap(void *);
+static int fsio_queue(int, int, void *, size_t, off_t, fsio_cb_t *, void *);
+
+int fsio_setup(unsigned int depth)
+{
+    int rc;
+
+    if(0 == depth) {
+        return 0;
+    }
+
+    rc = io_uring_queue_init(depth, &fsio_ring, 0);
+    if(rc < 0) {
+        log_warning("io_uring unavailable (%d), using blocking I/O", rc);
+        return 0;
+    }
+
+    pthread_mutex_init(&fsio_mutex, NULL);
+    pthread_cond_init(&fsio_cond, NULL);
+    fsio_depth = depth;
+    fsio_queued = 0;
+    fsio_inflight = 0;
+    fsio_enabled = 1;
+
+    pthread_create(&fsio_thread, NULL, fsio_reap, NULL);
+
+    return 0;
+}
+
+int fsio_cleanup(void)
+{
+    struct io_uring_sqe *sqe;
+
+    if(!fsio_enabled) {
+        return 0;
+    }
+
+    /* completions come in any order, so wait for the ring to go idle
+     * before a nop without request data tells the reaper to exit; the
+     * drain flag keeps the nop behind anything queued meanwhile */
+    pthread_mutex_lock(&fsio_mutex);
+    while(fsio_inflight > 0) {
+        if(fsio_queued > 0) {
+            io_uring_submit(&fsio_ring);
+            fsio_queued = 0;
+        }
+        pthread_cond_wait(&fsio_cond, &fsio_mutex);
+    }
+    for(;;) {
+        sqe = io_uring_get_sqe(&fsio_ring);
+        if(sqe) {
+            break;
+        }
+        io_uring_submit(&fsio_ring);
+    }
+    io_uring_prep_nop(sqe);
+    io_uring_sqe_set_data(sqe, NULL);
+    io_uring_sqe_set_flags(sqe, IOSQE_IO_DRAIN);
+    io_uring_submit(&fsio_ring);
+    fsio_queued = 0;
+    pthread_mutex_unlock(&fsio_mutex);
+
+    pthread_join(fsio_thread, NULL);
+
+    io_uring_queue_exit(&fsio_ring);
+    pthread_cond_destroy(&fsio_cond);
+    pthread_mutex_destroy(&fsio_mutex);
+    fsio_enabled = 0;
+
+    return 0;
+}
+
+int fsio_read(int fd, void *buf, size_t len, off_t off, fsio_cb_t *cb,
+        void *opaque)
+{
+    if(fsio_enabled) {
+        return fsio_queue(FSIO_OP_READ, fd, buf, len, off, cb, opaque);
+    }
+    return fsio_blocking(FSIO_OP_READ, fd, buf, len, off, cb, opaque);
+}
+
+int fsio_write(int fd, const void *buf, size_t len, off_t off, fsio_cb_t *cb,
+        void *opaque)
+{
+    if(fsio_enabled) {
+        return fsio_queue(FSIO_OP_WRITE, fd, (void *)buf, len, off, cb,
+                opaque);
+    }
+    return fsio_blocking(FSIO_OP_WRITE, fd, (void *)buf, len, off, cb,
+            opaque);
+}
+
+int fsio_fsync(int fd, fsio_cb_t *cb, void *opaque)
+{
+    if(fsio_enabled) {
+        return fsio_queue(FSIO_OP_FSYNC, fd, NULL, 0, 0, cb, opaque);
+    }
+    return fsio_blocking(FSIO_OP_FSYNC, fd, NULL, 0, 0, cb, opaque);
+}
+
+int fsio_fallocate(int fd, off_t off, off_t len, fsio_cb_t *cb, void *opaque)
+{
+    if(fsio_enabled) {
+        return fsio_queue(FSIO_OP_FALLOCATE, fd, NULL, len, off, cb, opaque);
+    }
+    return fsio_blocking(FSIO_OP_FALLOCATE, fd, NULL, len, off, cb, opaque);
+}
+
+int fsio_submit(void)
+{
+    int rc;
+
+    if(!fsio_enabled) {
+        return 0;
+    }
+
+    rc = 0;
+    pthread_mutex_lock(&fsio_mutex);
+    if(fsio_queued > 0) {
+        rc = io_uring_submit(&fsio_ring);
+        fsio_queued = 0;
+    }
+    pthread_mutex_unlock(&fsio_mutex);
+
+    return rc < 0 ? rc : 0;
+}
+
+static int fsio_queue(int op, int fd, void *buf, size_t len, off_t off,
+        fsio_cb_t *cb, void *opaque)
+{
+    fsio_req_t *req;
+    struct io_uring_sqe *sqe;
+
+    req = malloc(sizeof(fsio_req_t));
+    if(NULL == req) {
+        return fsio_blocking(op, fd, buf, len, off, cb, opaque);
+    }
+    req->cb = cb;
+    req->opaque = opaque;
+
+    pthread_mutex_lock(&fsio_mutex);
+    /* never have more requests in flight than the completion ring holds */
+    while(fsio_inflight >= fsio_depth) {
+        if(fsio_queued > 0) {
+            io_uring_submit(&fsio_ring);
+            fsio_queued = 0;
+        }
+        pthread_cond_wait(&fsio_cond, &fsio_mutex);
+    }
+    for(;;) {
+        sqe = io_uring_get_sqe(&fsio_ring);
+        if(sqe) {
+            break;
+        }
+        io_uring_submit(&fsio_ring);
+        fsio_queued = 0;
+    }
+    switch(op) {
+    case FSIO_OP_READ:
+        io_uring_prep_read(sqe, fd, buf, len, off);
+        break;
+    case FSIO_OP_WRITE:
+        io_uring_prep_write(sqe, fd, buf, len, off);
+        break;
+    case FSIO_OP_FSYNC:
+        io_uring_prep_fsync(sqe, fd, 0);
+        break;
+    case FSIO_OP_FALLOCATE:
+        io_uring_prep_fallocate(sqe, fd, 0, off, len);
+        break;
+    }
+    io_uring_sqe_set_data(sqe, req);
+    fsio_inflight++;
+    fsio_queued++;
+    if(fsio_queued >= FSIO_BATCH) {
+        io_uring_submit(&fsio_ring);
+        fsio_queued = 0;
+    }
+    pthread_mutex_unlock(&fsio_mutex);
+
+    return 0;
+}
+
+static void *fsio_reap(void *opaque)
+{
+    int rc;
+    struct io_uring_cqe *cqe;
+    fsio_req_t *req;
+    int res;
+
+    (void)opaque;
+
+    for(;;) {
+        rc = io_uring_wait_cqe(&fsio_ring, &cqe);
+        if(rc < 0) {
+            if(-EINTR == rc) {
+                continue;
+            }
+            log_error("io_uring wait failed: %d", rc);
+            break;
+        }
+        req = (fsio_req_t *)io_uring_cqe_get_data(cqe);
+        res = cqe->res;
+        io_uring_cqe_seen(&fsio_ring, cqe);
+        if(NULL == req) {
+            break;
+        }
+
+        pthread_mutex_lock(&fsio_mutex);
+        fsio_inflight--;
+        pthread_cond_broadcast(&fsio_cond);
+        pthread_mutex_unlock(&fsio_mutex);
+
+        if(req->cb) {
+            req->cb(req->opaque, res);
+        }
+        free(req);
+    }
+
+    return NULL;
+}
+
+#else /* HAVE_LIBURING */
+
+int fsio_setup(unsigned int depth)
+{
+    (void)depth;
+    return 0;
+}
+
+int fsio_cleanup(void)
+{
+    return 0;
+}
+
+int fsio_read(int fd, void *buf, size_t len, off_t off, fsio_cb_t *cb,
+        void *opaque)
+{
+    return fsio_blocking(FSIO_OP_READ, fd, buf, len, off, cb, opaque);
+}
+
+int fsio_write(int fd, const void *buf, size_t len, off_t off, fsio_cb_t *cb,
+        void *opaque)
+{
+    return fsio_blocking(FSIO_OP_WRITE, fd, (void *)buf, len, off, cb,
+            opaque);
+}
+
+int fsio_fsync(int fd, fsio_cb_t *cb, void *opaque)
+{
+    return fsio_blocking(FSIO_OP_FSYNC, fd, NULL, 0, 0, cb, opaque);
+}
+
+int fsio_fallocate(int fd, off_t off, off_t len, fsio_cb_t *cb, void *opaque)
+{
+    return fsio_blocking(FSIO_OP_FALLOCATE, fd, NULL, len, off, cb, opaque);
+}
+
+int fsio_submit(void)
+{
+    return 0;
+}
+
+#endif /* HAVE_LIBURING */
+
+static int fsio_blocking(int op, int fd, void *buf, size_t len, off_t off,
+        fsio_cb_t *cb, void *opaque)
+{
+    ssize_t rc;
+
+    rc = -EINVAL;
+    switch(op) {
+    case FSIO_OP_READ:
+        rc = pread(fd, buf, len, off);
+        break;
+    case FSIO_OP_WRITE:
+        rc = pwrite(fd, buf, len, off);
+        break;
+    case FSIO_OP_FSYNC:
+        rc = fsync(fd);
+        break;
+    case FSIO_OP_FALLOCATE:
+        rc = fallocate(fd, 0, off, len);
+        break;
+    }
+    if(rc < 0) {
+        rc = -errno;
+    }
+
+    if(cb) {
+        cb(opaque, (int)rc);
+    }
+
+    return 0;
+}
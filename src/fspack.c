@@ -0,0 +1,524 @@
+This file is part of drive-fuse-sync.
+
+drive-fuse-sync is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+drive-fuse-sync is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "fspack.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+
+/* small objects are appended to a single pack file as
+ * <header><key><data><padding>; the index is rebuilt in memory by scanning
+ * the pack at setup, later records for the same key win and a record
+ * flagged dead removes the key */
+
+#define FSPACK_NAME     "inline.pack"
+#define FSPACK_TMPNAME  "inline.pack.new"
+#define FSPACK_MAGIC    0x4b504644U
+#define FSPACK_DEAD     1
+#define FSPACK_KEY_MAX  63
+#define FSPACK_BUCKETS  65536
+/* the map is grown in steps so appends rarely need a remap */
+#define FSPACK_MAPSTEP  (64 * 1024 * 1024)
+/* dead space is only reclaimed at setup, when it outweighs live data */
+#define FSPACK_COMPACT  (16 * 1024 * 1024)
+
+struct _fspack_hdr
+{
+    uint32_t magic;
+    uint32_t len;
+    uint32_t sum;
+    uint16_t keylen;
+    uint16_t flags;
+};
+typedef struct _fspack_hdr fspack_hdr_t;
+
+struct _fspack_ent
+{
+    char key[FSPACK_KEY_MAX + 1];
+    off_t off;
+    size_t len;
+    struct _fspack_ent *next;
+};
+typedef struct _fspack_ent fspack_ent_t;
+
+static int fspack_dirfd = -1;
+static int fspack_fd = -1;
+static char *fspack_map = NULL;
+static size_t fspack_maplen = 0;
+static off_t fspack_end = 0;
+static size_t fspack_live = 0;
+static size_t fspack_dead = 0;
+static fspack_ent_t **fspack_index = NULL;
+static pthread_rwlock_t fspack_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static uint32_t fspack_hash(const char *, size_t);
+static size_t fspack_reclen(size_t, size_t);
+static fspack_ent_t *fspack_find(const char *);
+static void fspack_index_put(const char *, off_t, size_t);
+static void fspack_index_del(const char *);
+static void fspack_index_clear(void);
+static int fspack_scan(void);
+static int fspack_remap(size_t);
+static int fspack_append(const char *, const char *, size_t, int);
+static int fspack_compact(void);
+
+int fspack_setup(int dirfd)
+{
+    int rc;
+
+    fspack_index = malloc(FSPACK_BUCKETS * sizeof(fspack_ent_t *));
+    if(NULL == fspack_index) {
+        return -ENOMEM;
+    }
+    memset(fspack_index, 0, FSPACK_BUCKETS * sizeof(fspack_ent_t *));
+
+    fspack_dirfd = dirfd;
+    fspack_fd = openat(dirfd, FSPACK_NAME, O_RDWR | O_CREAT | O_CLOEXEC,
+            (mode_t)0600);
+    if(fspack_fd < 0) {
+        rc = -errno;
+        log_error("unable to open %s", FSPACK_NAME);
+        return rc;
+    }
+
+    rc = fspack_scan();
+    if(rc != 0) {
+        return rc;
+    }
+
+    if((fspack_dead > FSPACK_COMPACT) && (fspack_dead > fspack_live)) {
+        rc = fspack_compact();
+        if(rc != 0) {
+            log_warning("unable to compact %s: %d", FSPACK_NAME, rc);
+        }
+    }
+
+    log_info("inline pack: %lu live bytes, %lu dead bytes",
+            (unsigned long)fspack_live, (unsigned long)fspack_dead);
+
+    return fspack_remap(fspack_end);
+}
+
+int fspack_cleanup(void)
+{
+    pthread_rwlock_wrlock(&fspack_lock);
+    if(fspack_map) {
+        munmap(fspack_map, fspack_maplen);
+        fspack_map = NULL;
+        fspack_maplen = 0;
+    }
+    if(fspack_fd >= 0) {
+        close(fspack_fd);
+        fspack_fd = -1;
+    }
+    if(fspack_index) {
+        fspack_index_clear();
+        free(fspack_index);
+        fspack_index = NULL;
+    }
+    pthread_rwlock_unlock(&fspack_lock);
+
+    return 0;
+}
+
+int fspack_store(const char *key, const char *data, size_t len)
+{
+    int rc;
+
+    pthread_rwlock_wrlock(&fspack_lock);
+    rc = fspack_append(key, data, len, 0);
+    pthread_rwlock_unlock(&fspack_lock);
+
+    return rc;
+}
+
+int fspack_read(const char *key, char *buf, off_t off, size_t len)
+{
+    int rc;
+    fspack_ent_t *e;
+
+    pthread_rwlock_rdlock(&fspack_lock);
+    e = fspack_find(key);
+    if(NULL == e) {
+        rc = -ENOENT;
+    } else if((size_t)off >= e->len) {
+        rc = 0;
+    } else {
+        if(len > e->len - (size_t)off) {
+            len = e->len - (size_t)off;
+        }
+        memcpy(buf, fspack_map + e->off + off, len);
+        rc = (int)len;
+    }
+    pthread_rwlock_unlock(&fspack_lock);
+
+    return rc;
+}
+
+int fspack_size(const char *key, size_t *size)
+{
+    int rc;
+    fspack_ent_t *e;
+
+    pthread_rwlock_rdlock(&fspack_lock);
+    e = fspack_find(key);
+    if(e) {
+        if(size) {
+            *size = e->len;
+        }
+        rc = 0;
+    } else {
+        rc = -ENOENT;
+    }
+    pthread_rwlock_unlock(&fspack_lock);
+
+    return rc;
+}
+
+int fspack_rm(const char *key)
+{
+    int rc;
+
+    pthread_rwlock_wrlock(&fspack_lock);
+    if(fspack_find(key)) {
+        rc = fspack_append(key, NULL, 0, FSPACK_DEAD);
+    } else {
+        rc = -ENOENT;
+    }
+    pthread_rwlock_unlock(&fspack_lock);
+
+    return rc;
+}
+
+static uint32_t fspack_hash(const char *data, size_t len)
+{
+    uint32_t h;
+    size_t i;
+
+    h = 2166136261U;
+    for(i = 0; i < len; i++) {
+        h ^= (uint8_t)data[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static size_t fspack_reclen(size_t keylen, size_t len)
+{
+    return (sizeof(fspack_hdr_t) + keylen + len + 7) & ~(size_t)7;
+}
+
+static fspack_ent_t *fspack_find(const char *key)
+{
+    fspack_ent_t *e;
+
+    e = fspack_index[fspack_hash(key, strlen(key)) % FSPACK_BUCKETS];
+    for(; e; e = e->next) {
+        if(0 == strcmp(e->key, key)) {
+            break;
+        }
+    }
+    return e;
+}
+
+static void fspack_index_put(const char *key, off_t off, size_t len)
+{
+    fspack_ent_t *e;
+    uint32_t b;
+
+    e = fspack_find(key);
+    if(e) {
+        fspack_live -= e->len;
+        fspack_dead += fspack_reclen(strlen(key), e->len);
+    } else {
+        e = malloc(sizeof(fspack_ent_t));
+        if(NULL == e) {
+            return;
+        }
+        memset(e, 0, sizeof(fspack_ent_t));
+        strncpy(e->key, key, FSPACK_KEY_MAX);
+        b = fspack_hash(key, strlen(key)) % FSPACK_BUCKETS;
+        e->next = fspack_index[b];
+        fspack_index[b] = e;
+    }
+    e->off = off;
+    e->len = len;
+    fspack_live += len;
+}
+
+static void fspack_index_del(const char *key)
+{
+    fspack_ent_t **pe;
+    fspack_ent_t *e;
+
+    pe = &fspack_index[fspack_hash(key, strlen(key)) % FSPACK_BUCKETS];
+    for(; *pe; pe = &(*pe)->next) {
+        if(0 == strcmp((*pe)->key, key)) {
+            e = *pe;
+            *pe = e->next;
+            fspack_live -= e->len;
+            fspack_dead += fspack_reclen(strlen(key), e->len);
+            free(e);
+            break;
+        }
+    }
+}
+
+static void fspack_index_clear(void)
+{
+    int i;
+    fspack_ent_t *e;
+
+    for(i = 0; i < FSPACK_BUCKETS; i++) {
+        while(fspack_index[i]) {
+            e = fspack_index[i];
+            fspack_index[i] = e->next;
+            free(e);
+        }
+    }
+    fspack_live = 0;
+    fspack_dead = 0;
+}
+
+static int fspack_scan(void)
+{
+    struct stat st;
+    char *map;
+    off_t off;
+    fspack_hdr_t hdr;
+    char key[FSPACK_KEY_MAX + 1];
+    size_t reclen;
+
+    if(fstat(fspack_fd, &st) != 0) {
+        return -errno;
+    }
+    off = 0;
+    if(st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fspack_fd, 0);
+        if(MAP_FAILED == map) {
+            return -errno;
+        }
+        while(off + (off_t)sizeof(fspack_hdr_t) <= st.st_size) {
+            memcpy(&hdr, map + off, sizeof(fspack_hdr_t));
+            reclen = fspack_reclen(hdr.keylen, hdr.len);
+            if((hdr.magic != FSPACK_MAGIC) || (0 == hdr.keylen) ||
+                    (hdr.keylen > FSPACK_KEY_MAX) ||
+                    (off + (off_t)reclen > st.st_size)) {
+                break;
+            }
+            if(hdr.sum != fspack_hash(map + off + sizeof(fspack_hdr_t),
+                    hdr.keylen + hdr.len)) {
+                break;
+            }
+            memset(key, 0, (FSPACK_KEY_MAX + 1) * sizeof(char));
+            memcpy(key, map + off + sizeof(fspack_hdr_t), hdr.keylen);
+            if(hdr.flags & FSPACK_DEAD) {
+                fspack_index_del(key);
+                fspack_dead += reclen;
+            } else {
+                fspack_index_put(key,
+                        off + sizeof(fspack_hdr_t) + hdr.keylen, hdr.len);
+            }
+            off += reclen;
+        }
+        munmap(map, st.st_size);
+    }
+
+    if(off < st.st_size) {
+        /* torn append from a previous run */
+        log_warning("dropping %ld trailing bytes from %s",
+                (long)(st.st_size - off), FSPACK_NAME);
+        if(ftruncate(fspack_fd, off) != 0) {
+            return -errno;
+        }
+    }
+    fspack_end = off;
+
+    return 0;
+}
+
+static int fspack_remap(size_t need)
+{
+    size_t len;
+    char *map;
+    int rc;
+
+    if(fspack_map && (need <= fspack_maplen)) {
+        return 0;
+    }
+
+    len = ((need / FSPACK_MAPSTEP) + 1) * FSPACK_MAPSTEP;
+    map = mmap(NULL, len, PROT_READ, MAP_SHARED, fspack_fd, 0);
+    if(MAP_FAILED == map) {
+        rc = -errno;
+        log_error("unable to map %s", FSPACK_NAME);
+        return rc;
+    }
+    if(fspack_map) {
+        munmap(fspack_map, fspack_maplen);
+    }
+    fspack_map = map;
+    fspack_maplen = len;
+
+    return 0;
+}
+
+static int fspack_append(const char *key, const char *data, size_t len,
+        int flags)
+{
+    fspack_hdr_t *hdr;
+    char *rec;
+    size_t keylen;
+    size_t reclen;
+    ssize_t n;
+    int rc;
+
+    /* called with fspack_lock held for writing */
+    keylen = strlen(key);
+    if((0 == keylen) || (keylen > FSPACK_KEY_MAX)) {
+        return -EINVAL;
+    }
+    reclen = fspack_reclen(keylen, len);
+    rec = malloc(reclen);
+    if(NULL == rec) {
+        return -ENOMEM;
+    }
+    memset(rec, 0, reclen);
+    hdr = (fspack_hdr_t *)rec;
+    hdr->magic = FSPACK_MAGIC;
+    hdr->len = (uint32_t)len;
+    hdr->keylen = (uint16_t)keylen;
+    hdr->flags = (uint16_t)flags;
+    memcpy(rec + sizeof(fspack_hdr_t), key, keylen);
+    if(len > 0) {
+        memcpy(rec + sizeof(fspack_hdr_t) + keylen, data, len);
+    }
+    hdr->sum = fspack_hash(rec + sizeof(fspack_hdr_t), keylen + len);
+
+    n = pwrite(fspack_fd, rec, reclen, fspack_end);
+    free(rec);
+    if(n != (ssize_t)reclen) {
+        rc = (n < 0) ? -errno : -EIO;
+        /* leave no partial record behind for the next append */
+        if(ftruncate(fspack_fd, fspack_end) != 0) {
+            log_error("unable to truncate %s", FSPACK_NAME);
+        }
+        return rc;
+    }
+
+    rc = fspack_remap(fspack_end + reclen);
+    if(rc != 0) {
+        return rc;
+    }
+
+    if(flags & FSPACK_DEAD) {
+        fspack_index_del(key);
+        fspack_dead += reclen;
+    } else {
+        fspack_index_put(key, fspack_end + sizeof(fspack_hdr_t) + keylen,
+                len);
+    }
+    fspack_end += reclen;
+
+    return 0;
+}
+
+static int fspack_compact(void)
+{
+    int fd;
+    int rc;
+    int i;
+    fspack_ent_t *e;
+    char *map;
+    struct stat st;
+    int oldfd;
+    off_t oldend;
+
+    if(fstat(fspack_fd, &st) != 0) {
+        return -errno;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fspack_fd, 0);
+    if(MAP_FAILED == map) {
+        return -errno;
+    }
+
+    fd = openat(fspack_dirfd, FSPACK_TMPNAME,
+            O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, (mode_t)0600);
+    if(fd < 0) {
+        rc = -errno;
+        munmap(map, st.st_size);
+        return rc;
+    }
+
+    /* rewrite live records into a fresh pack, rebuilding the index */
+    oldfd = fspack_fd;
+    oldend = fspack_end;
+    fspack_fd = fd;
+    fspack_end = 0;
+    rc = 0;
+    for(i = 0; (i < FSPACK_BUCKETS) && (0 == rc); i++) {
+        for(e = fspack_index[i]; e && (0 == rc); e = e->next) {
+            rc = fspack_append(e->key, map + e->off, e->len, 0);
+        }
+    }
+    munmap(map, st.st_size);
+
+    if(0 == rc) {
+        rc = fsync(fd);
+        if(0 == rc) {
+            rc = renameat(fspack_dirfd, FSPACK_TMPNAME, fspack_dirfd,
+                    FSPACK_NAME);
+        }
+        if(rc != 0) {
+            rc = -errno;
+        }
+    }
+    if(rc != 0) {
+        /* keep going with the old pack */
+        close(fd);
+        unlinkat(fspack_dirfd, FSPACK_TMPNAME, 0);
+        if(fspack_map) {
+            munmap(fspack_map, fspack_maplen);
+            fspack_map = NULL;
+            fspack_maplen = 0;
+        }
+        fspack_fd = oldfd;
+        fspack_end = oldend;
+        fspack_index_clear();
+        fspack_scan();
+        return rc;
+    }
+
+    close(oldfd);
+    fspack_live = 0;
+    fspack_dead = 0;
+    for(i = 0; i < FSPACK_BUCKETS; i++) {
+        for(e = fspack_index[i]; e; e = e->next) {
+            fspack_live += e->len;
+        }
+    }
+
+    return 0;
+}
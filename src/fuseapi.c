@@ -17,30 +17,105 @@ along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
 #include <fcntl.h>
 #include <limits.h>
 #include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
 
+#include "blkcache.h"
 #include "dbcache.h"
+#include "fetch.h"
 #include "fscache.h"
+#include "history.h"
 #include "driveapi.h"
 #include "log.h"
+#include "probes.h"
+#include "stats.h"
+#include "trace.h"
+#include "xfer.h"
 
 #define SECTSIZE    512L
 #define BLOCKSIZE   4096L
 
+#define REVISION_MAX    127
+
+/* read only stats, rendered anew on every open; not in the db so nothing
+ * here can shadow or be synced as a drive file */
+#define FAPI_VDIR       "/.dfs"
+#define FAPI_VSTATS     FAPI_VDIR "/stats"
+#define FAPI_VNONE      0
+#define FAPI_VISDIR     1
+#define FAPI_VISSTATS   2
+
+/* checksum-less files are kept current by the changes feed; opens only
+ * queue a background check of the head revision, once per uuid every
+ * FAPI_REVAL_TTL seconds */
+#define FAPI_REVAL_TTL      60
+#define FAPI_REVAL_SLOTS    1024
+
+struct _fapi_reval
+{
+    char uuid[FSCACHE_KEY_MAX + 1];
+    time_t checked;
+};
+typedef struct _fapi_reval fapi_reval_t;
+
+static fapi_reval_t fapi_reval[FAPI_REVAL_SLOTS];
+static pthread_mutex_t fapi_reval_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 static uid_t uid = 0;
 static gid_t gid = 0;
 
+/* per open handle, stored in fi->fh; fd is -1 for objects served from
+ * the inline pack or, with mem set, from a rendered virtual file */
+struct _fapi_file
+{
+    int fd;
+    char key[FSCACHE_KEY_MAX + 1];
+    char *mem;
+    size_t memlen;
+};
+typedef struct _fapi_file fapi_file_t;
+
+#define FAPI_FILE(fi)   ((fapi_file_t *)(uintptr_t)(fi)->fh)
+
+static int fuseapi_attach(fapi_file_t *, size_t, int);
+static int fuseapi_revalidate(fapi_file_t *, const char *, size_t);
+static int fuseapi_reval_due(const char *);
+static int fuseapi_virtual(const char *);
+static int fuseapi_stats(fapi_file_t *);
+
 static int fuseapi_getattr(const char *path, struct stat *st)
 {
     log_debug("fuseapi_getattr: %s", path);
 
     memset(st, 0, sizeof(struct stat));
+    switch(fuseapi_virtual(path)) {
+    case FAPI_VISDIR:
+        st->st_mode = S_IFDIR | 0555;
+        st->st_size = BLOCKSIZE;
+        break;
+    case FAPI_VISSTATS:
+        /* size unknown until rendered, reads are direct */
+        st->st_mode = S_IFREG | 0444;
+        break;
+    }
+    if(st->st_mode != 0) {
+        st->st_nlink = 1;
+        st->st_uid = uid;
+        st->st_gid = gid;
+        st->st_blksize = BLOCKSIZE;
+        clock_gettime(CLOCK_REALTIME, &st->st_mtim);
+        st->st_atim = st->st_mtim;
+        st->st_ctim = st->st_mtim;
+        return 0;
+    }
     int cb(int64_t id, const char *uuid, const char *name, int type,
             size_t size, mode_t mode, const struct timespec *atime,
             const struct timespec *mtime, const struct timespec *ctime,
@@ -90,6 +165,10 @@ static int fuseapi_mkdir(const char *path, mode_t mode)
 {
     log_debug("fuseapi_mkdir: %s", path);
 
+    if(fuseapi_virtual(path) != FAPI_VNONE) {
+        return -EEXIST;
+    }
+
     int cb(int64_t id, const char *uuid, const char *name, int type,
             size_t size, mode_t mode, const struct timespec *atime,
             const struct timespec *mtime, const struct timespec *ctime,
@@ -140,6 +219,9 @@ static int fuseapi_mkdir(const char *path, mode_t mode)
 static int fuseapi_rmdir(const char *path)
 {
     log_debug("fuseapi_rmdir: %s", path);
+    if(fuseapi_virtual(path) != FAPI_VNONE) {
+        return -EPERM;
+    }
     int cb(int64_t id, const char *uuid, const char *name, int type,
             size_t size, mode_t mode, const struct timespec *atime,
             const struct timespec *mtime, const struct timespec *ctime,
@@ -191,54 +273,381 @@ static int fuseapi_open(const char *path,
               struct fuse_file_info *fi)
 {
     int rc;
+    char fuuid[FSCACHE_KEY_MAX + 1];
+    char fcksum[FSCACHE_KEY_MAX + 1];
+    size_t fsize;
+    int64_t fparent;
+    fapi_file_t *file;
 
     log_debug("fuseapi_open: %s", path);
 
+    switch(fuseapi_virtual(path)) {
+    case FAPI_VISDIR:
+        return -EISDIR;
+    case FAPI_VISSTATS:
+        if((fi->flags & O_ACCMODE) != O_RDONLY) {
+            return -EACCES;
+        }
+        file = malloc(sizeof(fapi_file_t));
+        if(NULL == file) {
+            return -ENOMEM;
+        }
+        memset(file, 0, sizeof(fapi_file_t));
+        file->fd = -1;
+        rc = fuseapi_stats(file);
+        if(rc != 0) {
+            free(file);
+            return rc;
+        }
+        fi->fh = (uint64_t)(uintptr_t)file;
+        fi->direct_io = 1;
+        return 0;
+    }
+
+    /* only copy the entry out here, fetching happens once the db is
+     * released */
     int cb(int64_t id, const char *uuid, const char *name, int type,
             size_t size, mode_t mode, const struct timespec *atime,
             const struct timespec *mtime, const struct timespec *ctime,
             const char *checksum, int64_t parent) {
-        struct stat st;
-        FILE *f;
-
         (void)id;
         (void)name;
         (void)type;
-        (void)size;
         (void)mode;
         (void)atime;
         (void)mtime;
         (void)ctime;
-        (void)checksum;
-        (void)parent;
 
-        rc = fscache_stat(uuid, &st);
-        if(-ENOENT == rc) {
-            f = fscache_fopen(uuid);
-            if(f) {
-                rc = drive_download(uuid, f);
-                fscache_fclose(f);
-            }
+        memset(fuuid, 0, (FSCACHE_KEY_MAX + 1) * sizeof(char));
+        strncpy(fuuid, uuid, FSCACHE_KEY_MAX);
+        memset(fcksum, 0, (FSCACHE_KEY_MAX + 1) * sizeof(char));
+        if(checksum) {
+            strncpy(fcksum, checksum, FSCACHE_KEY_MAX);
         }
+        fsize = size;
+        fparent = parent;
+        return 0;
+    }
+
+    rc = dbcache_findbypath(path, cb);
+    if(rc != 0) {
+        return rc;
+    }
+
+    file = malloc(sizeof(fapi_file_t));
+    if(NULL == file) {
+        return -ENOMEM;
+    }
+    memset(file, 0, sizeof(fapi_file_t));
+    file->fd = -1;
+    fscache_key(fuuid, fcksum, fsize, file->key, FSCACHE_KEY_MAX);
+
+    /* identical content under another uuid is found here and never
+     * downloaded twice */
+    rc = fuseapi_attach(file, fsize, fi->flags);
+    if((0 == rc) && (0 == strlen(fcksum))) {
+        rc = fuseapi_revalidate(file, fuuid, fsize);
+    } else if(0 == rc) {
+        /* keeps prefetch and pinning from queueing it again */
+        fetch_adopt(fuuid, fcksum, file->key);
+    }
+    if(-ENOENT == rc) {
+        rc = fetch_file(fuuid, fcksum, NULL, fsize, XFER_INTERACTIVE);
         if(0 == rc) {
-            rc = fscache_open(uuid, fi->flags);
-            if(rc >= 0) {
-                fi->fh = rc;
-                rc = 0;
-            }
+            rc = fuseapi_attach(file, fsize, fi->flags);
         }
-        return rc;
     }
-    
-    return dbcache_findbypath(path, cb);
+    if(0 == rc) {
+        fi->fh = (uint64_t)(uintptr_t)file;
+        history_open(fuuid);
+        fetch_dir(fparent);
+    } else {
+        free(file);
+    }
+    return rc;
+}
+
+static int fuseapi_revalidate(fapi_file_t *file, const char *uuid,
+        size_t size)
+{
+    char cksum[FSCACHE_KEY_MAX + 1];
+    char have[REVISION_MAX + 1];
+    char want[REVISION_MAX + 1];
+
+    if(!fuseapi_reval_due(uuid)) {
+        return 0;
+    }
+    /* serve the copy at hand, a stale one is replaced by the worker */
+    if(0 == fetch_queue(uuid, "", NULL, size)) {
+        return 0;
+    }
+
+    /* no worker to take it, check right away */
+    /* keyed by uuid, so the checksum can not tell a stale copy: compare
+     * the revision it was downloaded at with the current head, keeping
+     * the copy when drive can not be reached */
+    dbcache_content_load(uuid, cksum, FSCACHE_KEY_MAX, have, REVISION_MAX);
+    if(drive_revision(uuid, want, REVISION_MAX, XFER_INTERACTIVE) != 0) {
+        return 0;
+    }
+    if((0 == strlen(want)) || (0 == strcmp(have, want))) {
+        return 0;
+    }
+
+    log_debug("stale copy of %s: %s -> %s", uuid, have, want);
+    if(file->fd >= 0) {
+        fscache_close(file->fd);
+        file->fd = -1;
+    }
+    return -ENOENT;
+}
+
+static int fuseapi_reval_due(const char *uuid)
+{
+    fapi_reval_t *e;
+    const char *p;
+    uint32_t h;
+    time_t now;
+    int due;
+
+    h = 2166136261U;
+    for(p = uuid; *p; p++) {
+        h ^= (uint8_t)*p;
+        h *= 16777619U;
+    }
+    time(&now);
+
+    pthread_mutex_lock(&fapi_reval_mutex);
+    e = &fapi_reval[h % FAPI_REVAL_SLOTS];
+    due = (strcmp(e->uuid, uuid) != 0) || (now - e->checked >= FAPI_REVAL_TTL);
+    if(due) {
+        snprintf(e->uuid, sizeof(e->uuid), "%s", uuid);
+        e->checked = now;
+    }
+    pthread_mutex_unlock(&fapi_reval_mutex);
+
+    return due;
+}
+
+static int fuseapi_attach(fapi_file_t *file, size_t size, int flags)
+{
+    int rc;
+
+    if((size <= FSCACHE_INLINE_MAX) &&
+            (0 == fscache_inline_size(file->key, NULL))) {
+        file->fd = -1;
+        return 0;
+    }
+
+    rc = fscache_open(file->key, flags);
+    if(rc >= 0) {
+        file->fd = rc;
+        rc = 0;
+    }
+    return rc;
+}
+
+static int fuseapi_virtual(const char *path)
+{
+    if(0 == strcmp(path, FAPI_VDIR)) {
+        return FAPI_VISDIR;
+    }
+    if(0 == strcmp(path, FAPI_VSTATS)) {
+        return FAPI_VISSTATS;
+    }
+    return FAPI_VNONE;
+}
+
+static int fuseapi_stats(fapi_file_t *file)
+{
+    static const char *events[XFER_EVENTS] = {
+        "throttled", "server", "transport", "retry"
+    };
+    uint64_t counts[XFER_EVENTS];
+    drive_timing_t timing[DRIVE_REQS];
+    double qps;
+    uint64_t issued;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t bytes;
+    size_t budget;
+    FILE *f;
+    int i;
+
+    /* prometheus text format: the latency histograms, then the counters
+     * the other modules keep */
+    f = open_memstream(&file->mem, &file->memlen);
+    if(NULL == f) {
+        return -ENOMEM;
+    }
+    stats_print(f);
+
+    xfer_stats(counts, &qps);
+    fprintf(f, "# HELP dfs_xfer_events_total Drive request outcomes "
+            "that were retried or throttled.\n");
+    fprintf(f, "# TYPE dfs_xfer_events_total counter\n");
+    for(i = 0; i < XFER_EVENTS; i++) {
+        fprintf(f, "dfs_xfer_events_total{event=\"%s\"} %llu\n", events[i],
+                (unsigned long long)counts[i]);
+    }
+    fprintf(f, "# HELP dfs_xfer_qps Current drive request rate limit.\n");
+    fprintf(f, "# TYPE dfs_xfer_qps gauge\n");
+    fprintf(f, "dfs_xfer_qps %g\n", qps);
+
+    /* sums only, the distributions are in the http histograms */
+    drive_timing(timing);
+    fprintf(f, "# HELP dfs_http_requests_total Drive requests by kind.\n");
+    fprintf(f, "# TYPE dfs_http_requests_total counter\n");
+    for(i = 0; i < DRIVE_REQS; i++) {
+        fprintf(f, "dfs_http_requests_total{kind=\"%s\"} %llu\n",
+                drive_req_name(i), (unsigned long long)timing[i].requests);
+    }
+    fprintf(f, "# TYPE dfs_http_failed_total counter\n");
+    for(i = 0; i < DRIVE_REQS; i++) {
+        fprintf(f, "dfs_http_failed_total{kind=\"%s\"} %llu\n",
+                drive_req_name(i), (unsigned long long)timing[i].failed);
+    }
+    fprintf(f, "# HELP dfs_http_slow_total Drive requests over the slow "
+            "request threshold.\n");
+    fprintf(f, "# TYPE dfs_http_slow_total counter\n");
+    for(i = 0; i < DRIVE_REQS; i++) {
+        fprintf(f, "dfs_http_slow_total{kind=\"%s\"} %llu\n",
+                drive_req_name(i), (unsigned long long)timing[i].slow);
+    }
+    fprintf(f, "# HELP dfs_http_reused_total Drive requests sent over an "
+            "open connection.\n");
+    fprintf(f, "# TYPE dfs_http_reused_total counter\n");
+    for(i = 0; i < DRIVE_REQS; i++) {
+        fprintf(f, "dfs_http_reused_total{kind=\"%s\"} %llu\n",
+                drive_req_name(i), (unsigned long long)timing[i].reused);
+    }
+    fprintf(f, "# HELP dfs_http_bytes_total Bytes received from drive.\n");
+    fprintf(f, "# TYPE dfs_http_bytes_total counter\n");
+    for(i = 0; i < DRIVE_REQS; i++) {
+        fprintf(f, "dfs_http_bytes_total{kind=\"%s\"} %llu\n",
+                drive_req_name(i), (unsigned long long)timing[i].bytes);
+    }
+    fprintf(f, "# HELP dfs_http_phase_seconds_total Time drive requests "
+            "spent per phase.\n");
+    fprintf(f, "# TYPE dfs_http_phase_seconds_total counter\n");
+    for(i = 0; i < DRIVE_REQS; i++) {
+        fprintf(f, "dfs_http_phase_seconds_total{kind=\"%s\",phase=\"dns\"} "
+                "%.6f\n", drive_req_name(i), timing[i].dns);
+        fprintf(f, "dfs_http_phase_seconds_total{kind=\"%s\","
+                "phase=\"connect\"} %.6f\n", drive_req_name(i),
+                timing[i].connect);
+        fprintf(f, "dfs_http_phase_seconds_total{kind=\"%s\",phase=\"tls\"} "
+                "%.6f\n", drive_req_name(i), timing[i].tls);
+        fprintf(f, "dfs_http_phase_seconds_total{kind=\"%s\",phase=\"wait\"} "
+                "%.6f\n", drive_req_name(i), timing[i].wait);
+        fprintf(f, "dfs_http_phase_seconds_total{kind=\"%s\","
+                "phase=\"total\"} %.6f\n", drive_req_name(i),
+                timing[i].total);
+    }
+
+    history_stats(&issued, &hits, &bytes);
+    fprintf(f, "# TYPE dfs_prefetch_issued_total counter\n");
+    fprintf(f, "dfs_prefetch_issued_total %llu\n",
+            (unsigned long long)issued);
+    fprintf(f, "# TYPE dfs_prefetch_hits_total counter\n");
+    fprintf(f, "dfs_prefetch_hits_total %llu\n", (unsigned long long)hits);
+    fprintf(f, "# TYPE dfs_prefetch_bytes_total counter\n");
+    fprintf(f, "dfs_prefetch_bytes_total %llu\n", (unsigned long long)bytes);
+
+    blkcache_stats(&hits, &misses, &budget);
+    fprintf(f, "# TYPE dfs_blkcache_hits_total counter\n");
+    fprintf(f, "dfs_blkcache_hits_total %llu\n", (unsigned long long)hits);
+    fprintf(f, "# TYPE dfs_blkcache_misses_total counter\n");
+    fprintf(f, "dfs_blkcache_misses_total %llu\n",
+            (unsigned long long)misses);
+    fprintf(f, "# TYPE dfs_blkcache_budget_bytes gauge\n");
+    fprintf(f, "dfs_blkcache_budget_bytes %llu\n",
+            (unsigned long long)budget);
+
+    if(fclose(f) != 0) {
+        free(file->mem);
+        file->mem = NULL;
+        return -ENOMEM;
+    }
+    return 0;
 }
 
 static int fuseapi_read(const char *path, char *buf, size_t size,
         off_t off, struct fuse_file_info *fi)
 {
+    fapi_file_t *file;
+
     log_debug("fuseapi_read: %s", path);
-    
-    return fscache_read(fi->fh, buf, off, size);
+
+    file = FAPI_FILE(fi);
+    if(file->mem) {
+        if((size_t)off >= file->memlen) {
+            return 0;
+        }
+        if(size > file->memlen - off) {
+            size = file->memlen - off;
+        }
+        memcpy(buf, file->mem + off, size);
+        return (int)size;
+    }
+    if(file->fd < 0) {
+        return fscache_inline_read(file->key, buf, off, size);
+    }
+    return blkcache_read(file->key, file->fd, buf, off, size);
+}
+
+static int fuseapi_read_buf(const char *path, struct fuse_bufvec **bufp,
+        size_t size, off_t off, struct fuse_file_info *fi)
+{
+    struct fuse_bufvec *bv;
+    fapi_file_t *file;
+    char *mem;
+    int rc;
+
+    log_debug("fuseapi_read_buf: %s", path);
+
+    bv = malloc(sizeof(struct fuse_bufvec));
+    if(NULL == bv) {
+        return -ENOMEM;
+    }
+    *bv = FUSE_BUFVEC_INIT(size);
+
+    file = FAPI_FILE(fi);
+    if((file->fd < 0) || (size <= BLKCACHE_BLOCK)) {
+        /* inline objects are copied straight out of the pack and small
+         * reads go through the ram block cache; libfuse frees the buffer
+         * once the reply is sent */
+        mem = malloc(size);
+        if(NULL == mem) {
+            free(bv);
+            return -ENOMEM;
+        }
+        if(file->mem) {
+            rc = fuseapi_read(path, mem, size, off, fi);
+        } else if(file->fd < 0) {
+            rc = fscache_inline_read(file->key, mem, off, size);
+        } else {
+            rc = blkcache_read(file->key, file->fd, mem, off, size);
+        }
+        if(rc < 0) {
+            free(mem);
+            free(bv);
+            return rc;
+        }
+        bv->buf[0].size = rc;
+        bv->buf[0].mem = mem;
+        *bufp = bv;
+        return 0;
+    }
+
+    /* hand the cache file to libfuse, pages get spliced to the kernel
+     * instead of being copied through a user buffer */
+    bv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    bv->buf[0].fd = file->fd;
+    bv->buf[0].pos = off;
+    *bufp = bv;
+
+    return 0;
 }
 
 /*static int fuseapi_write(const char *path, const char *buf,
@@ -253,21 +662,32 @@ static int fuseapi_release(const char *path,
               struct fuse_file_info *fi)
 {
     size_t size;
+    fapi_file_t *file;
+    int rc;
 
     log_debug("fuseapi_release: %s", path);
 
-    if(fi->flags & O_ACCMODE) {
-        fscache_size(fi->fh, &size);
-        //dbcache_resize(ino, size);
+    file = FAPI_FILE(fi);
+    rc = 0;
+    if(file->fd >= 0) {
+        if(fi->flags & O_ACCMODE) {
+            fscache_size(file->fd, &size);
+            //dbcache_resize(ino, size);
+        }
+        rc = fscache_close(file->fd);
     }
+    free(file->mem);
+    free(file);
 
-    return fscache_close(fi->fh);
+    return rc;
 }
 
 static int fuseapi_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                  off_t off, struct fuse_file_info *fi)
 {
     struct stat st;
+    int64_t dir;
+    int rc;
     log_debug("fuseapi_readdir: %s", path);
     (void)off;
     (void)fi;
@@ -279,8 +699,8 @@ static int fuseapi_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
         (void)uuid;
         (void)checksum;
-        (void)parent;
 
+        dir = parent;
         memset(&st, 0, sizeof(struct stat));
         st.st_ino = id;
         st.st_mode = mode;
@@ -320,7 +740,24 @@ static int fuseapi_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     filler(buf, ".", NULL, 0);
     filler(buf, "..", NULL, 0);
 
-    return dbcache_listdir(path, cb);
+    switch(fuseapi_virtual(path)) {
+    case FAPI_VISDIR:
+        filler(buf, "stats", NULL, 0);
+        return 0;
+    case FAPI_VISSTATS:
+        return -ENOTDIR;
+    }
+
+    dir = 0;
+    rc = dbcache_listdir(path, cb);
+    if((0 == rc) && (0 == strcmp(path, "/"))) {
+        filler(buf, FAPI_VDIR + 1, NULL, 0);
+    }
+    if((0 == rc) && (dir > 0)) {
+        history_dir(dir);
+        fetch_dir(dir);
+    }
+    return rc;
 }
 
 /*static void fuseapi_create(const char *path,
@@ -359,27 +796,356 @@ static void fuseapi_flush(const char *path,
     fuse_reply_buf(req, NULL, 0);
 }*/
 
+static void *fuseapi_init(struct fuse_conn_info *conn)
+{
+    conn->want |= conn->capable &
+            (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+    return NULL;
+}
+
+/* pinning: "user.dfs.pinned" set to 1 pins a file or subtree, 0 unpins it;
+ * "user.dfs.pending" reads back files and bytes still to be fetched */
+#define XATTR_PINNED    "user.dfs.pinned"
+#define XATTR_PENDING   "user.dfs.pending"
+#define XATTR_MAX       63
+
+static int fuseapi_setxattr(const char *path, const char *name,
+        const char *value, size_t size, int flags)
+{
+    int64_t fid;
+    int pinned;
+    int rc;
+
+    log_debug("fuseapi_setxattr: %s %s", path, name);
+
+    (void)flags;
+
+    if(strcmp(name, XATTR_PINNED) != 0) {
+        return -ENOTSUP;
+    }
+    if((size < 1) || ((value[0] != '0') && (value[0] != '1'))) {
+        return -EINVAL;
+    }
+    pinned = ('1' == value[0]);
+
+    int cb(int64_t id, const char *uuid, const char *name, int type,
+            size_t size, mode_t mode, const struct timespec *atime,
+            const struct timespec *mtime, const struct timespec *ctime,
+            const char *checksum, int64_t parent) {
+        (void)uuid;
+        (void)name;
+        (void)type;
+        (void)size;
+        (void)mode;
+        (void)atime;
+        (void)mtime;
+        (void)ctime;
+        (void)checksum;
+        (void)parent;
+        fid = id;
+        return 0;
+    }
+
+    rc = dbcache_findbypath(path, cb);
+    if(rc != 0) {
+        return rc;
+    }
+    rc = dbcache_pin(fid, pinned);
+    if(rc != 0) {
+        return -EIO;
+    }
+    log_info("%s %s", pinned ? "pinned" : "unpinned", path);
+    if(pinned) {
+        fetch_pinned(fid);
+    }
+    return 0;
+}
+
+static int fuseapi_getxattr(const char *path, const char *name, char *value,
+        size_t size)
+{
+    char buf[XATTR_MAX + 1];
+    int64_t fid;
+    int pinned;
+    int64_t files;
+    int64_t bytes;
+    size_t len;
+    int rc;
+
+    log_debug("fuseapi_getxattr: %s %s", path, name);
+
+    int cb(int64_t id, const char *uuid, const char *name, int type,
+            size_t size, mode_t mode, const struct timespec *atime,
+            const struct timespec *mtime, const struct timespec *ctime,
+            const char *checksum, int64_t parent) {
+        (void)uuid;
+        (void)name;
+        (void)type;
+        (void)size;
+        (void)mode;
+        (void)atime;
+        (void)mtime;
+        (void)ctime;
+        (void)checksum;
+        (void)parent;
+        fid = id;
+        return 0;
+    }
+
+    if(strcmp(name, XATTR_PINNED) && strcmp(name, XATTR_PENDING)) {
+        return -ENODATA;
+    }
+    rc = dbcache_findbypath(path, cb);
+    if(rc != 0) {
+        return rc;
+    }
+    if(dbcache_pin_status(fid, &pinned, &files, &bytes) != 0) {
+        return -EIO;
+    }
+
+    memset(buf, 0, (XATTR_MAX + 1) * sizeof(char));
+    if(0 == strcmp(name, XATTR_PINNED)) {
+        snprintf(buf, XATTR_MAX, "%d", pinned);
+    } else {
+        snprintf(buf, XATTR_MAX, "%ld %ld", (long)files, (long)bytes);
+    }
+
+    len = strlen(buf);
+    if(0 == size) {
+        return (int)len;
+    }
+    if(size < len) {
+        return -ERANGE;
+    }
+    memcpy(value, buf, len);
+    return (int)len;
+}
+
+static int fuseapi_listxattr(const char *path, char *list, size_t size)
+{
+    size_t len;
+
+    log_debug("fuseapi_listxattr: %s", path);
+
+    len = sizeof(XATTR_PINNED) + sizeof(XATTR_PENDING);
+    if(0 == size) {
+        return (int)len;
+    }
+    if(size < len) {
+        return -ERANGE;
+    }
+    memcpy(list, XATTR_PINNED, sizeof(XATTR_PINNED));
+    memcpy(list + sizeof(XATTR_PINNED), XATTR_PENDING, sizeof(XATTR_PENDING));
+    return (int)len;
+}
+
+/* every operation is timed into the stats histograms, and recorded as
+ * well while tracing */
+static int timed_getattr(const char *path, struct stat *st)
+{
+    int64_t t;
+    int rc;
+
+    PROBE2(fuse_entry, "getattr", path);
+    t = stats_begin();
+    rc = fuseapi_getattr(path, st);
+    stats_end(STATS_FUSE_GETATTR, t, rc < 0);
+    if(trace_enabled()) {
+        trace_end(TRACE_GETATTR, path, 0, 0, t, rc);
+    }
+    PROBE3(fuse_return, "getattr", path, rc);
+    return rc;
+}
+
+static int timed_mkdir(const char *path, mode_t mode)
+{
+    int64_t t;
+    int rc;
+
+    PROBE2(fuse_entry, "mkdir", path);
+    t = stats_begin();
+    rc = fuseapi_mkdir(path, mode);
+    stats_end(STATS_FUSE_MKDIR, t, rc < 0);
+    if(trace_enabled()) {
+        trace_end(TRACE_MKDIR, path, 0, (int64_t)mode, t, rc);
+    }
+    PROBE3(fuse_return, "mkdir", path, rc);
+    return rc;
+}
+
+static int timed_rmdir(const char *path)
+{
+    int64_t t;
+    int rc;
+
+    PROBE2(fuse_entry, "rmdir", path);
+    t = stats_begin();
+    rc = fuseapi_rmdir(path);
+    stats_end(STATS_FUSE_RMDIR, t, rc < 0);
+    if(trace_enabled()) {
+        trace_end(TRACE_RMDIR, path, 0, 0, t, rc);
+    }
+    PROBE3(fuse_return, "rmdir", path, rc);
+    return rc;
+}
+
+static int timed_open(const char *path, struct fuse_file_info *fi)
+{
+    int64_t t;
+    int rc;
+
+    PROBE2(fuse_entry, "open", path);
+    t = stats_begin();
+    rc = fuseapi_open(path, fi);
+    stats_end(STATS_FUSE_OPEN, t, rc < 0);
+    if(trace_enabled()) {
+        trace_end(TRACE_OPEN, path, 0, (int64_t)fi->flags, t, rc);
+    }
+    PROBE3(fuse_return, "open", path, rc);
+    return rc;
+}
+
+static int timed_read(const char *path, char *buf, size_t size, off_t off,
+        struct fuse_file_info *fi)
+{
+    int64_t t;
+    int rc;
+
+    PROBE2(fuse_entry, "read", path);
+    t = stats_begin();
+    rc = fuseapi_read(path, buf, size, off, fi);
+    stats_end(STATS_FUSE_READ, t, rc < 0);
+    if(trace_enabled()) {
+        trace_end(TRACE_READ, path, (int64_t)off, (int64_t)size, t, rc);
+    }
+    PROBE3(fuse_return, "read", path, rc);
+    return rc;
+}
+
+static int timed_read_buf(const char *path, struct fuse_bufvec **bufp,
+        size_t size, off_t off, struct fuse_file_info *fi)
+{
+    int64_t t;
+    int rc;
+
+    /* spliced replies are sent after this returns, the result is the
+     * size handed over */
+    PROBE2(fuse_entry, "read_buf", path);
+    t = stats_begin();
+    rc = fuseapi_read_buf(path, bufp, size, off, fi);
+    stats_end(STATS_FUSE_READ, t, rc < 0);
+    if(trace_enabled()) {
+        trace_end(TRACE_READ, path, (int64_t)off, (int64_t)size, t,
+                rc ? rc : (int)fuse_buf_size(*bufp));
+    }
+    PROBE3(fuse_return, "read_buf", path, rc);
+    return rc;
+}
+
+static int timed_release(const char *path, struct fuse_file_info *fi)
+{
+    int64_t t;
+    int rc;
+
+    PROBE2(fuse_entry, "release", path);
+    t = stats_begin();
+    rc = fuseapi_release(path, fi);
+    stats_end(STATS_FUSE_RELEASE, t, rc < 0);
+    if(trace_enabled()) {
+        trace_end(TRACE_RELEASE, path, 0, 0, t, rc);
+    }
+    PROBE3(fuse_return, "release", path, rc);
+    return rc;
+}
+
+static int timed_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+        off_t off, struct fuse_file_info *fi)
+{
+    int64_t t;
+    int rc;
+
+    PROBE2(fuse_entry, "readdir", path);
+    t = stats_begin();
+    rc = fuseapi_readdir(path, buf, filler, off, fi);
+    stats_end(STATS_FUSE_READDIR, t, rc < 0);
+    if(trace_enabled()) {
+        trace_end(TRACE_READDIR, path, (int64_t)off, 0, t, rc);
+    }
+    PROBE3(fuse_return, "readdir", path, rc);
+    return rc;
+}
+
+static int timed_setxattr(const char *path, const char *name,
+        const char *value, size_t size, int flags)
+{
+    int64_t t;
+    int rc;
+
+    PROBE2(fuse_entry, "setxattr", path);
+    t = stats_begin();
+    rc = fuseapi_setxattr(path, name, value, size, flags);
+    stats_end(STATS_FUSE_SETXATTR, t, rc < 0);
+    if(trace_enabled()) {
+        trace_end(TRACE_SETXATTR, path, 0, (int64_t)size, t, rc);
+    }
+    PROBE3(fuse_return, "setxattr", path, rc);
+    return rc;
+}
+
+static int timed_getxattr(const char *path, const char *name, char *value,
+        size_t size)
+{
+    int64_t t;
+    int rc;
+
+    PROBE2(fuse_entry, "getxattr", path);
+    t = stats_begin();
+    rc = fuseapi_getxattr(path, name, value, size);
+    stats_end(STATS_FUSE_GETXATTR, t, rc < 0);
+    if(trace_enabled()) {
+        trace_end(TRACE_GETXATTR, path, 0, (int64_t)size, t, rc);
+    }
+    PROBE3(fuse_return, "getxattr", path, rc);
+    return rc;
+}
+
+static int timed_listxattr(const char *path, char *list, size_t size)
+{
+    int64_t t;
+    int rc;
+
+    PROBE2(fuse_entry, "listxattr", path);
+    t = stats_begin();
+    rc = fuseapi_listxattr(path, list, size);
+    stats_end(STATS_FUSE_LISTXATTR, t, rc < 0);
+    if(trace_enabled()) {
+        trace_end(TRACE_LISTXATTR, path, 0, (int64_t)size, t, rc);
+    }
+    PROBE3(fuse_return, "listxattr", path, rc);
+    return rc;
+}
+
 static struct fuse_operations fapi_ops = {
-    .getattr = fuseapi_getattr,
-    .mkdir = fuseapi_mkdir,
+    .getattr = timed_getattr,
+    .mkdir = timed_mkdir,
 //    .unlink = fuseapi_unlink,
-    .rmdir = fuseapi_rmdir,
+    .rmdir = timed_rmdir,
 //    .rename = fuseapi_rename,
 //    .chmod = fuseapi_chmod,
 //    .chown = fuseapi_chown,
 //    .truncate
-    .open = fuseapi_open,
-    .read = fuseapi_read,
+    .open = timed_open,
+    .read = timed_read,
 //    .write = fuseapi_write,
 //    .statfs = fuseapi_statfs,
 //    .flush = fuseapi_flush,
-    .release = fuseapi_release,
+    .release = timed_release,
 //    .fsync
 //    .opendir
-    .readdir = fuseapi_readdir,
+    .readdir = timed_readdir,
 //    .releasedir
 //    .fsyncdir
-//    .init
+    .init = fuseapi_init,
 //    .destroy
 //    .access
 //    .create = fuseapi_create,
@@ -387,6 +1153,10 @@ static struct fuse_operations fapi_ops = {
 //    .fgetattr
 //    .lock
 //    .utimens
+    .read_buf = timed_read_buf,
+    .setxattr = timed_setxattr,
+    .getxattr = timed_getxattr,
+    .listxattr = timed_listxattr,
 };
 
 static char fapi_mountpoint[PATH_MAX + 1];
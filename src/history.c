@@ -0,0 +1,345 @@
+This file is part of drive-fuse-sync.
+
+drive-fuse-sync is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+drive-fuse-sync is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "history.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dbcache.h"
+#include "fetch.h"
+#include "log.h"
+
+/* access history: opens are counted per file, and files opened within
+ * HISTORY_SESSION seconds of each other are counted as co-accessed; the
+ * history is used to queue likely-needed files to the fetch workers at
+ * startup, on directory access and after each open, within a byte budget
+ * per hour */
+
+#define HISTORY_EVENTS      256
+#define HISTORY_RECENT      8
+#define HISTORY_SESSION     300
+#define HISTORY_TRACK       256
+#define HISTORY_WARM        64
+#define HISTORY_PEERS       8
+#define HISTORY_SIBLINGS    8
+#define HISTORY_REPORT      60
+#define HISTORY_UUID_MAX    63
+
+#define HISTORY_EV_OPEN     1
+#define HISTORY_EV_DIR      2
+
+struct _history_event
+{
+    int kind;
+    char uuid[HISTORY_UUID_MAX + 1];
+    int64_t dir;
+    time_t ts;
+};
+typedef struct _history_event history_event_t;
+
+struct _history_recent
+{
+    char uuid[HISTORY_UUID_MAX + 1];
+    time_t ts;
+};
+typedef struct _history_recent history_recent_t;
+
+static pthread_mutex_t history_mutex;
+static pthread_cond_t history_cond;
+static pthread_t history_thread;
+static int keep_running = 0;
+
+/* events from the fuse threads, drained by history_run() */
+static history_event_t history_events[HISTORY_EVENTS];
+static int history_head = 0;
+static int history_count = 0;
+
+/* only touched by history_run() */
+static history_recent_t history_recent[HISTORY_RECENT];
+static int history_nrecent = 0;
+
+static size_t history_budget = 0;
+static double history_tokens = 0.0;
+static time_t history_refill;
+
+/* what was prefetched, to tell whether opens benefit */
+static char history_track[HISTORY_TRACK][HISTORY_UUID_MAX + 1];
+static int history_ntrack = 0;
+static uint64_t history_issued = 0;
+static uint64_t history_bytes = 0;
+static uint64_t history_hits = 0;
+
+static void *history_run(void *);
+static void history_record(const history_event_t *);
+static int history_prefetch(const char *, const char *, int64_t);
+static int history_tracked(const char *, int);
+
+int history_setup(size_t budget)
+{
+    pthread_mutex_init(&history_mutex, NULL);
+    pthread_cond_init(&history_cond, NULL);
+
+    history_budget = budget;
+    history_tokens = (double)budget;
+    time(&history_refill);
+
+    keep_running = 1;
+    if(pthread_create(&history_thread, NULL, history_run, NULL) != 0) {
+        log_error("unable to start access history thread");
+        keep_running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+int history_cleanup(void)
+{
+    if(keep_running) {
+        pthread_mutex_lock(&history_mutex);
+        keep_running = 0;
+        pthread_cond_signal(&history_cond);
+        pthread_mutex_unlock(&history_mutex);
+        pthread_join(history_thread, NULL);
+    }
+
+    pthread_cond_destroy(&history_cond);
+    pthread_mutex_destroy(&history_mutex);
+
+    return 0;
+}
+
+void history_open(const char *uuid)
+{
+    history_event_t *ev;
+
+    if(!keep_running || (NULL == uuid)) {
+        return;
+    }
+
+    pthread_mutex_lock(&history_mutex);
+    if(history_tracked(uuid, 1)) {
+        history_hits++;
+    }
+    if(history_count < HISTORY_EVENTS) {
+        ev = &history_events[(history_head + history_count) % HISTORY_EVENTS];
+        memset(ev, 0, sizeof(history_event_t));
+        ev->kind = HISTORY_EV_OPEN;
+        strncpy(ev->uuid, uuid, HISTORY_UUID_MAX);
+        time(&ev->ts);
+        history_count++;
+        pthread_cond_signal(&history_cond);
+    }
+    pthread_mutex_unlock(&history_mutex);
+}
+
+void history_dir(int64_t dir)
+{
+    history_event_t *ev;
+
+    if(!keep_running || (0 == history_budget)) {
+        return;
+    }
+
+    pthread_mutex_lock(&history_mutex);
+    if(history_count < HISTORY_EVENTS) {
+        ev = &history_events[(history_head + history_count) % HISTORY_EVENTS];
+        memset(ev, 0, sizeof(history_event_t));
+        ev->kind = HISTORY_EV_DIR;
+        ev->dir = dir;
+        time(&ev->ts);
+        history_count++;
+        pthread_cond_signal(&history_cond);
+    }
+    pthread_mutex_unlock(&history_mutex);
+}
+
+int history_stats(uint64_t *issued, uint64_t *hits, uint64_t *bytes)
+{
+    pthread_mutex_lock(&history_mutex);
+    *issued = history_issued;
+    *hits = history_hits;
+    *bytes = history_bytes;
+    pthread_mutex_unlock(&history_mutex);
+
+    return 0;
+}
+
+static void *history_run(void *opaque)
+{
+    history_event_t ev;
+    struct timespec ts;
+    time_t now;
+    time_t reported;
+    uint64_t lastissued;
+
+    int cb(const char *uuid, const char *cksum, int64_t size) {
+        return history_prefetch(uuid, cksum, size);
+    }
+
+    (void)opaque;
+
+    /* warm up with what has been used the most, lately */
+    if(history_budget > 0) {
+        time(&now);
+        dbcache_access_top(HISTORY_WARM, now, cb);
+    }
+
+    time(&reported);
+    lastissued = 0;
+    pthread_mutex_lock(&history_mutex);
+    while(keep_running) {
+        if(0 == history_count) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += HISTORY_REPORT;
+            pthread_cond_timedwait(&history_cond, &history_mutex, &ts);
+        }
+
+        time(&now);
+        if((now - reported >= HISTORY_REPORT) &&
+                (history_issued != lastissued)) {
+            log_info("prefetch: %lu issued, %lu bytes, %lu hits (%lu%%)",
+                    (unsigned long)history_issued,
+                    (unsigned long)history_bytes,
+                    (unsigned long)history_hits,
+                    (unsigned long)(history_hits * 100 / history_issued));
+            lastissued = history_issued;
+            reported = now;
+        }
+
+        if(0 == history_count) {
+            continue;
+        }
+        memcpy(&ev, &history_events[history_head], sizeof(history_event_t));
+        history_head = (history_head + 1) % HISTORY_EVENTS;
+        history_count--;
+        pthread_mutex_unlock(&history_mutex);
+
+        history_record(&ev);
+
+        pthread_mutex_lock(&history_mutex);
+    }
+    pthread_mutex_unlock(&history_mutex);
+
+    return NULL;
+}
+
+static void history_record(const history_event_t *ev)
+{
+    const char *peers[HISTORY_RECENT];
+    int npeers;
+    int i;
+
+    int cb(const char *uuid, const char *cksum, int64_t size) {
+        return history_prefetch(uuid, cksum, size);
+    }
+
+    if(HISTORY_EV_DIR == ev->kind) {
+        dbcache_access_dir(ev->dir, HISTORY_SIBLINGS, ev->ts, cb);
+        return;
+    }
+
+    /* same session: opened shortly before this one */
+    npeers = 0;
+    for(i = 0; i < history_nrecent; i++) {
+        if((ev->ts - history_recent[i].ts <= HISTORY_SESSION) &&
+                strcmp(history_recent[i].uuid, ev->uuid)) {
+            peers[npeers++] = history_recent[i].uuid;
+        }
+    }
+    dbcache_access_record(ev->uuid, peers, npeers, ev->ts);
+
+    for(i = 0; i < history_nrecent; i++) {
+        if(0 == strcmp(history_recent[i].uuid, ev->uuid)) {
+            break;
+        }
+    }
+    if(i == history_nrecent) {
+        if(history_nrecent < HISTORY_RECENT) {
+            history_nrecent++;
+        }
+        i = history_nrecent - 1;
+    }
+    memmove(&history_recent[1], &history_recent[0],
+            i * sizeof(history_recent_t));
+    memcpy(history_recent[0].uuid, ev->uuid, sizeof(history_recent[0].uuid));
+    history_recent[0].ts = ev->ts;
+
+    if(history_budget > 0) {
+        dbcache_access_peers(ev->uuid, HISTORY_PEERS, cb);
+    }
+}
+
+static int history_prefetch(const char *uuid, const char *cksum, int64_t size)
+{
+    time_t now;
+    int rc;
+
+    /* called back with dbcache locked, only queue here */
+    time(&now);
+    history_tokens += (double)history_budget * (now - history_refill) / 3600.0;
+    if(history_tokens > (double)history_budget) {
+        history_tokens = (double)history_budget;
+    }
+    history_refill = now;
+
+    if((double)size > history_tokens) {
+        /* out of budget, stop here */
+        return 1;
+    }
+    rc = fetch_queue(uuid, cksum, NULL, (size_t)size);
+    if(-EAGAIN == rc) {
+        return 1;
+    }
+    if(rc != 0) {
+        return 0;
+    }
+    history_tokens -= (double)size;
+
+    pthread_mutex_lock(&history_mutex);
+    if(!history_tracked(uuid, 0)) {
+        strncpy(history_track[history_ntrack % HISTORY_TRACK], uuid,
+                HISTORY_UUID_MAX);
+        history_ntrack++;
+    }
+    history_issued++;
+    history_bytes += size;
+    pthread_mutex_unlock(&history_mutex);
+
+    log_debug("prefetching %s", uuid);
+    return 0;
+}
+
+static int history_tracked(const char *uuid, int consume)
+{
+    int n;
+    int i;
+
+    /* called with history_mutex held; consumed so a hit counts once */
+    n = (history_ntrack < HISTORY_TRACK) ? history_ntrack : HISTORY_TRACK;
+    for(i = 0; i < n; i++) {
+        if(0 == strcmp(history_track[i], uuid)) {
+            if(consume) {
+                history_track[i][0] = 0;
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -15,179 +15,392 @@ along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "log.h"
 
-#include <log4c.h>
-#include <log4c/appender_type_rollingfile.h>
-#include <log4c/rollingpolicy.h>
-#include <log4c/rollingpolicy_type_sizewin.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+/* every thread formats into a ring of its own, single producer single
+ * consumer so no locks are taken on the logging side; one writer thread
+ * merges the rings in timestamp order into <logdir>/LOG_FILE and rotates it
+ * by size. Rings of threads that exited are reused by new threads. When a
+ * ring is full the message is dropped and counted, the writer reports the
+ * count. Before log_init() and after log_term() messages go straight to
+ * stdout/stderr as they always did. */
+
+#define LOG_FILE        "drivefusesync.log"
+#define LOG_FILE_MAX    (8 * 1024 * 1024)
+#define LOG_FILES       5
+/* log_path plus a rotation suffix */
+#define LOG_ROTATED_MAX (PATH_MAX + 16)
+#define LOG_RING_SLOTS  512
+#define LOG_LINE_MAX    255
+#define LOG_POLL        50
+
+struct _log_entry
+{
+    int64_t ts;
+    int level;
+    pid_t tid;
+    char line[LOG_LINE_MAX + 1];
+};
+typedef struct _log_entry log_entry_t;
+
+struct _log_ring
+{
+    log_entry_t slot[LOG_RING_SLOTS];
+    unsigned int head;      /* advanced by the owning thread only */
+    unsigned int tail;      /* advanced by the writer only */
+    int owned;
+    uint64_t dropped;
+    uint64_t reported;
+    struct _log_ring *next;
+};
+typedef struct _log_ring log_ring_t;
+
+int log_level = LOG_INFO;
+
+static const char *log_names[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+
+static log_ring_t *log_rings = NULL;
+static __thread log_ring_t *log_mine = NULL;
+static __thread pid_t log_tid = 0;
+static pthread_key_t log_key;
+
+/* producers nudge the writer when a ring gets half full, without taking
+ * the mutex: a lost wakeup only costs the rest of a poll interval */
+static pthread_mutex_t log_mutex;
+static pthread_cond_t log_cond;
+static pthread_t log_thread;
+static int keep_running = 0;
+static char log_path[PATH_MAX + 1];
+static FILE *log_file = NULL;
+static long log_size = 0;
+
+static log_ring_t *log_ring(void);
+static void log_release(void *);
+static void *log_run(void *);
+static int log_drain(void);
+static int log_open(void);
+static void log_rotate(void);
 
 int log_init(const char *logdir)
 {
-#ifdef HAVE_LIBLOG4C
-    (void)logdir;
-    log4c_init();
-#else /* HAVE_LIBLOG4C */
-    (void)logdir;
-#endif /* HAVE_LIBLOG4C */
+    int rc;
+
+    memset(log_path, 0, (PATH_MAX + 1) * sizeof(char));
+    snprintf(log_path, PATH_MAX, "%s/" LOG_FILE, logdir);
+    if(log_open() != 0) {
+        rc = -errno;
+        fprintf(stderr, "unable to open log file %s: %d\n", log_path, -rc);
+        return rc;
+    }
+
+    pthread_key_create(&log_key, log_release);
+    pthread_mutex_init(&log_mutex, NULL);
+    pthread_cond_init(&log_cond, NULL);
+
+    __atomic_store_n(&keep_running, 1, __ATOMIC_RELEASE);
+    if(pthread_create(&log_thread, NULL, log_run, NULL) != 0) {
+        __atomic_store_n(&keep_running, 0, __ATOMIC_RELEASE);
+        fclose(log_file);
+        log_file = NULL;
+        return -1;
+    }
     return 0;
 }
 
 int log_term(void)
 {
-#ifdef HAVE_LIBLOG4C
-    log4c_fini();
-#endif /* HAVE_LIBLOG4C */
+    if(!__atomic_load_n(&keep_running, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    /* the writer drains what is left on its way out */
+    __atomic_store_n(&keep_running, 0, __ATOMIC_RELEASE);
+    pthread_cond_signal(&log_cond);
+    pthread_join(log_thread, NULL);
+    /* a failed rotation leaves the writer on stderr */
+    if(log_file != stderr) {
+        fclose(log_file);
+    }
+    log_file = NULL;
+    pthread_cond_destroy(&log_cond);
+    pthread_mutex_destroy(&log_mutex);
+
     return 0;
 }
 
 int log_context(void **ctx, const char *name)
 {
-#ifdef HAVE_LIBLOG4C
-    log4c_category_t *root;
-
-    root = log4c_category_get(name);
-    *ctx = (void *)root;
-    
-#else /* HAVE_LIBLOG4C */
-    (void)ctx;
     (void)name;
-#endif /* HAVE_LIBLOG4C */
+    *ctx = NULL;
+    return 0;
+}
+
+int log_set_level(int level)
+{
+    if((level < LOG_ERROR) || (level > LOG_DEBUG)) {
+        return -EINVAL;
+    }
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
     return 0;
 }
 
-#ifdef HAVE_LIBLOG4C
-#ifdef __JUST_AS_EXAMPLE__
-/*********************** Parameters **********************************
- *
- * params could be taken from the command line to facillitate testing
- *
-*/
-
-/*
- * rolling file specific params
-*/
-#define FILE_SEP "/"
-char *param_log_dir = ROLLINGFILE_DEFAULT_LOG_DIR;
-char* param_log_prefix = ROLLINGFILE_DEFAULT_LOG_PREFIX"rf";
-long param_max_file_size = 1666;
-long param_max_num_files = 6;
-
-/*
- * Other Logging params
- * xxx Problem with dated layout on windows: assert failure
- * in gmtime call.
-*/
-char *param_layout_to_use = "dated"; /* could also be "basic" */
-
-/*******************************************************************
- *
- * Globals
- *
- */
-log4c_category_t* root = NULL;
-log4c_appender_t* file_appender = NULL;
-/******************************************************************************/
-
-/*
- * Init log4c and configure a rolling file appender
- *
-*/
-static void init_log4c_with_rollingfile_appender(){
-  int rc = 2;
-  rollingfile_udata_t *rfup = NULL;
-  log4c_rollingpolicy_t *policyp = NULL;
-  rollingpolicy_sizewin_udata_t *sizewin_udatap = NULL;
-
-  printf("using the rolling file appender "
-          "to write test log files\n"
-          "to log directory '%s', log file prefix is '%s'"
-          ", max file size is '%ld'\n"
-          "max num files is '%ld'\n",
-          param_log_dir, param_log_prefix, param_max_file_size,
-          param_max_num_files);
-
-  if ( (rc = log4c_init()) == 0 ) {
-    printf("log4c init success\n");
-  } else {
-    printf("log4c init failed--error %d\n", rc);
-    return;
-  }
-
-  /*
-   * Get a reference to the root category
-  */
-  root = log4c_category_get("root");
-  log4c_category_set_priority(root,
-                        LOG4C_PRIORITY_WARN);
-
-  /* 
-   * Get a file appender and set the type to rollingfile
-  */
-  file_appender = log4c_appender_get("aname");
-  log4c_appender_set_type(file_appender, 
-    log4c_appender_type_get("rollingfile"));
-  
-  /*
-   * Make a rolling file udata object and set the basic parameters 
-  */
-  rfup = rollingfile_make_udata();              
-  rollingfile_udata_set_logdir(rfup, param_log_dir);
-  rollingfile_udata_set_files_prefix(rfup, param_log_prefix);
-
-  /*
-   * Get a new rollingpolicy
-   * type defaults to "sizewin" but set the type explicitly here
-   * to show how to do it.
-  */
-  policyp = log4c_rollingpolicy_get("a_policy_name");
-  log4c_rollingpolicy_set_type(policyp,
-              log4c_rollingpolicy_type_get("sizewin"));
-
-  /*
-   * Get a new sizewin policy type and configure it.
-   * Then attach it to the policy object.
-  */
-  sizewin_udatap = sizewin_make_udata();
-  sizewin_udata_set_file_maxsize(sizewin_udatap, param_max_file_size);
-  sizewin_udata_set_max_num_files(sizewin_udatap, param_max_num_files);
-  log4c_rollingpolicy_set_udata(policyp,sizewin_udatap);
-
-  /*
-   * Now set that policy in our rolling file appender udata.
-  */
-  
-  rollingfile_udata_set_policy(rfup, policyp);
-  log4c_appender_set_udata(file_appender, rfup);
- 
-  /*
-  * Allow the rolling policy to initialize itself:
-  * it needs to know the rollingfile udata it is associated with--it
-  * picks up some parameters in there
-  */
-  log4c_rollingpolicy_init(policyp, rfup);
-
-  /*
-   * Configure a layout for the rolling file appender 
-  */
-  log4c_appender_set_layout(file_appender, 
-                            log4c_layout_get(param_layout_to_use) );
-
-  /*
-   * Configure the root category with our rolling file appender...
-   * and we can then start logging to it.
-   *
-  */
-  log4c_category_set_appender(root,file_appender );
-  
-  log4c_dump_all_instances(stderr);
+int log_parse_level(const char *s)
+{
+    int i;
+
+    for(i = LOG_ERROR; i <= LOG_DEBUG; i++) {
+        if(0 == strcasecmp(s, log_names[i])) {
+            return i;
+        }
+    }
+    if(0 == strcasecmp(s, "warning")) {
+        return LOG_WARNING;
+    }
+    if((s[0] >= '0') && (s[0] <= '3') && (0 == s[1])) {
+        return s[0] - '0';
+    }
+    return -EINVAL;
+}
+
+void log_write(int level, const char *fmt, ...)
+{
+    struct timespec ts;
+    log_ring_t *ring;
+    log_entry_t *e;
+    unsigned int head;
+    unsigned int used;
+    va_list ap;
+
+    ring = NULL;
+    if(__atomic_load_n(&keep_running, __ATOMIC_ACQUIRE)) {
+        ring = log_ring();
+    }
+    if(NULL == ring) {
+        va_start(ap, fmt);
+        if(LOG_ERROR == level) {
+            vfprintf(stderr, fmt, ap);
+            fprintf(stderr, "\n");
+        } else {
+            vprintf(fmt, ap);
+            printf("\n");
+        }
+        va_end(ap);
+        return;
+    }
+
+    head = ring->head;
+    used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if(used >= LOG_RING_SLOTS) {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    e = &ring->slot[head % LOG_RING_SLOTS];
+    clock_gettime(CLOCK_REALTIME, &ts);
+    e->ts = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    e->level = level;
+    e->tid = log_tid;
+    va_start(ap, fmt);
+    vsnprintf(e->line, LOG_LINE_MAX + 1, fmt, ap);
+    va_end(ap);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    if(LOG_RING_SLOTS / 2 == used) {
+        pthread_cond_signal(&log_cond);
+    }
+}
+
+static log_ring_t *log_ring(void)
+{
+    log_ring_t *ring;
+    int orphan;
 
+    if(log_mine) {
+        return log_mine;
+    }
 
+    /* adopt the ring of a thread that is gone, or add one */
+    for(ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring;
+            ring = ring->next) {
+        orphan = 0;
+        if(__atomic_compare_exchange_n(&ring->owned, &orphan, 1, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if(NULL == ring) {
+        ring = calloc(1, sizeof(log_ring_t));
+        if(NULL == ring) {
+            return NULL;
+        }
+        ring->owned = 1;
+        ring->next = __atomic_load_n(&log_rings, __ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&log_rings, &ring->next, ring, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        }
+    }
+    log_tid = (pid_t)syscall(SYS_gettid);
+    log_mine = ring;
+    pthread_setspecific(log_key, ring);
+    return ring;
 }
 
-#endif /* __JUST_AS_EXAMPLE__ */
+static void log_release(void *opaque)
+{
+    log_ring_t *ring;
 
-#else /* HAVE_LIBLOG4C */
+    /* the writer still drains what the thread left behind */
+    ring = (log_ring_t *)opaque;
+    __atomic_store_n(&ring->owned, 0, __ATOMIC_RELEASE);
+}
 
+static void *log_run(void *opaque)
+{
+    struct timespec wake;
+    int running;
+
+    (void)opaque;
+
+    do {
+        running = __atomic_load_n(&keep_running, __ATOMIC_ACQUIRE);
+        if((0 == log_drain()) && running) {
+            clock_gettime(CLOCK_REALTIME, &wake);
+            wake.tv_nsec += LOG_POLL * 1000000L;
+            if(wake.tv_nsec >= 1000000000L) {
+                wake.tv_sec++;
+                wake.tv_nsec -= 1000000000L;
+            }
+            pthread_mutex_lock(&log_mutex);
+            pthread_cond_timedwait(&log_cond, &log_mutex, &wake);
+            pthread_mutex_unlock(&log_mutex);
+        }
+    } while(running);
+    /* whatever raced with shutdown */
+    log_drain();
 
+    return NULL;
+}
+
+static int log_drain(void)
+{
+    static char stamp[32];
+    static time_t stamped = 0;
+    struct tm tm;
+    time_t sec;
+    log_ring_t *ring;
+    log_ring_t *next;
+    log_entry_t *e;
+    uint64_t dropped;
+    size_t len;
+    int n;
 
-#endif /* HAVE_LIBLOG4C */
+    /* merges the rings oldest first */
+    n = 0;
+    for(;;) {
+        next = NULL;
+        for(ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring;
+                ring = ring->next) {
+            if(ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+                continue;
+            }
+            if((NULL == next) ||
+                    (ring->slot[ring->tail % LOG_RING_SLOTS].ts <
+                     next->slot[next->tail % LOG_RING_SLOTS].ts)) {
+                next = ring;
+            }
+        }
+        if(NULL == next) {
+            break;
+        }
 
+        e = &next->slot[next->tail % LOG_RING_SLOTS];
+        sec = (time_t)(e->ts / 1000000000LL);
+        if(sec != stamped) {
+            localtime_r(&sec, &tm);
+            strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+            stamped = sec;
+        }
+        len = strlen(e->line);
+        while((len > 0) && ('\n' == e->line[len - 1])) {
+            len--;
+        }
+        log_size += fprintf(log_file, "%s.%03d %-5s %d %.*s\n", stamp,
+                (int)((e->ts / 1000000LL) % 1000LL), log_names[e->level],
+                (int)e->tid, (int)len, e->line);
+        __atomic_store_n(&next->tail, next->tail + 1, __ATOMIC_RELEASE);
+        n++;
+
+        if(log_size >= LOG_FILE_MAX) {
+            log_rotate();
+        }
+    }
+
+    for(ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring;
+            ring = ring->next) {
+        dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if(dropped > ring->reported) {
+            log_size += fprintf(log_file, "%llu messages dropped\n",
+                    (unsigned long long)(dropped - ring->reported));
+            ring->reported = dropped;
+            n++;
+        }
+    }
+    if(n > 0) {
+        fflush(log_file);
+    }
+    return n;
+}
+
+static int log_open(void)
+{
+    struct stat st;
+
+    log_file = fopen(log_path, "a");
+    if(NULL == log_file) {
+        return -1;
+    }
+    setvbuf(log_file, NULL, _IOFBF, 64 * 1024);
+    log_size = 0;
+    if(0 == fstat(fileno(log_file), &st)) {
+        log_size = (long)st.st_size;
+    }
+    return 0;
+}
+
+static void log_rotate(void)
+{
+    char from[LOG_ROTATED_MAX + 1];
+    char to[LOG_ROTATED_MAX + 1];
+    int i;
+
+    /* drivefusesync.log -> .1 -> ... -> .LOG_FILES, the oldest goes */
+    if(log_file != stderr) {
+        fclose(log_file);
+    }
+    for(i = LOG_FILES - 1; i >= 0; i--) {
+        memset(from, 0, (LOG_ROTATED_MAX + 1) * sizeof(char));
+        memset(to, 0, (LOG_ROTATED_MAX + 1) * sizeof(char));
+        if(0 == i) {
+            snprintf(from, LOG_ROTATED_MAX, "%s", log_path);
+        } else {
+            snprintf(from, LOG_ROTATED_MAX, "%s.%d", log_path, i);
+        }
+        snprintf(to, LOG_ROTATED_MAX, "%s.%d", log_path, i + 1);
+        rename(from, to);
+    }
+    if(log_open() != 0) {
+        /* keep going on stderr rather than lose the writer */
+        log_file = stderr;
+        log_size = 0;
+    }
+}
@@ -22,17 +22,40 @@ along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include "blkcache.h"
 #include "dbcache.h"
 #include "driveapi.h"
+#include "fetch.h"
 #include "fscache.h"
+#include "fsio.h"
 #include "fuseapi.h"
+#include "history.h"
 #include "log.h"
+#include "stats.h"
+#include "trace.h"
+#include "xfer.h"
 
 struct _conf
 {
     int setup;
     int daemonize;
+    unsigned int iodepth;
+    size_t ramcache;
+    int fetchers;
+    size_t prefetch;
+    size_t siblings;
+    size_t downlimit;
+    size_t uplimit;
+    int limitfrom;
+    int limitto;
+    int loglevel;
+    long slowms;
     
+#define URL_MAX     255
+    char apiurl[URL_MAX + 1];
+    char oauthurl[URL_MAX + 1];
+    char tracefile[PATH_MAX + 1];
+
     char basedir[PATH_MAX + 1];
     char cachedir[PATH_MAX + 1];
     char mountpoint[PATH_MAX + 1];
@@ -55,6 +78,8 @@ int main(int argc, char *argv[])
     
     set_defaults(&conf);
     parse_command_line(&conf, argc, argv);
+    drive_endpoints(conf.apiurl, conf.oauthurl);
+    drive_slowlog(conf.slowms);
 
     if(conf.setup) {
         dbcache_open(conf.dbfile);
@@ -72,29 +97,46 @@ int main(int argc, char *argv[])
     mkdir(conf.mountpoint, (mode_t)0700);
     mkdir(conf.logdir, (mode_t)0700);
 
+    log_set_level(conf.loglevel);
     log_init(conf.logdir);
+    stats_setup();
 
     log_debug("writing pidfile %s", conf.pidfile);
     write_pid(conf.pidfile);
 
     log_info("setting up filesystem cache %s", conf.cachedir);
+    fsio_setup(conf.iodepth);
     fscache_setup(conf.cachedir);
+    blkcache_setup(conf.ramcache);
 
     dbcache_open(conf.dbfile);
     if(!conf.setup) {
         dbcache_setup();
     }
+    fscache_rekey();
 
+    xfer_bwlimit(conf.downlimit, conf.uplimit, conf.limitfrom, conf.limitto);
+    xfer_setup();
+    fetch_setup(conf.fetchers, conf.siblings);
+    history_setup(conf.prefetch);
     drive_start();
+    trace_setup(conf.tracefile);
 
     fuseapi_run(conf.mountpoint);
 
+    trace_cleanup();
     drive_stop();
+    history_cleanup();
+    fetch_cleanup();
+    xfer_cleanup();
 
     dbcache_close();
 
+    blkcache_cleanup();
     fscache_cleanup();
+    fsio_cleanup();
 
+    stats_cleanup();
     log_term();
 
     return 0;
@@ -104,6 +146,12 @@ static void set_defaults(conf_t *conf)
 {
     const char *home;
     memset(conf, 0, sizeof(conf_t));
+    conf->iodepth = 64;
+    conf->ramcache = 64 * 1024 * 1024;
+    conf->fetchers = FETCH_WORKERS;
+    conf->prefetch = 256 * 1024 * 1024;
+    conf->loglevel = LOG_INFO;
+    conf->slowms = 2000;
     home = getenv("HOME");
     if(home) {
         snprintf(conf->basedir, PATH_MAX, "%s/.drivefusesync", home);
@@ -114,7 +162,7 @@ static void set_defaults(conf_t *conf)
 static void parse_command_line(conf_t *conf, int argc, char *argv[])
 {
     int o;
-#define OPTS    "sdu:b:m:l:h"
+#define OPTS    "sdu:b:m:l:q:r:j:p:S:D:U:H:A:O:T:V:W:h"
     static struct option lopts[] = {
         {"setup", 0, NULL, 's'},
         {"daemonize", 0, NULL, 'd'},
@@ -122,6 +170,19 @@ static void parse_command_line(conf_t *conf, int argc, char *argv[])
         {"base-dir", 1, NULL, 'b'},
         {"mount-point", 1, NULL, 'm'},
         {"log-dir", 1, NULL, 'l'},
+        {"io-depth", 1, NULL, 'q'},
+        {"ram-cache", 1, NULL, 'r'},
+        {"fetch-workers", 1, NULL, 'j'},
+        {"prefetch", 1, NULL, 'p'},
+        {"sibling-max", 1, NULL, 'S'},
+        {"down-limit", 1, NULL, 'D'},
+        {"up-limit", 1, NULL, 'U'},
+        {"limit-hours", 1, NULL, 'H'},
+        {"api-url", 1, NULL, 'A'},
+        {"oauth-url", 1, NULL, 'O'},
+        {"trace", 1, NULL, 'T'},
+        {"log-level", 1, NULL, 'V'},
+        {"slow-request", 1, NULL, 'W'},
         {"help", 0, NULL, 'h'},
         {0, 0, 0, 0}
     };
@@ -158,6 +219,77 @@ static void parse_command_line(conf_t *conf, int argc, char *argv[])
                 strncpy(conf->logdir, optarg, PATH_MAX);
             }
             break;
+        case 'q':
+            if(optarg) {
+                conf->iodepth = (unsigned int)strtoul(optarg, NULL, 10);
+            }
+            break;
+        case 'r':
+            if(optarg) {
+                conf->ramcache = (size_t)strtoul(optarg, NULL, 10) *
+                        1024 * 1024;
+            }
+            break;
+        case 'j':
+            if(optarg) {
+                conf->fetchers = (int)strtol(optarg, NULL, 10);
+            }
+            break;
+        case 'p':
+            if(optarg) {
+                conf->prefetch = (size_t)strtoul(optarg, NULL, 10) *
+                        1024 * 1024;
+            }
+            break;
+        case 'S':
+            if(optarg) {
+                conf->siblings = (size_t)strtoul(optarg, NULL, 10) * 1024;
+            }
+            break;
+        case 'D':
+            if(optarg) {
+                conf->downlimit = (size_t)strtoul(optarg, NULL, 10) * 1024;
+            }
+            break;
+        case 'U':
+            if(optarg) {
+                conf->uplimit = (size_t)strtoul(optarg, NULL, 10) * 1024;
+            }
+            break;
+        case 'H':
+            if(optarg) {
+                sscanf(optarg, "%d-%d", &conf->limitfrom, &conf->limitto);
+            }
+            break;
+        case 'A':
+            if(optarg) {
+                strncpy(conf->apiurl, optarg, URL_MAX);
+            }
+            break;
+        case 'O':
+            if(optarg) {
+                strncpy(conf->oauthurl, optarg, URL_MAX);
+            }
+            break;
+        case 'T':
+            if(optarg) {
+                strncpy(conf->tracefile, optarg, PATH_MAX);
+            }
+            break;
+        case 'V':
+            if(optarg) {
+                conf->loglevel = log_parse_level(optarg);
+                if(conf->loglevel < 0) {
+                    fprintf(stderr, "unknown log level %s\n", optarg);
+                    exit(1);
+                }
+            }
+            break;
+        case 'W':
+            if(optarg) {
+                conf->slowms = strtol(optarg, NULL, 10);
+            }
+            break;
         case 'h':
             printf("usage: %s "
                 "[-s|--setup] "
@@ -165,12 +297,39 @@ static void parse_command_line(conf_t *conf, int argc, char *argv[])
                 "[-b|--base-dir <BASEDIR>] "
                 "[-m|--mount-point <MOUNTPOINT>] "
                 "[-l|--log-dir <LOGDIR>] "
+                "[-q|--io-depth <DEPTH>] "
+                "[-r|--ram-cache <MBYTES>] "
+                "[-j|--fetch-workers <WORKERS>] "
+                "[-p|--prefetch <PMBYTES>] "
+                "[-S|--sibling-max <KBYTES>] "
+                "[-D|--down-limit <KBPS>] "
+                "[-U|--up-limit <KBPS>] "
+                "[-H|--limit-hours <FROM>-<TO>] "
+                "[-A|--api-url <URL>] "
+                "[-O|--oauth-url <URL>] "
+                "[-T|--trace <TRACEFILE>] "
+                "[-V|--log-level <LEVEL>] "
+                "[-W|--slow-request <MSECS>] "
                 "-u|--user <USERNAME> "
                 " | "
                 "-h|--help\n"
                 "\n"
                 "BASEDIR defaults to ${HOME}/.drivefusesync\n"
                 "USER is the drive user\n"
+                "DEPTH is the cache I/O queue depth, 0 for blocking I/O\n"
+                "MBYTES is the ram block cache budget, 0 to disable\n"
+                "WORKERS bounds background downloads (pinned, refreshed)\n"
+                "PMBYTES is the hourly history prefetch budget, 0 to disable\n"
+                "KBYTES makes opening a directory fetch all files up to that\n"
+                "  size in it at once, 0 (default) to disable\n"
+                "KBPS caps background (prefetch, crawl) bandwidth in KB/s,\n"
+                "  between FROM and TO o'clock if given, 0 for no cap\n"
+                "URL points drive (v3) or oauth2 requests elsewhere, e.g. at\n"
+                "  tools/drivemock for offline testing\n"
+                "TRACEFILE records every fuse operation, for tools/dfsreplay\n"
+                "LEVEL is one of error, warning, info (default), debug\n"
+                "MSECS logs drive requests taking longer, with curl's timing\n"
+                "  breakdown, default 2000, 0 to disable\n"
                 "\n", argv[0]);
             exit(0);
         }
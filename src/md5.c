@@ -0,0 +1,159 @@
+This file is part of drive-fuse-sync.
+
+drive-fuse-sync is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+drive-fuse-sync is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "md5.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* RFC 1321, only used to check downloads against the checksum drive
+ * reports, so plain and unoptimized */
+
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const uint8_t md5_r[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+static void md5_block(md5_t *, const uint8_t *);
+
+void md5_init(md5_t *ctx)
+{
+    memset(ctx, 0, sizeof(md5_t));
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+}
+
+void md5_update(md5_t *ctx, const void *data, size_t len)
+{
+    const uint8_t *p;
+    size_t used;
+    size_t n;
+
+    p = (const uint8_t *)data;
+    used = (size_t)(ctx->len % 64);
+    ctx->len += len;
+
+    if(used > 0) {
+        n = 64 - used;
+        if(n > len) {
+            n = len;
+        }
+        memcpy(ctx->buf + used, p, n);
+        p += n;
+        len -= n;
+        if(used + n < 64) {
+            return;
+        }
+        md5_block(ctx, ctx->buf);
+    }
+    while(len >= 64) {
+        md5_block(ctx, p);
+        p += 64;
+        len -= 64;
+    }
+    memcpy(ctx->buf, p, len);
+}
+
+void md5_hex(md5_t *ctx, char *hex)
+{
+    uint8_t pad[72];
+    uint64_t bits;
+    size_t n;
+    int i;
+
+    /* pad to 56 mod 64 and append the length in bits, little endian */
+    bits = ctx->len * 8;
+    n = 64 - (size_t)((ctx->len + 8) % 64);
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for(i = 0; i < 8; i++) {
+        pad[n + i] = (uint8_t)(bits >> (8 * i));
+    }
+    md5_update(ctx, pad, n + 8);
+
+    memset(hex, 0, (MD5_HEX_MAX + 1) * sizeof(char));
+    for(i = 0; i < 16; i++) {
+        snprintf(hex + 2 * i, 3, "%02x",
+                (unsigned int)((ctx->state[i / 4] >> (8 * (i % 4))) & 0xff));
+    }
+}
+
+static void md5_block(md5_t *ctx, const uint8_t *p)
+{
+    uint32_t w[16];
+    uint32_t a, b, c, d;
+    uint32_t f;
+    uint32_t tmp;
+    int g;
+    int i;
+
+    for(i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4 * i] | ((uint32_t)p[4 * i + 1] << 8) |
+                ((uint32_t)p[4 * i + 2] << 16) | ((uint32_t)p[4 * i + 3] << 24);
+    }
+
+    a = ctx->state[0];
+    b = ctx->state[1];
+    c = ctx->state[2];
+    d = ctx->state[3];
+    for(i = 0; i < 64; i++) {
+        if(i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if(i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) % 16;
+        } else if(i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) % 16;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) % 16;
+        }
+        tmp = d;
+        d = c;
+        c = b;
+        f += a + md5_k[i] + w[g];
+        b += (f << md5_r[i]) | (f >> (32 - md5_r[i]));
+        a = tmp;
+    }
+    ctx->state[0] += a;
+    ctx->state[1] += b;
+    ctx->state[2] += c;
+    ctx->state[3] += d;
+}
@@ -0,0 +1,375 @@
+This file is part of drive-fuse-sync.
+
+drive-fuse-sync is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+drive-fuse-sync is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* log-linear buckets: exact below 8ns, then 8 per power of two, so any
+ * recorded value is off by at most 12.5%; the last bucket also takes
+ * everything beyond about half an hour. Every thread records into a shard
+ * of its own with plain stores, readers sum the shards and may see a
+ * sample in the count before it shows in the sum. Shards of threads that
+ * exited are taken over by new ones, counters only ever grow. */
+
+#define STATS_SUB       8
+#define STATS_BUCKETS   320
+
+struct _stats_shard
+{
+    uint64_t count[STATS_METRICS][STATS_BUCKETS];
+    uint64_t sum[STATS_METRICS];
+    uint64_t errors[STATS_METRICS];
+    int64_t max[STATS_METRICS];
+    int owned;
+    struct _stats_shard *next;
+};
+typedef struct _stats_shard stats_shard_t;
+
+static const char *stats_names[STATS_METRICS][2] = {
+    { "fuse", "getattr" },
+    { "fuse", "mkdir" },
+    { "fuse", "rmdir" },
+    { "fuse", "open" },
+    { "fuse", "read" },
+    { "fuse", "release" },
+    { "fuse", "readdir" },
+    { "fuse", "setxattr" },
+    { "fuse", "getxattr" },
+    { "fuse", "listxattr" },
+    { "db", "findbypath" },
+    { "db", "listdir" },
+    { "db", "update" },
+    { "db", "remove" },
+    { "db", "content" },
+    { "db", "pin" },
+    { "db", "access" },
+    { "db", "dir" },
+    { "db", "change" },
+    { "db", "auth" },
+    { "cache", "open" },
+    { "cache", "read" },
+    { "cache", "write" },
+    { "cache", "inline_read" },
+    { "cache", "commit" },
+    { "http", "interactive" },
+    { "http", "metadata" },
+    { "http", "prefetch" },
+    { "http", "bulk" },
+    { "http", "auth" },
+    { "http", "dns" },
+    { "http", "connect" },
+    { "http", "tls" },
+    { "http", "wait" },
+};
+
+/* histogram bounds exported, in ns */
+static const int64_t stats_le[] = {
+    1000L, 2500L, 5000L,
+    10000L, 25000L, 50000L,
+    100000L, 250000L, 500000L,
+    1000000L, 2500000L, 5000000L,
+    10000000L, 25000000L, 50000000L,
+    100000000L, 250000000L, 500000000L,
+    1000000000L, 2500000000L, 5000000000L,
+    10000000000L,
+};
+#define STATS_LE    (sizeof(stats_le) / sizeof(stats_le[0]))
+
+static const double stats_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+#define STATS_QUANTILES \
+        (sizeof(stats_quantiles) / sizeof(stats_quantiles[0]))
+
+static stats_shard_t *stats_shards = NULL;
+static __thread stats_shard_t *stats_mine = NULL;
+static pthread_key_t stats_key;
+static int keep_running = 0;
+
+static stats_shard_t *stats_shard(void);
+static void stats_release(void *);
+static int stats_bucket(int64_t);
+static int64_t stats_bound(int);
+
+int stats_setup(void)
+{
+    pthread_key_create(&stats_key, stats_release);
+    __atomic_store_n(&keep_running, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int stats_cleanup(void)
+{
+    /* shards stay, a thread may be recording right now */
+    __atomic_store_n(&keep_running, 0, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int64_t stats_begin(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void stats_end(int metric, int64_t start, int err)
+{
+    if(!__atomic_load_n(&keep_running, __ATOMIC_RELAXED)) {
+        return;
+    }
+    stats_add(metric, stats_begin() - start, err);
+}
+
+void stats_add(int metric, int64_t ns, int err)
+{
+    stats_shard_t *sh;
+    uint64_t *c;
+    int b;
+
+    if(!__atomic_load_n(&keep_running, __ATOMIC_RELAXED) ||
+            (metric < 0) || (metric >= STATS_METRICS)) {
+        return;
+    }
+    sh = stats_shard();
+    if(NULL == sh) {
+        return;
+    }
+    if(ns < 0) {
+        ns = 0;
+    }
+
+    /* single writer, readers only need untorn values */
+    b = stats_bucket(ns);
+    c = &sh->count[metric][b];
+    __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + 1,
+            __ATOMIC_RELAXED);
+    c = &sh->sum[metric];
+    __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + ns,
+            __ATOMIC_RELAXED);
+    if(err) {
+        c = &sh->errors[metric];
+        __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + 1,
+                __ATOMIC_RELAXED);
+    }
+    if(ns > __atomic_load_n(&sh->max[metric], __ATOMIC_RELAXED)) {
+        __atomic_store_n(&sh->max[metric], ns, __ATOMIC_RELAXED);
+    }
+}
+
+int stats_print(FILE *f)
+{
+    uint64_t *count;
+    uint64_t total;
+    uint64_t cum;
+    uint64_t sum;
+    uint64_t errors;
+    int64_t max;
+    uint64_t rank;
+    stats_shard_t *sh;
+    size_t i;
+    size_t q;
+    int m;
+    int b;
+
+    count = malloc(STATS_BUCKETS * sizeof(uint64_t));
+    if(NULL == count) {
+        return -1;
+    }
+
+    fprintf(f, "# HELP dfs_op_duration_seconds Latency of filesystem, "
+            "database, cache and drive operations.\n");
+    fprintf(f, "# TYPE dfs_op_duration_seconds histogram\n");
+    for(m = 0; m < STATS_METRICS; m++) {
+        memset(count, 0, STATS_BUCKETS * sizeof(uint64_t));
+        total = 0;
+        sum = 0;
+        for(sh = __atomic_load_n(&stats_shards, __ATOMIC_ACQUIRE); sh;
+                sh = sh->next) {
+            for(b = 0; b < STATS_BUCKETS; b++) {
+                count[b] += __atomic_load_n(&sh->count[m][b],
+                        __ATOMIC_RELAXED);
+            }
+            sum += __atomic_load_n(&sh->sum[m], __ATOMIC_RELAXED);
+        }
+        for(b = 0; b < STATS_BUCKETS; b++) {
+            total += count[b];
+        }
+        if(0 == total) {
+            continue;
+        }
+
+        /* a bucket is only counted under a bound it lies wholly below */
+        cum = 0;
+        b = 0;
+        for(i = 0; i < STATS_LE; i++) {
+            while((b < STATS_BUCKETS) && (stats_bound(b + 1) <= stats_le[i])) {
+                cum += count[b];
+                b++;
+            }
+            fprintf(f, "dfs_op_duration_seconds_bucket{layer=\"%s\","
+                    "op=\"%s\",le=\"%g\"} %llu\n", stats_names[m][0],
+                    stats_names[m][1], (double)stats_le[i] / 1e9,
+                    (unsigned long long)cum);
+        }
+        fprintf(f, "dfs_op_duration_seconds_bucket{layer=\"%s\",op=\"%s\","
+                "le=\"+Inf\"} %llu\n", stats_names[m][0], stats_names[m][1],
+                (unsigned long long)total);
+        fprintf(f, "dfs_op_duration_seconds_sum{layer=\"%s\",op=\"%s\"} "
+                "%.9f\n", stats_names[m][0], stats_names[m][1],
+                (double)sum / 1e9);
+        fprintf(f, "dfs_op_duration_seconds_count{layer=\"%s\",op=\"%s\"} "
+                "%llu\n", stats_names[m][0], stats_names[m][1],
+                (unsigned long long)total);
+    }
+
+    fprintf(f, "# HELP dfs_op_duration_quantile_seconds Latency quantiles, "
+            "upper bound of the bucket the quantile falls in.\n");
+    fprintf(f, "# TYPE dfs_op_duration_quantile_seconds gauge\n");
+    for(m = 0; m < STATS_METRICS; m++) {
+        memset(count, 0, STATS_BUCKETS * sizeof(uint64_t));
+        total = 0;
+        max = 0;
+        for(sh = __atomic_load_n(&stats_shards, __ATOMIC_ACQUIRE); sh;
+                sh = sh->next) {
+            for(b = 0; b < STATS_BUCKETS; b++) {
+                count[b] += __atomic_load_n(&sh->count[m][b],
+                        __ATOMIC_RELAXED);
+            }
+            if(__atomic_load_n(&sh->max[m], __ATOMIC_RELAXED) > max) {
+                max = __atomic_load_n(&sh->max[m], __ATOMIC_RELAXED);
+            }
+        }
+        for(b = 0; b < STATS_BUCKETS; b++) {
+            total += count[b];
+        }
+        if(0 == total) {
+            continue;
+        }
+        for(q = 0; q < STATS_QUANTILES; q++) {
+            rank = (uint64_t)(stats_quantiles[q] * (double)total);
+            if(rank >= total) {
+                rank = total - 1;
+            }
+            cum = 0;
+            for(b = 0; b < STATS_BUCKETS - 1; b++) {
+                cum += count[b];
+                if(cum > rank) {
+                    break;
+                }
+            }
+            fprintf(f, "dfs_op_duration_quantile_seconds{layer=\"%s\","
+                    "op=\"%s\",quantile=\"%g\"} %.9f\n", stats_names[m][0],
+                    stats_names[m][1], stats_quantiles[q],
+                    (double)(stats_bound(b + 1) < max ?
+                        stats_bound(b + 1) : max) / 1e9);
+        }
+        fprintf(f, "dfs_op_duration_quantile_seconds{layer=\"%s\","
+                "op=\"%s\",quantile=\"1\"} %.9f\n", stats_names[m][0],
+                stats_names[m][1], (double)max / 1e9);
+    }
+
+    fprintf(f, "# HELP dfs_op_errors_total Operations that failed.\n");
+    fprintf(f, "# TYPE dfs_op_errors_total counter\n");
+    for(m = 0; m < STATS_METRICS; m++) {
+        errors = 0;
+        for(sh = __atomic_load_n(&stats_shards, __ATOMIC_ACQUIRE); sh;
+                sh = sh->next) {
+            errors += __atomic_load_n(&sh->errors[m], __ATOMIC_RELAXED);
+        }
+        if(errors > 0) {
+            fprintf(f, "dfs_op_errors_total{layer=\"%s\",op=\"%s\"} %llu\n",
+                    stats_names[m][0], stats_names[m][1],
+                    (unsigned long long)errors);
+        }
+    }
+
+    free(count);
+    return 0;
+}
+
+static stats_shard_t *stats_shard(void)
+{
+    stats_shard_t *sh;
+    int orphan;
+
+    if(stats_mine) {
+        return stats_mine;
+    }
+
+    /* adopt the shard of a thread that is gone, or add one */
+    for(sh = __atomic_load_n(&stats_shards, __ATOMIC_ACQUIRE); sh;
+            sh = sh->next) {
+        orphan = 0;
+        if(__atomic_compare_exchange_n(&sh->owned, &orphan, 1, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if(NULL == sh) {
+        sh = calloc(1, sizeof(stats_shard_t));
+        if(NULL == sh) {
+            return NULL;
+        }
+        sh->owned = 1;
+        sh->next = __atomic_load_n(&stats_shards, __ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&stats_shards, &sh->next, sh, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        }
+    }
+    stats_mine = sh;
+    pthread_setspecific(stats_key, sh);
+    return sh;
+}
+
+static void stats_release(void *opaque)
+{
+    stats_shard_t *sh;
+
+    sh = (stats_shard_t *)opaque;
+    __atomic_store_n(&sh->owned, 0, __ATOMIC_RELEASE);
+}
+
+static int stats_bucket(int64_t ns)
+{
+    int e;
+    int b;
+
+    if(ns < STATS_SUB) {
+        return (int)ns;
+    }
+    e = 63 - __builtin_clzll((unsigned long long)ns);
+    b = (e - 2) * STATS_SUB + (int)((ns >> (e - 3)) & (STATS_SUB - 1));
+    return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+static int64_t stats_bound(int b)
+{
+    int e;
+
+    /* lowest value of bucket b, so the exclusive upper bound of b - 1 */
+    if(b < STATS_SUB) {
+        return b;
+    }
+    if(b >= STATS_BUCKETS) {
+        return INT64_MAX;
+    }
+    e = b / STATS_SUB + 2;
+    return (int64_t)(STATS_SUB + b % STATS_SUB) << (e - 3);
+}
@@ -0,0 +1,228 @@
+This file is part of drive-fuse-sync.
+
+drive-fuse-sync is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+drive-fuse-sync is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+/* operations are appended to one of two buffers under a short lock and a
+ * writer thread flushes the other; when the writer falls behind records
+ * are dropped and counted rather than making fuse threads wait on disk */
+
+#define TRACE_BUF       (1024 * 1024)
+#define TRACE_FLUSH     1
+#define TRACE_PATH_MAX  1023
+
+static pthread_mutex_t trace_mutex;
+static pthread_cond_t trace_cond;
+static pthread_t trace_thread;
+static int keep_running = 0;
+
+static int trace_fd = -1;
+static char *trace_buf[2];
+static size_t trace_len = 0;
+static int trace_cur = 0;
+static int64_t trace_epoch;
+static uint64_t trace_records = 0;
+static uint64_t trace_dropped = 0;
+
+static void *trace_run(void *);
+static int64_t trace_now(void);
+
+int trace_setup(const char *file)
+{
+    trace_header_t header;
+    struct timespec ts;
+    int rc;
+
+    if((NULL == file) || (0 == strlen(file))) {
+        return 0;
+    }
+
+    trace_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+            (mode_t)0600);
+    if(trace_fd < 0) {
+        rc = -errno;
+        log_error("unable to open trace file %s: %d", file, -rc);
+        return rc;
+    }
+    trace_buf[0] = malloc(TRACE_BUF);
+    trace_buf[1] = malloc(TRACE_BUF);
+    if((NULL == trace_buf[0]) || (NULL == trace_buf[1])) {
+        free(trace_buf[0]);
+        free(trace_buf[1]);
+        close(trace_fd);
+        trace_fd = -1;
+        return -ENOMEM;
+    }
+
+    memset(&header, 0, sizeof(trace_header_t));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header.epoch = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    if(write(trace_fd, &header, sizeof(trace_header_t)) !=
+            (ssize_t)sizeof(trace_header_t)) {
+        log_error("unable to write trace file %s", file);
+    }
+
+    pthread_mutex_init(&trace_mutex, NULL);
+    pthread_cond_init(&trace_cond, NULL);
+    trace_epoch = 0;
+    trace_epoch = trace_now();
+
+    keep_running = 1;
+    if(pthread_create(&trace_thread, NULL, trace_run, NULL) != 0) {
+        log_error("unable to start trace thread");
+        keep_running = 0;
+        return -1;
+    }
+    log_info("tracing fuse operations to %s", file);
+    return 0;
+}
+
+int trace_cleanup(void)
+{
+    if(!keep_running) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&trace_mutex);
+    keep_running = 0;
+    pthread_cond_signal(&trace_cond);
+    pthread_mutex_unlock(&trace_mutex);
+    pthread_join(trace_thread, NULL);
+
+    log_info("trace: %llu records, %llu dropped",
+            (unsigned long long)trace_records,
+            (unsigned long long)trace_dropped);
+
+    close(trace_fd);
+    trace_fd = -1;
+    free(trace_buf[0]);
+    free(trace_buf[1]);
+    pthread_cond_destroy(&trace_cond);
+    pthread_mutex_destroy(&trace_mutex);
+
+    return 0;
+}
+
+int trace_enabled(void)
+{
+    return keep_running;
+}
+
+int64_t trace_begin(void)
+{
+    return trace_now();
+}
+
+void trace_end(int op, const char *path, int64_t off, int64_t size,
+        int64_t start, int result)
+{
+    trace_record_t rec;
+    size_t plen;
+    char *dst;
+
+    memset(&rec, 0, sizeof(trace_record_t));
+    rec.duration = trace_now() - start;
+    plen = path ? strlen(path) : 0;
+    if(plen > TRACE_PATH_MAX) {
+        plen = TRACE_PATH_MAX;
+    }
+    rec.len = (uint16_t)(sizeof(trace_record_t) + plen);
+    rec.op = (uint8_t)op;
+    rec.result = (int32_t)result;
+    rec.start = start - trace_epoch;
+    rec.off = off;
+    rec.size = size;
+
+    pthread_mutex_lock(&trace_mutex);
+    if(trace_len + rec.len > TRACE_BUF) {
+        trace_dropped++;
+        pthread_cond_signal(&trace_cond);
+        pthread_mutex_unlock(&trace_mutex);
+        return;
+    }
+    dst = trace_buf[trace_cur] + trace_len;
+    memcpy(dst, &rec, sizeof(trace_record_t));
+    memcpy(dst + sizeof(trace_record_t), path, plen);
+    trace_len += rec.len;
+    trace_records++;
+    if(trace_len > TRACE_BUF / 2) {
+        pthread_cond_signal(&trace_cond);
+    }
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+static void *trace_run(void *opaque)
+{
+    struct timespec wake;
+    const char *data;
+    size_t len;
+    ssize_t n;
+    int running;
+
+    (void)opaque;
+
+    do {
+        pthread_mutex_lock(&trace_mutex);
+        if(keep_running && (trace_len <= TRACE_BUF / 2)) {
+            clock_gettime(CLOCK_REALTIME, &wake);
+            wake.tv_sec += TRACE_FLUSH;
+            pthread_cond_timedwait(&trace_cond, &trace_mutex, &wake);
+        }
+        running = keep_running;
+        /* swap, appends go on in the other buffer while this one is
+         * written out */
+        data = trace_buf[trace_cur];
+        len = trace_len;
+        trace_cur = 1 - trace_cur;
+        trace_len = 0;
+        pthread_mutex_unlock(&trace_mutex);
+
+        while(len > 0) {
+            n = write(trace_fd, data, len);
+            if(n < 0) {
+                if(EINTR == errno) {
+                    continue;
+                }
+                log_error("unable to write trace: %d", errno);
+                break;
+            }
+            data += n;
+            len -= (size_t)n;
+        }
+    } while(running);
+
+    return NULL;
+}
+
+static int64_t trace_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
@@ -0,0 +1,404 @@
+This file is part of drive-fuse-sync.
+
+drive-fuse-sync is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+drive-fuse-sync is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "xfer.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+/* admission of drive transfers by priority class: a class waits while a
+ * more urgent one has work it could start, each class has its own
+ * concurrency limit, and while interactive transfers are running or
+ * waiting background classes are squeezed to a single transfer each and
+ * stall in xfer_yield() from their progress callback */
+
+#define XFER_TOTAL          12
+#define XFER_SQUEEZED       1
+#define XFER_YIELD_MS       100
+
+/* request rate shared by all transfers, after drive's default per-user
+ * quota; halved on each throttling response, crept back up on success */
+#define XFER_QPS_MAX        10.0
+#define XFER_QPS_MIN        0.5
+#define XFER_QPS_STEP       0.05
+#define XFER_BURST          20.0
+
+static const int xfer_limits[XFER_CLASSES] = {
+    8,      /* interactive */
+    2,      /* metadata */
+    4,      /* prefetch, refresh */
+    2       /* bulk crawl */
+};
+
+static pthread_mutex_t xfer_mutex;
+static pthread_cond_t xfer_cond;
+static int xfer_running[XFER_CLASSES];
+static int xfer_waiting[XFER_CLASSES];
+static int xfer_total = 0;
+static int xfer_enabled = 0;
+
+static pthread_mutex_t xfer_rate_mutex;
+static double xfer_qps = XFER_QPS_MAX;
+static double xfer_tokens = XFER_BURST;
+static struct timespec xfer_refill;
+static uint64_t xfer_events[XFER_EVENTS];
+
+/* background bandwidth, in bytes per second, 0 for no limit; applied
+ * between xfer_from and xfer_to o'clock, all day when they are equal */
+static size_t xfer_down = 0;
+static size_t xfer_up = 0;
+static int xfer_from = 0;
+static int xfer_to = 0;
+static double xfer_bytes = 0.0;
+static struct timespec xfer_bytes_refill;
+
+static int xfer_limit(int);
+static int xfer_admit(int);
+
+int xfer_setup(void)
+{
+    pthread_mutex_init(&xfer_mutex, NULL);
+    pthread_cond_init(&xfer_cond, NULL);
+    memset(xfer_running, 0, XFER_CLASSES * sizeof(int));
+    memset(xfer_waiting, 0, XFER_CLASSES * sizeof(int));
+    xfer_total = 0;
+
+    pthread_mutex_init(&xfer_rate_mutex, NULL);
+    xfer_qps = XFER_QPS_MAX;
+    xfer_tokens = XFER_BURST;
+    clock_gettime(CLOCK_MONOTONIC, &xfer_refill);
+    memset(xfer_events, 0, XFER_EVENTS * sizeof(uint64_t));
+    xfer_bytes = (double)xfer_down;
+    clock_gettime(CLOCK_MONOTONIC, &xfer_bytes_refill);
+    xfer_enabled = 1;
+
+    return 0;
+}
+
+int xfer_cleanup(void)
+{
+    xfer_enabled = 0;
+    log_info("drive requests: %lu throttled, %lu server errors, "
+            "%lu transport errors, %lu retries",
+            (unsigned long)xfer_events[XFER_EV_THROTTLED],
+            (unsigned long)xfer_events[XFER_EV_SERVER],
+            (unsigned long)xfer_events[XFER_EV_TRANSPORT],
+            (unsigned long)xfer_events[XFER_EV_RETRY]);
+    pthread_mutex_destroy(&xfer_rate_mutex);
+    pthread_cond_destroy(&xfer_cond);
+    pthread_mutex_destroy(&xfer_mutex);
+
+    return 0;
+}
+
+int xfer_enter(int cls)
+{
+    if(!xfer_enabled) {
+        return 0;
+    }
+    if((cls < 0) || (cls >= XFER_CLASSES)) {
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&xfer_mutex);
+    xfer_waiting[cls]++;
+    while(!xfer_admit(cls)) {
+        pthread_cond_wait(&xfer_cond, &xfer_mutex);
+    }
+    xfer_waiting[cls]--;
+    xfer_running[cls]++;
+    xfer_total++;
+    pthread_mutex_unlock(&xfer_mutex);
+
+    return 0;
+}
+
+int xfer_try_enter(int cls)
+{
+    int rc;
+
+    /* as xfer_enter(), for callers that have other transfers to tend to
+     * instead of waiting */
+    if(!xfer_enabled) {
+        return 0;
+    }
+    if((cls < 0) || (cls >= XFER_CLASSES)) {
+        return -EINVAL;
+    }
+
+    rc = -EAGAIN;
+    pthread_mutex_lock(&xfer_mutex);
+    if(xfer_admit(cls)) {
+        xfer_running[cls]++;
+        xfer_total++;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&xfer_mutex);
+
+    return rc;
+}
+
+int xfer_leave(int cls)
+{
+    if(!xfer_enabled) {
+        return 0;
+    }
+    if((cls < 0) || (cls >= XFER_CLASSES)) {
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&xfer_mutex);
+    xfer_running[cls]--;
+    xfer_total--;
+    pthread_cond_broadcast(&xfer_cond);
+    pthread_mutex_unlock(&xfer_mutex);
+
+    return 0;
+}
+
+int xfer_yield(int cls)
+{
+    struct timespec ts;
+    int stalled;
+
+    /* called from transfer progress callbacks: background transfers hold
+     * still for a while when interactive ones need the link */
+    if(!xfer_enabled || (cls < XFER_PREFETCH)) {
+        return 0;
+    }
+
+    stalled = 0;
+    pthread_mutex_lock(&xfer_mutex);
+    if(xfer_running[XFER_INTERACTIVE] || xfer_waiting[XFER_INTERACTIVE]) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += XFER_YIELD_MS * 1000000L;
+        if(ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&xfer_cond, &xfer_mutex, &ts);
+        stalled = 1;
+    }
+    pthread_mutex_unlock(&xfer_mutex);
+
+    return stalled;
+}
+
+int xfer_token(void)
+{
+    struct timespec now;
+    double elapsed;
+    long wait;
+
+    if(!xfer_enabled) {
+        return 0;
+    }
+
+    /* token bucket, waiting out the deficit outside the lock */
+    pthread_mutex_lock(&xfer_rate_mutex);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - xfer_refill.tv_sec) +
+            (now.tv_nsec - xfer_refill.tv_nsec) / 1000000000.0;
+    xfer_refill = now;
+    xfer_tokens += elapsed * xfer_qps;
+    if(xfer_tokens > XFER_BURST) {
+        xfer_tokens = XFER_BURST;
+    }
+    xfer_tokens -= 1.0;
+    wait = 0;
+    if(xfer_tokens < 0.0) {
+        wait = (long)(-xfer_tokens / xfer_qps * 1000000.0);
+    }
+    pthread_mutex_unlock(&xfer_rate_mutex);
+
+    if(wait > 0) {
+        usleep((useconds_t)wait);
+    }
+    return 0;
+}
+
+int xfer_ok(void)
+{
+    if(!xfer_enabled) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&xfer_rate_mutex);
+    if(xfer_qps < XFER_QPS_MAX) {
+        xfer_qps += XFER_QPS_STEP;
+        if(xfer_qps > XFER_QPS_MAX) {
+            xfer_qps = XFER_QPS_MAX;
+        }
+    }
+    pthread_mutex_unlock(&xfer_rate_mutex);
+
+    return 0;
+}
+
+int xfer_throttled(void)
+{
+    if(!xfer_enabled) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&xfer_rate_mutex);
+    xfer_events[XFER_EV_THROTTLED]++;
+    xfer_qps /= 2.0;
+    if(xfer_qps < XFER_QPS_MIN) {
+        xfer_qps = XFER_QPS_MIN;
+    }
+    /* drain the burst too, or it is spent straight into the next 429 */
+    if(xfer_tokens > 0.0) {
+        xfer_tokens = 0.0;
+    }
+    log_debug("drive throttling, request rate down to %.2f/s", xfer_qps);
+    pthread_mutex_unlock(&xfer_rate_mutex);
+
+    return 0;
+}
+
+int xfer_count(int ev)
+{
+    if(!xfer_enabled || (ev < 0) || (ev >= XFER_EVENTS)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&xfer_rate_mutex);
+    xfer_events[ev]++;
+    pthread_mutex_unlock(&xfer_rate_mutex);
+
+    return 0;
+}
+
+int xfer_stats(uint64_t *events, double *qps)
+{
+    pthread_mutex_lock(&xfer_rate_mutex);
+    memcpy(events, xfer_events, XFER_EVENTS * sizeof(uint64_t));
+    *qps = xfer_qps;
+    pthread_mutex_unlock(&xfer_rate_mutex);
+
+    return 0;
+}
+
+int xfer_bwlimit(size_t down, size_t up, int from, int to)
+{
+    /* before xfer_setup() */
+    xfer_down = down;
+    xfer_up = up;
+    xfer_from = from % 24;
+    xfer_to = to % 24;
+
+    return 0;
+}
+
+size_t xfer_cap(int cls, int up)
+{
+    struct tm tm;
+    time_t now;
+    int inside;
+
+    /* interactive and metadata transfers are never capped */
+    if(cls < XFER_PREFETCH) {
+        return 0;
+    }
+    if(xfer_from != xfer_to) {
+        time(&now);
+        localtime_r(&now, &tm);
+        if(xfer_from < xfer_to) {
+            inside = (tm.tm_hour >= xfer_from) && (tm.tm_hour < xfer_to);
+        } else {
+            inside = (tm.tm_hour >= xfer_from) || (tm.tm_hour < xfer_to);
+        }
+        if(!inside) {
+            return 0;
+        }
+    }
+    return up ? xfer_up : xfer_down;
+}
+
+int xfer_consume(int cls, size_t len)
+{
+    struct timespec now;
+    double elapsed;
+    size_t cap;
+    long wait;
+
+    /* shared by all capped downloads; each handle is also capped by curl,
+     * this keeps their sum under the limit */
+    if(!xfer_enabled) {
+        return 0;
+    }
+    cap = xfer_cap(cls, 0);
+    if(0 == cap) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&xfer_rate_mutex);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - xfer_bytes_refill.tv_sec) +
+            (now.tv_nsec - xfer_bytes_refill.tv_nsec) / 1000000000.0;
+    xfer_bytes_refill = now;
+    xfer_bytes += elapsed * (double)cap;
+    if(xfer_bytes > (double)cap) {
+        xfer_bytes = (double)cap;
+    }
+    xfer_bytes -= (double)len;
+    wait = 0;
+    if(xfer_bytes < 0.0) {
+        wait = (long)(-xfer_bytes / (double)cap * 1000000.0);
+    }
+    pthread_mutex_unlock(&xfer_rate_mutex);
+
+    if(wait > 0) {
+        usleep((useconds_t)wait);
+    }
+    return 0;
+}
+
+static int xfer_limit(int cls)
+{
+    /* called with xfer_mutex held */
+    if((cls >= XFER_PREFETCH) && (xfer_running[XFER_INTERACTIVE] ||
+                xfer_waiting[XFER_INTERACTIVE])) {
+        return XFER_SQUEEZED;
+    }
+    return xfer_limits[cls];
+}
+
+static int xfer_admit(int cls)
+{
+    int c;
+
+    /* called with xfer_mutex held; interactive work may exceed the total
+     * so it never queues behind the background */
+    if(xfer_running[cls] >= xfer_limit(cls)) {
+        return 0;
+    }
+    if((cls != XFER_INTERACTIVE) && (xfer_total >= XFER_TOTAL)) {
+        return 0;
+    }
+    for(c = 0; c < cls; c++) {
+        if(xfer_waiting[c] && (xfer_running[c] < xfer_limit(c))) {
+            return 0;
+        }
+    }
+    return 1;
+}
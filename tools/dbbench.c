@@ -0,0 +1,421 @@
+This file is part of drive-fuse-sync.
+
+drive-fuse-sync is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+drive-fuse-sync is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dbcache.h"
+
+/* micro-benchmark of the metadata cache: builds a synthetic tree through
+ * dbcache_update() and times path resolution, directory listing and bulk
+ * metadata updates against it, one result line per phase so runs can be
+ * diffed across commits
+ *
+ * directories are numbered breadth first, directory k (k > 0) being child
+ * (k - 1) % fanout of directory (k - 1) / fanout, so paths and uuids follow from
+ * the numbers and nothing but the latencies is kept in memory */
+
+#define BENCH_NAME_MAX      63
+#define BENCH_SAMPLES       100000
+
+struct _bench_conf
+{
+    int64_t entries;
+    int fanout;
+    int files;
+    int samples;
+    unsigned int seed;
+    char dbfile[PATH_MAX + 1];
+};
+typedef struct _bench_conf bench_conf_t;
+
+static bench_conf_t conf;
+static int64_t ndirs;
+static int depth;
+static int64_t *lat;
+static int64_t found;
+
+static void usage(const char *);
+static int64_t now_ns(void);
+static void dir_uuid(int64_t, char *, size_t);
+static void dir_path(int64_t, char *, size_t);
+static void file_path(int64_t, int, char *, size_t);
+static int64_t random_dir(void);
+static int collect(int64_t, const char *, const char *, int, size_t, mode_t,
+        const struct timespec *, const struct timespec *,
+        const struct timespec *, const char *, int64_t);
+static void report(const char *, int64_t, int64_t);
+static void build(void);
+static void bench_lookup(void);
+static void bench_listdir(void);
+static void bench_update(void);
+
+int main(int argc, char *argv[])
+{
+    int o;
+    int64_t d;
+
+    memset(&conf, 0, sizeof(bench_conf_t));
+    conf.entries = 10000;
+    conf.fanout = 8;
+    conf.files = 24;
+    conf.samples = 10000;
+    conf.seed = 1;
+    snprintf(conf.dbfile, PATH_MAX, "/tmp/dbbench-%d.db", (int)getpid());
+
+    for(;;) {
+        o = getopt(argc, argv, "n:w:f:k:r:b:h");
+        if(-1 == o) {
+            break;
+        }
+        switch(o) {
+        case 'n':
+            conf.entries = (int64_t)strtoll(optarg, NULL, 10);
+            break;
+        case 'w':
+            conf.fanout = (int)strtol(optarg, NULL, 10);
+            break;
+        case 'f':
+            conf.files = (int)strtol(optarg, NULL, 10);
+            break;
+        case 'k':
+            conf.samples = (int)strtol(optarg, NULL, 10);
+            break;
+        case 'r':
+            conf.seed = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            strncpy(conf.dbfile, optarg, PATH_MAX);
+            break;
+        default:
+            usage(argv[0]);
+            exit('h' == o ? 0 : 1);
+        }
+    }
+    if((conf.fanout < 1) || (conf.files < 0) || (conf.entries < 1)) {
+        usage(argv[0]);
+        exit(1);
+    }
+    if((conf.samples < 1) || (conf.samples > BENCH_SAMPLES)) {
+        conf.samples = BENCH_SAMPLES;
+    }
+
+    /* every directory accounts for itself and its files */
+    ndirs = conf.entries / (conf.files + 1);
+    if(ndirs < 1) {
+        ndirs = 1;
+    }
+    depth = 0;
+    for(d = ndirs - 1; d > 0; d = (d - 1) / conf.fanout) {
+        depth++;
+    }
+
+    lat = malloc(conf.samples * sizeof(int64_t));
+    if(NULL == lat) {
+        return 1;
+    }
+    srand(conf.seed);
+
+    unlink(conf.dbfile);
+    dbcache_open(conf.dbfile);
+    dbcache_setup_schema();
+    dbcache_setup();
+
+    printf("# entries=%lld dirs=%lld files/dir=%d fanout=%d depth=%d "
+            "samples=%d\n", (long long)conf.entries, (long long)ndirs,
+            conf.files, conf.fanout, depth, conf.samples);
+    printf("%-10s %10s %10s %12s %10s %10s %10s %10s\n", "phase", "entries",
+            "ops", "ops/s", "p50(us)", "p90(us)", "p99(us)", "max(us)");
+
+    build();
+    bench_lookup();
+    bench_listdir();
+    bench_update();
+
+    dbcache_close();
+    unlink(conf.dbfile);
+    free(lat);
+
+    return 0;
+}
+
+static void usage(const char *argv0)
+{
+    printf("usage: %s [-n <ENTRIES>] [-w <FANOUT>] [-f <FILES>] "
+        "[-k <SAMPLES>] [-r <SEED>] [-b <DBFILE>] | -h\n"
+        "\n"
+        "ENTRIES is the tree size, 10000 by default\n"
+        "FANOUT and FILES are the subdirectories and files per directory\n"
+        "SAMPLES is the number of timed operations per phase\n"
+        "DBFILE is created, and removed when done\n"
+        "\n", argv0);
+}
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void dir_uuid(int64_t k, char *buf, size_t len)
+{
+    memset(buf, 0, len + 1);
+    if(0 == k) {
+        strncpy(buf, "root", len);
+    } else {
+        snprintf(buf, len, "bench-d%012lld", (long long)k);
+    }
+}
+
+static void dir_path(int64_t k, char *buf, size_t len)
+{
+    char tail[PATH_MAX + 1];
+    char name[BENCH_NAME_MAX + 1];
+
+    /* walks up to the root, prepending one component at a time */
+    memset(buf, 0, len + 1);
+    while(k > 0) {
+        memset(name, 0, (BENCH_NAME_MAX + 1) * sizeof(char));
+        snprintf(name, BENCH_NAME_MAX, "/dir%lld", (long long)k);
+        memset(tail, 0, (PATH_MAX + 1) * sizeof(char));
+        if(snprintf(tail, PATH_MAX, "%s%s", name, buf) >= (int)len) {
+            fprintf(stderr, "tree too deep for PATH_MAX, use a wider fanout\n");
+            exit(1);
+        }
+        memcpy(buf, tail, strlen(tail) + 1);
+        k = (k - 1) / conf.fanout;
+    }
+}
+
+static void file_path(int64_t k, int j, char *buf, size_t len)
+{
+    char dir[PATH_MAX + 1];
+
+    dir_path(k, dir, PATH_MAX);
+    memset(buf, 0, len + 1);
+    if(snprintf(buf, len, "%s/file%lld-%d.dat", dir, (long long)k, j) >=
+            (int)len) {
+        fprintf(stderr, "tree too deep for PATH_MAX, use a wider fanout\n");
+        exit(1);
+    }
+}
+
+static int64_t random_dir(void)
+{
+    return (int64_t)(((uint64_t)rand() << 31 | (uint64_t)rand()) %
+            (uint64_t)ndirs);
+}
+
+static int collect(int64_t id, const char *uuid, const char *name, int type,
+        size_t size, mode_t mode, const struct timespec *atime,
+        const struct timespec *mtime, const struct timespec *ctime,
+        const char *cksum, int64_t parent)
+{
+    (void)id;
+    (void)uuid;
+    (void)name;
+    (void)type;
+    (void)size;
+    (void)mode;
+    (void)atime;
+    (void)mtime;
+    (void)ctime;
+    (void)cksum;
+    (void)parent;
+    found++;
+    return 0;
+}
+
+static int cmp_lat(const void *a, const void *b)
+{
+    int64_t x;
+    int64_t y;
+
+    x = *(const int64_t *)a;
+    y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char *phase, int64_t ops, int64_t elapsed)
+{
+    int n;
+
+    n = (ops < conf.samples) ? (int)ops : conf.samples;
+    qsort(lat, n, sizeof(int64_t), cmp_lat);
+    printf("%-10s %10lld %10lld %12.1f %10.1f %10.1f %10.1f %10.1f\n", phase,
+            (long long)conf.entries, (long long)ops,
+            elapsed > 0 ? (double)ops * 1e9 / (double)elapsed : 0.0,
+            n ? (double)lat[n / 2] / 1e3 : 0.0,
+            n ? (double)lat[(n * 9) / 10] / 1e3 : 0.0,
+            n ? (double)lat[(n * 99) / 100] / 1e3 : 0.0,
+            n ? (double)lat[n - 1] / 1e3 : 0.0);
+    fflush(stdout);
+}
+
+static void build(void)
+{
+    char uuid[BENCH_NAME_MAX + 1];
+    char parent[BENCH_NAME_MAX + 1];
+    char name[BENCH_NAME_MAX + 1];
+    char cksum[BENCH_NAME_MAX + 1];
+    struct timespec ts;
+    int64_t start;
+    int64_t t;
+    int64_t ops;
+    int64_t k;
+    int j;
+
+    /* bulk insert as the initial crawl does it, directories before their
+     * contents; latencies are sampled over the first inserts only */
+    clock_gettime(CLOCK_REALTIME, &ts);
+    dbcache_update("root", "", 1, 0, &ts, &ts, "", "");
+    ops = 0;
+    start = now_ns();
+    for(k = 0; k < ndirs; k++) {
+        dir_uuid(k, parent, BENCH_NAME_MAX);
+        for(j = 0; j < conf.fanout; j++) {
+            if(k * conf.fanout + 1 + j >= ndirs) {
+                break;
+            }
+            dir_uuid(k * conf.fanout + 1 + j, uuid, BENCH_NAME_MAX);
+            memset(name, 0, (BENCH_NAME_MAX + 1) * sizeof(char));
+            snprintf(name, BENCH_NAME_MAX, "dir%lld",
+                    (long long)(k * conf.fanout + 1 + j));
+            t = now_ns();
+            dbcache_update(uuid, name, 1, 0, &ts, &ts, "", parent);
+            if(ops < conf.samples) {
+                lat[ops] = now_ns() - t;
+            }
+            ops++;
+        }
+        for(j = 0; j < conf.files; j++) {
+            memset(uuid, 0, (BENCH_NAME_MAX + 1) * sizeof(char));
+            snprintf(uuid, BENCH_NAME_MAX, "bench-f%012lld-%d",
+                    (long long)k, j);
+            memset(name, 0, (BENCH_NAME_MAX + 1) * sizeof(char));
+            snprintf(name, BENCH_NAME_MAX, "file%lld-%d.dat",
+                    (long long)k, j);
+            memset(cksum, 0, (BENCH_NAME_MAX + 1) * sizeof(char));
+            snprintf(cksum, BENCH_NAME_MAX, "%032llx", (long long)k * 131 + j);
+            t = now_ns();
+            dbcache_update(uuid, name, 0, 4096 + j, &ts, &ts, cksum, parent);
+            if(ops < conf.samples) {
+                lat[ops] = now_ns() - t;
+            }
+            ops++;
+        }
+    }
+    report("insert", ops, now_ns() - start);
+}
+
+static void bench_lookup(void)
+{
+    char path[PATH_MAX + 1];
+    int64_t start;
+    int64_t t;
+    int64_t misses;
+    int i;
+
+    /* random files, so the whole path is resolved */
+    misses = 0;
+    start = now_ns();
+    for(i = 0; i < conf.samples; i++) {
+        if(conf.files > 0) {
+            file_path(random_dir(), rand() % conf.files, path, PATH_MAX);
+        } else {
+            dir_path(random_dir(), path, PATH_MAX);
+        }
+        if(0 == strlen(path)) {
+            strcpy(path, "/");
+        }
+        t = now_ns();
+        if(dbcache_findbypath(path, collect) != 0) {
+            misses++;
+        }
+        lat[i] = now_ns() - t;
+    }
+    report("lookup", conf.samples, now_ns() - start);
+    if(misses > 0) {
+        fprintf(stderr, "lookup: %lld paths not found\n", (long long)misses);
+    }
+}
+
+static void bench_listdir(void)
+{
+    char path[PATH_MAX + 1];
+    int64_t start;
+    int64_t t;
+    int i;
+
+    found = 0;
+    start = now_ns();
+    for(i = 0; i < conf.samples; i++) {
+        dir_path(random_dir(), path, PATH_MAX);
+        if(0 == strlen(path)) {
+            strcpy(path, "/");
+        }
+        t = now_ns();
+        dbcache_listdir(path, collect);
+        lat[i] = now_ns() - t;
+    }
+    report("listdir", conf.samples, now_ns() - start);
+    printf("# listdir: %.1f entries per listing\n",
+            (double)found / (double)conf.samples);
+}
+
+static void bench_update(void)
+{
+    char uuid[BENCH_NAME_MAX + 1];
+    char parent[BENCH_NAME_MAX + 1];
+    char name[BENCH_NAME_MAX + 1];
+    char cksum[BENCH_NAME_MAX + 1];
+    struct timespec ts;
+    int64_t start;
+    int64_t t;
+    int64_t k;
+    int i;
+    int j;
+
+    /* what a change feed does: new content for existing files */
+    if(0 == conf.files) {
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    start = now_ns();
+    for(i = 0; i < conf.samples; i++) {
+        k = random_dir();
+        j = rand() % conf.files;
+        dir_uuid(k, parent, BENCH_NAME_MAX);
+        memset(uuid, 0, (BENCH_NAME_MAX + 1) * sizeof(char));
+        snprintf(uuid, BENCH_NAME_MAX, "bench-f%012lld-%d", (long long)k, j);
+        memset(name, 0, (BENCH_NAME_MAX + 1) * sizeof(char));
+        snprintf(name, BENCH_NAME_MAX, "file%lld-%d.dat", (long long)k, j);
+        memset(cksum, 0, (BENCH_NAME_MAX + 1) * sizeof(char));
+        snprintf(cksum, BENCH_NAME_MAX, "%032llx", (long long)i);
+        t = now_ns();
+        dbcache_update(uuid, name, 0, 8192 + j, &ts, &ts, cksum, parent);
+        lat[i] = now_ns() - t;
+    }
+    report("update", conf.samples, now_ns() - start);
+}
@@ -0,0 +1,528 @@
+This file is part of drive-fuse-sync.
+
+drive-fuse-sync is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+drive-fuse-sync is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+
+#include "trace.h"
+
+/* replays a trace recorded with drivefusesync -T against a mount, either
+ * as fast as possible or at the recorded pace (optionally scaled), and
+ * compares replayed latencies and outcomes per operation
+ *
+ * records are spread over -j worker threads by path, so operations on
+ * one path keep their order (an open, its reads and its release) while
+ * different paths overlap as they did in the recorded mount; paced
+ * workers issue each record at its recorded start
+ *
+ * operations are re-issued as the syscalls that caused them, so the
+ * kernel caches in between may absorb some of them; mkdir, rmdir and
+ * setxattr change the tree and are only replayed with -w */
+
+#define REPLAY_FDS      256
+#define REPLAY_BLOCK    (1024 * 1024)
+#define REPLAY_WORKERS  64
+#define REPLAY_QUEUE    64
+
+struct _replay_fd
+{
+    char path[PATH_MAX + 1];
+    int fd;
+};
+typedef struct _replay_fd replay_fd_t;
+
+struct _replay_job
+{
+    trace_record_t rec;
+    char path[PATH_MAX + 1];
+};
+typedef struct _replay_job replay_job_t;
+
+struct _replay_worker
+{
+    pthread_t thread;
+    replay_fd_t fds[REPLAY_FDS];
+    int nfds;
+    char *buf;
+
+    replay_job_t jobs[REPLAY_QUEUE];
+    int head;
+    int count;
+    int done;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+typedef struct _replay_worker replay_worker_t;
+
+struct _replay_stat
+{
+    int64_t *orig;
+    int64_t *lat;
+    int64_t n;
+    int64_t cap;
+    int64_t mismatches;
+    int64_t skipped;
+};
+typedef struct _replay_stat replay_stat_t;
+
+static const char *op_names[TRACE_OPS] = {
+    "?", "getattr", "mkdir", "rmdir", "open", "read", "release", "readdir",
+    "setxattr", "getxattr", "listxattr"
+};
+
+static replay_worker_t *workers;
+static int nworkers = 1;
+static replay_stat_t stats[TRACE_OPS];
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int paced = 0;
+static double speed = 1.0;
+static int64_t start;
+
+static int64_t now_ns(void);
+static uint32_t path_hash(const char *);
+static void worker_push(replay_worker_t *, const trace_record_t *,
+        const char *);
+static void *worker_run(void *);
+static int fd_find(replay_worker_t *, const char *);
+static int replay_one(replay_worker_t *, const trace_record_t *,
+        const char *);
+static void stat_add(replay_stat_t *, int64_t, int64_t);
+static int cmp_lat(const void *, const void *);
+static double pct(int64_t *, int64_t, int);
+
+int main(int argc, char *argv[])
+{
+    trace_header_t header;
+    trace_record_t rec;
+    char rel[PATH_MAX + 1];
+    char path[PATH_MAX + 1];
+    const char *mount;
+    int writes;
+    int64_t t;
+    int64_t total;
+    size_t plen;
+    FILE *f;
+    int o;
+    int i;
+
+    writes = 0;
+    for(;;) {
+        o = getopt(argc, argv, "j:rs:wh");
+        if(-1 == o) {
+            break;
+        }
+        switch(o) {
+        case 'j':
+            nworkers = atoi(optarg);
+            if(nworkers < 1) {
+                nworkers = 1;
+            }
+            if(nworkers > REPLAY_WORKERS) {
+                nworkers = REPLAY_WORKERS;
+            }
+            break;
+        case 'r':
+            paced = 1;
+            break;
+        case 's':
+            paced = 1;
+            speed = strtod(optarg, NULL);
+            if(speed <= 0.0) {
+                speed = 1.0;
+            }
+            break;
+        case 'w':
+            writes = 1;
+            break;
+        default:
+            printf("usage: %s [-j <N>] [-r] [-s <SPEED>] [-w] <TRACEFILE> "
+                    "<MOUNT>\n"
+                    "\n"
+                    "-j N replays on N threads, one path always on the same "
+                    "one (default 1)\n"
+                    "-r keeps the recorded pace, -s SPEED scales it\n"
+                    "-w also replays mkdir, rmdir and setxattr\n"
+                    "\n", argv[0]);
+            exit('h' == o ? 0 : 1);
+        }
+    }
+    if(optind + 2 > argc) {
+        fprintf(stderr, "trace file and mount point needed\n");
+        exit(1);
+    }
+    mount = argv[optind + 1];
+
+    f = fopen(argv[optind], "rb");
+    if(NULL == f) {
+        perror(argv[optind]);
+        exit(1);
+    }
+    if((fread(&header, sizeof(trace_header_t), 1, f) != 1) ||
+            memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) ||
+            (header.version != TRACE_VERSION)) {
+        fprintf(stderr, "%s is not a version %d trace\n", argv[optind],
+                TRACE_VERSION);
+        exit(1);
+    }
+    memset(stats, 0, sizeof(stats));
+    workers = calloc(nworkers, sizeof(replay_worker_t));
+    if(NULL == workers) {
+        exit(1);
+    }
+    for(i = 0; i < nworkers; i++) {
+        workers[i].buf = malloc(REPLAY_BLOCK);
+        if(NULL == workers[i].buf) {
+            exit(1);
+        }
+        pthread_mutex_init(&workers[i].mutex, NULL);
+        pthread_cond_init(&workers[i].cond, NULL);
+    }
+
+    total = 0;
+    start = now_ns();
+    for(i = 0; i < nworkers; i++) {
+        if(pthread_create(&workers[i].thread, NULL, worker_run,
+                    &workers[i]) != 0) {
+            fprintf(stderr, "unable to start worker %d\n", i);
+            exit(1);
+        }
+    }
+    while(1 == fread(&rec, sizeof(trace_record_t), 1, f)) {
+        if(rec.len < sizeof(trace_record_t)) {
+            fprintf(stderr, "corrupt record after %lld\n", (long long)total);
+            break;
+        }
+        plen = rec.len - sizeof(trace_record_t);
+        memset(rel, 0, (PATH_MAX + 1) * sizeof(char));
+        if((plen > PATH_MAX) || (fread(rel, 1, plen, f) != plen)) {
+            break;
+        }
+        if((rec.op < 1) || (rec.op >= TRACE_OPS)) {
+            continue;
+        }
+        total++;
+
+        if(!writes && ((TRACE_MKDIR == rec.op) ||
+                    (TRACE_RMDIR == rec.op) || (TRACE_SETXATTR == rec.op))) {
+            pthread_mutex_lock(&stats_mutex);
+            stats[rec.op].skipped++;
+            pthread_mutex_unlock(&stats_mutex);
+            continue;
+        }
+
+        memset(path, 0, (PATH_MAX + 1) * sizeof(char));
+        if(snprintf(path, PATH_MAX, "%s%s", mount, rel) >= PATH_MAX) {
+            /* too long under this mountpoint, would hit the wrong file */
+            pthread_mutex_lock(&stats_mutex);
+            stats[rec.op].skipped++;
+            pthread_mutex_unlock(&stats_mutex);
+            continue;
+        }
+        worker_push(&workers[path_hash(rel) % nworkers], &rec, path);
+    }
+    fclose(f);
+
+    for(i = 0; i < nworkers; i++) {
+        pthread_mutex_lock(&workers[i].mutex);
+        workers[i].done = 1;
+        pthread_cond_broadcast(&workers[i].cond);
+        pthread_mutex_unlock(&workers[i].mutex);
+    }
+    for(i = 0; i < nworkers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        free(workers[i].buf);
+        pthread_cond_destroy(&workers[i].cond);
+        pthread_mutex_destroy(&workers[i].mutex);
+    }
+    free(workers);
+    t = now_ns() - start;
+
+    printf("# %lld operations replayed in %.3f s (%s, %d thread%s)\n",
+            (long long)total, (double)t / 1e9,
+            paced ? "paced" : "as fast as possible", nworkers,
+            (1 == nworkers) ? "" : "s");
+    printf("%-10s %9s %11s %11s %11s %11s %9s %8s\n", "op", "count",
+            "p50(us)", "p99(us)", "rec-p50", "rec-p99", "mismatch",
+            "skipped");
+    for(i = 1; i < TRACE_OPS; i++) {
+        if((0 == stats[i].n) && (0 == stats[i].skipped)) {
+            continue;
+        }
+        printf("%-10s %9lld %11.1f %11.1f %11.1f %11.1f %9lld %8lld\n",
+                op_names[i], (long long)stats[i].n,
+                pct(stats[i].lat, stats[i].n, 50),
+                pct(stats[i].lat, stats[i].n, 99),
+                pct(stats[i].orig, stats[i].n, 50),
+                pct(stats[i].orig, stats[i].n, 99),
+                (long long)stats[i].mismatches,
+                (long long)stats[i].skipped);
+        free(stats[i].lat);
+        free(stats[i].orig);
+    }
+
+    return 0;
+}
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static uint32_t path_hash(const char *s)
+{
+    uint32_t h;
+
+    /* FNV-1a */
+    h = 2166136261u;
+    while(*s) {
+        h ^= (uint8_t)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void worker_push(replay_worker_t *w, const trace_record_t *rec,
+        const char *path)
+{
+    replay_job_t *job;
+
+    pthread_mutex_lock(&w->mutex);
+    while(REPLAY_QUEUE == w->count) {
+        pthread_cond_wait(&w->cond, &w->mutex);
+    }
+    job = &w->jobs[(w->head + w->count) % REPLAY_QUEUE];
+    memcpy(&job->rec, rec, sizeof(trace_record_t));
+    snprintf(job->path, PATH_MAX + 1, "%s", path);
+    w->count++;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+}
+
+static void *worker_run(void *opaque)
+{
+    replay_worker_t *w;
+    trace_record_t rec;
+    char path[PATH_MAX + 1];
+    int64_t t;
+    int rc;
+    int i;
+
+    w = (replay_worker_t *)opaque;
+    for(;;) {
+        pthread_mutex_lock(&w->mutex);
+        while((0 == w->count) && !w->done) {
+            pthread_cond_wait(&w->cond, &w->mutex);
+        }
+        if(0 == w->count) {
+            pthread_mutex_unlock(&w->mutex);
+            break;
+        }
+        memcpy(&rec, &w->jobs[w->head].rec, sizeof(trace_record_t));
+        memcpy(path, w->jobs[w->head].path, (PATH_MAX + 1) * sizeof(char));
+        w->head = (w->head + 1) % REPLAY_QUEUE;
+        w->count--;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->mutex);
+
+        if(paced) {
+            t = start + (int64_t)((double)rec.start / speed) - now_ns();
+            if(t > 0) {
+                usleep((useconds_t)(t / 1000));
+            }
+        }
+
+        t = now_ns();
+        rc = replay_one(w, &rec, path);
+        t = now_ns() - t;
+        pthread_mutex_lock(&stats_mutex);
+        stat_add(&stats[rec.op], rec.duration, t);
+        if((rc < 0) != (rec.result < 0)) {
+            stats[rec.op].mismatches++;
+        }
+        pthread_mutex_unlock(&stats_mutex);
+    }
+
+    for(i = 0; i < w->nfds; i++) {
+        close(w->fds[i].fd);
+    }
+    return NULL;
+}
+
+static int fd_find(replay_worker_t *w, const char *path)
+{
+    int i;
+
+    /* most recently opened first */
+    for(i = w->nfds - 1; i >= 0; i--) {
+        if(0 == strcmp(w->fds[i].path, path)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int replay_one(replay_worker_t *w, const trace_record_t *rec,
+        const char *path)
+{
+    struct stat st;
+    struct dirent *de;
+    DIR *dir;
+    size_t size;
+    ssize_t n;
+    int fd;
+    int i;
+    int rc;
+
+    rc = 0;
+    switch(rec->op) {
+    case TRACE_GETATTR:
+        rc = lstat(path, &st);
+        break;
+    case TRACE_READDIR:
+        /* continuation calls are part of the first one's listing */
+        if(rec->off != 0) {
+            break;
+        }
+        dir = opendir(path);
+        if(NULL == dir) {
+            return -1;
+        }
+        while((de = readdir(dir))) {
+            (void)de;
+        }
+        closedir(dir);
+        break;
+    case TRACE_OPEN:
+        fd = open(path, (int)rec->size & O_ACCMODE);
+        if(fd < 0) {
+            return -1;
+        }
+        if(w->nfds >= REPLAY_FDS) {
+            close(w->fds[0].fd);
+            memmove(&w->fds[0], &w->fds[1], (REPLAY_FDS - 1) * sizeof(replay_fd_t));
+            w->nfds--;
+        }
+        snprintf(w->fds[w->nfds].path, PATH_MAX + 1, "%s", path);
+        w->fds[w->nfds].fd = fd;
+        w->nfds++;
+        break;
+    case TRACE_READ:
+        size = (rec->size > REPLAY_BLOCK) ? REPLAY_BLOCK : (size_t)rec->size;
+        i = fd_find(w, path);
+        if(i >= 0) {
+            n = pread(w->fds[i].fd, w->buf, size, (off_t)rec->off);
+        } else {
+            /* opened before the trace started */
+            fd = open(path, O_RDONLY);
+            if(fd < 0) {
+                return -1;
+            }
+            n = pread(fd, w->buf, size, (off_t)rec->off);
+            close(fd);
+        }
+        rc = (n < 0) ? -1 : 0;
+        break;
+    case TRACE_RELEASE:
+        i = fd_find(w, path);
+        if(i >= 0) {
+            close(w->fds[i].fd);
+            memmove(&w->fds[i], &w->fds[i + 1], (w->nfds - i - 1) *
+                    sizeof(replay_fd_t));
+            w->nfds--;
+        }
+        break;
+    case TRACE_GETXATTR:
+        n = lgetxattr(path, "user.dfs.pinned", w->buf,
+                (rec->size > REPLAY_BLOCK) ? REPLAY_BLOCK : (size_t)rec->size);
+        rc = (n < 0) ? -1 : 0;
+        break;
+    case TRACE_LISTXATTR:
+        n = llistxattr(path, w->buf,
+                (rec->size > REPLAY_BLOCK) ? REPLAY_BLOCK : (size_t)rec->size);
+        rc = (n < 0) ? -1 : 0;
+        break;
+    case TRACE_MKDIR:
+        rc = mkdir(path, (mode_t)rec->size);
+        break;
+    case TRACE_RMDIR:
+        rc = rmdir(path);
+        break;
+    case TRACE_SETXATTR:
+        /* the value is not recorded, pinning is the only settable one */
+        rc = lsetxattr(path, "user.dfs.pinned", "1", 1, 0);
+        break;
+    }
+    return rc;
+}
+
+static void stat_add(replay_stat_t *s, int64_t orig, int64_t lat)
+{
+    int64_t *o;
+    int64_t *l;
+
+    if(s->n >= s->cap) {
+        s->cap = s->cap ? 2 * s->cap : 1024;
+        o = realloc(s->orig, s->cap * sizeof(int64_t));
+        if(o) {
+            s->orig = o;
+        }
+        l = realloc(s->lat, s->cap * sizeof(int64_t));
+        if(l) {
+            s->lat = l;
+        }
+        if((NULL == o) || (NULL == l)) {
+            s->cap = s->n;
+            return;
+        }
+    }
+    s->orig[s->n] = orig;
+    s->lat[s->n] = lat;
+    s->n++;
+}
+
+static int cmp_lat(const void *a, const void *b)
+{
+    int64_t x;
+    int64_t y;
+
+    x = *(const int64_t *)a;
+    y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double pct(int64_t *v, int64_t n, int p)
+{
+    if(0 == n) {
+        return 0.0;
+    }
+    qsort(v, n, sizeof(int64_t), cmp_lat);
+    return (double)v[(n * p) / 100] / 1e3;
+}
@@ -0,0 +1,1095 @@
+This file is part of drive-fuse-sync.
+
+drive-fuse-sync is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+drive-fuse-sync is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "md5.h"
+
+/* stand-in for the parts of the drive v3 and oauth2 endpoints the daemon
+ * uses, serving a synthetic tree over plain http so that the sync engine
+ * can be exercised without a network: point drivefusesync at it with
+ * -A http://127.0.0.1:PORT/drive/v3 -O http://127.0.0.1:PORT/oauth2
+ *
+ * ids are "root" and mockNNNNNNNN, content is a deterministic byte pattern
+ * of the file id and version, md5Checksum is its actual digest, computed
+ * the first time each version is listed;
+ * GET /mock/stats returns request and byte counters */
+
+#define MOCK_ID_MAX         31
+#define MOCK_NAME_MAX       63
+#define MOCK_REQ_MAX        8191
+#define MOCK_PATH_MAX       2047
+#define MOCK_TOKEN_MAX      127
+#define MOCK_TIME_MAX       31
+#define MOCK_CHUNK          16384
+#define MOCK_PAGE           100
+#define MOCK_NODES_MAX      (1 << 20)
+
+#define MOCK_API            "/drive/v3"
+#define MOCK_OAUTH          "/oauth2"
+#define MOCK_FOLDER         "application/vnd.google-apps.folder"
+
+struct _mock_conf
+{
+    int port;
+    int depth;
+    int width;
+    int files;
+    int64_t size;
+    long latency;
+    size_t bandwidth;
+    int errors;
+    int throttle;
+    double qps;
+    int expiry;
+    int churn;
+    int big;
+    int64_t bigsize;
+    int auth;
+    int verbose;
+};
+typedef struct _mock_conf mock_conf_t;
+
+struct _mock_node
+{
+    char id[MOCK_ID_MAX + 1];
+    char name[MOCK_NAME_MAX + 1];
+    int parent;
+    int isdir;
+    int64_t size;
+    int version;
+    time_t ctime;
+    time_t mtime;
+    char md5[MD5_HEX_MAX + 1];
+    int md5version;
+};
+typedef struct _mock_node mock_node_t;
+
+struct _mock_buf
+{
+    char *data;
+    size_t len;
+    size_t cap;
+};
+typedef struct _mock_buf mock_buf_t;
+
+struct _mock_request
+{
+    char method[16];
+    char path[MOCK_PATH_MAX + 1];
+    char query[MOCK_PATH_MAX + 1];
+    char token[MOCK_TOKEN_MAX + 1];
+    int ranged;
+    int64_t from;
+    int64_t to;
+    size_t length;
+    int close;
+};
+typedef struct _mock_request mock_request_t;
+
+static mock_conf_t conf;
+
+/* the tree and its change log, guarded by mock_mutex */
+static pthread_mutex_t mock_mutex = PTHREAD_MUTEX_INITIALIZER;
+static mock_node_t *nodes = NULL;
+static int nnodes = 0;
+static int *changes = NULL;
+static int nchanges = 0;
+static int changecap = 0;
+static int generation = 0;
+static time_t issued = 0;
+static double tokens = 0.0;
+static struct timespec refill;
+static unsigned int seed;
+
+static uint64_t served = 0;
+static uint64_t injected = 0;
+static uint64_t throttled = 0;
+static uint64_t sent = 0;
+
+static void usage(const char *);
+static int mock_add(int, int, const char *);
+static void mock_tree(int, int);
+static mock_node_t *mock_find(const char *);
+static uint32_t mock_hash(const char *, int);
+static void mock_stamp(char *, size_t, time_t);
+static void mock_fill(const mock_node_t *, int64_t, char *, size_t);
+static const char *mock_md5(mock_node_t *);
+static void mock_node_json(mock_buf_t *, mock_node_t *);
+static void buf_printf(mock_buf_t *, const char *, ...)
+        __attribute__((format(printf, 2, 3)));
+static int query_get(const char *, const char *, char *, size_t);
+static void url_decode(char *);
+static int read_request(int, char *, size_t *, mock_request_t *);
+static int send_all(int, const char *, size_t);
+static int send_paced(int, const char *, size_t);
+static int reply_head(int, const mock_request_t *, int, const char *,
+        const char *, size_t);
+static int reply(int, const mock_request_t *, int, const char *,
+        const char *, const char *, size_t);
+static int reply_error(int, const mock_request_t *, int, const char *,
+        const char *);
+static int serve(int, const mock_request_t *);
+static int serve_stats(int, const mock_request_t *);
+static int serve_media(int, const mock_request_t *, const mock_node_t *);
+static int admit(void);
+static void *connection_run(void *);
+static void *churn_run(void *);
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_in addr;
+    pthread_t thread;
+    int listener;
+    int one;
+    int fd;
+    int o;
+    int big;
+#define OPTS    "p:n:w:f:s:g:G:L:B:E:T:Q:e:c:avh"
+
+    memset(&conf, 0, sizeof(mock_conf_t));
+    conf.port = 8080;
+    conf.depth = 3;
+    conf.width = 4;
+    conf.files = 16;
+    conf.size = 64 * 1024;
+    conf.bigsize = 256 * 1024 * 1024;
+    conf.expiry = 3600;
+
+    for(;;) {
+        o = getopt(argc, argv, OPTS);
+        if(-1 == o) {
+            break;
+        }
+        switch(o) {
+        case 'p':
+            conf.port = (int)strtol(optarg, NULL, 10);
+            break;
+        case 'n':
+            conf.depth = (int)strtol(optarg, NULL, 10);
+            break;
+        case 'w':
+            conf.width = (int)strtol(optarg, NULL, 10);
+            break;
+        case 'f':
+            conf.files = (int)strtol(optarg, NULL, 10);
+            break;
+        case 's':
+            conf.size = (int64_t)strtoll(optarg, NULL, 10);
+            break;
+        case 'g':
+            conf.big = (int)strtol(optarg, NULL, 10);
+            break;
+        case 'G':
+            conf.bigsize = (int64_t)strtoll(optarg, NULL, 10) * 1024 * 1024;
+            break;
+        case 'L':
+            conf.latency = strtol(optarg, NULL, 10);
+            break;
+        case 'B':
+            conf.bandwidth = (size_t)strtoul(optarg, NULL, 10) * 1024;
+            break;
+        case 'E':
+            conf.errors = (int)strtol(optarg, NULL, 10);
+            break;
+        case 'T':
+            conf.throttle = (int)strtol(optarg, NULL, 10);
+            break;
+        case 'Q':
+            conf.qps = strtod(optarg, NULL);
+            break;
+        case 'e':
+            conf.expiry = (int)strtol(optarg, NULL, 10);
+            break;
+        case 'c':
+            conf.churn = (int)strtol(optarg, NULL, 10);
+            break;
+        case 'a':
+            conf.auth = 1;
+            break;
+        case 'v':
+            conf.verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+            exit('h' == o ? 0 : 1);
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    seed = (unsigned int)time(NULL);
+    tokens = conf.qps;
+    clock_gettime(CLOCK_MONOTONIC, &refill);
+
+    mock_add(-1, 1, "My Drive");
+    mock_tree(0, 0);
+    if(conf.big > 0) {
+        /* large files for sequential and random read workloads */
+        big = mock_add(0, 1, "big");
+        for(o = 0; (big > 0) && (o < conf.big); o++) {
+            char name[MOCK_NAME_MAX + 1];
+            int file;
+
+            memset(name, 0, (MOCK_NAME_MAX + 1) * sizeof(char));
+            snprintf(name, MOCK_NAME_MAX, "big-%02d.dat", o);
+            file = mock_add(big, 0, name);
+            if(file > 0) {
+                nodes[file].size = conf.bigsize;
+            }
+        }
+    }
+    nchanges = 0;
+    fprintf(stderr, "drivemock: %d nodes\n", nnodes);
+
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    if(listener < 0) {
+        perror("socket");
+        return 1;
+    }
+    one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int));
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)conf.port);
+    if((bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0) ||
+            (listen(listener, 64) != 0)) {
+        perror("bind");
+        return 1;
+    }
+    fprintf(stderr, "drivemock: listening on http://127.0.0.1:%d"
+            MOCK_API "\n", conf.port);
+
+    if(conf.churn > 0) {
+        pthread_create(&thread, NULL, churn_run, NULL);
+        pthread_detach(thread);
+    }
+
+    for(;;) {
+        fd = accept(listener, NULL, NULL);
+        if(fd < 0) {
+            if(EINTR == errno) {
+                continue;
+            }
+            perror("accept");
+            break;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(int));
+        if(pthread_create(&thread, NULL, connection_run,
+                    (void *)(intptr_t)fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    close(listener);
+    return 0;
+}
+
+static void usage(const char *argv0)
+{
+    printf("usage: %s "
+        "[-p <PORT>] "
+        "[-n <DEPTH>] [-w <WIDTH>] [-f <FILES>] [-s <BYTES>] "
+        "[-g <COUNT>] [-G <MBYTES>] "
+        "[-L <MS>] [-B <KBPS>] [-E <PCT>] [-T <PCT>] [-Q <QPS>] "
+        "[-e <SECONDS>] [-c <SECONDS>] [-a] [-v] | -h\n"
+        "\n"
+        "PORT is the loopback port to listen on, 8080 by default\n"
+        "DEPTH, WIDTH and FILES shape the synthetic tree: WIDTH folders\n"
+        "  and FILES files per folder, DEPTH levels below the root\n"
+        "BYTES is the average file size\n"
+        "COUNT files of MBYTES (256 by default) go in a root folder \"big\"\n"
+        "MS is added to every response\n"
+        "KBPS caps the bandwidth of each connection, 0 for no cap\n"
+        "PCT of requests fail with 500 (-E) or 429 (-T)\n"
+        "QPS is the request rate above which requests get 403\n"
+        "  userRateLimitExceeded, 0 for no limit\n"
+        "SECONDS is the access token lifetime (-e), or the interval at\n"
+        "  which a random file is modified (-c, 0 for a static tree)\n"
+        "-a rejects requests without a current access token with 401\n"
+        "-v logs every request to stderr\n"
+        "\n", argv0);
+}
+
+static int mock_add(int parent, int isdir, const char *name)
+{
+    mock_node_t *node;
+    mock_node_t *grown;
+    time_t now;
+
+    if(nnodes >= MOCK_NODES_MAX) {
+        return -1;
+    }
+    if(0 == (nnodes & (nnodes - 1))) {
+        grown = realloc(nodes, (nnodes ? 2 * nnodes : 1) *
+                sizeof(mock_node_t));
+        if(NULL == grown) {
+            return -1;
+        }
+        nodes = grown;
+    }
+    node = &nodes[nnodes];
+    memset(node, 0, sizeof(mock_node_t));
+    if(0 == nnodes) {
+        strcpy(node->id, "root");
+    } else {
+        snprintf(node->id, MOCK_ID_MAX, "mock%08d", nnodes);
+    }
+    strncpy(node->name, name, MOCK_NAME_MAX);
+    node->parent = parent;
+    node->isdir = isdir;
+    node->version = 1;
+    if(!isdir && (conf.size > 0)) {
+        /* spread sizes over [size/2, 3*size/2] */
+        node->size = conf.size / 2 +
+                (int64_t)(mock_hash(node->id, 0) % (uint64_t)(conf.size + 1));
+    }
+    time(&now);
+    node->ctime = now - 86400 - (time_t)(mock_hash(node->id, 1) % 86400);
+    node->mtime = node->ctime;
+    return nnodes++;
+}
+
+static void mock_tree(int dir, int level)
+{
+    char name[MOCK_NAME_MAX + 1];
+    int child;
+    int i;
+
+    for(i = 0; i < conf.files; i++) {
+        memset(name, 0, (MOCK_NAME_MAX + 1) * sizeof(char));
+        snprintf(name, MOCK_NAME_MAX, "file-%d-%04d.dat", level, i);
+        mock_add(dir, 0, name);
+    }
+    if(level >= conf.depth) {
+        return;
+    }
+    for(i = 0; i < conf.width; i++) {
+        memset(name, 0, (MOCK_NAME_MAX + 1) * sizeof(char));
+        snprintf(name, MOCK_NAME_MAX, "dir-%d-%02d", level, i);
+        child = mock_add(dir, 1, name);
+        if(child < 0) {
+            return;
+        }
+        mock_tree(child, level + 1);
+    }
+}
+
+static mock_node_t *mock_find(const char *id)
+{
+    int i;
+
+    if(0 == strcmp(id, "root")) {
+        return &nodes[0];
+    }
+    if((1 == sscanf(id, "mock%d", &i)) && (i > 0) && (i < nnodes)) {
+        return &nodes[i];
+    }
+    return NULL;
+}
+
+static uint32_t mock_hash(const char *s, int salt)
+{
+    uint32_t h;
+
+    /* fnv-1a */
+    h = 2166136261u ^ (uint32_t)salt;
+    while(*s) {
+        h ^= (uint8_t)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void mock_stamp(char *buf, size_t len, time_t t)
+{
+    struct tm tm;
+
+    gmtime_r(&t, &tm);
+    strftime(buf, len, "%Y-%m-%dT%H:%M:%S.000Z", &tm);
+}
+
+static void mock_fill(const mock_node_t *node, int64_t from, char *data,
+        size_t n)
+{
+    uint32_t base;
+    size_t i;
+
+    /* stateless in the offset, so any range reads the same bytes */
+    base = mock_hash(node->id, node->version);
+    for(i = 0; i < n; i++) {
+        data[i] = (char)(((uint32_t)(from + (int64_t)i) * 2654435761u + base)
+                >> 24);
+    }
+}
+
+static const char *mock_md5(mock_node_t *node)
+{
+    char data[MOCK_CHUNK];
+    md5_t ctx;
+    int64_t off;
+    size_t n;
+
+    /* called with mock_mutex held */
+    if(node->md5version != node->version) {
+        md5_init(&ctx);
+        for(off = 0; off < node->size; off += (int64_t)n) {
+            n = (node->size - off < MOCK_CHUNK) ? (size_t)(node->size - off) :
+                    MOCK_CHUNK;
+            mock_fill(node, off, data, n);
+            md5_update(&ctx, data, n);
+        }
+        md5_hex(&ctx, node->md5);
+        node->md5version = node->version;
+    }
+    return node->md5;
+}
+
+static void mock_node_json(mock_buf_t *buf, mock_node_t *node)
+{
+    char ctime[MOCK_TIME_MAX + 1];
+    char mtime[MOCK_TIME_MAX + 1];
+
+    memset(ctime, 0, (MOCK_TIME_MAX + 1) * sizeof(char));
+    memset(mtime, 0, (MOCK_TIME_MAX + 1) * sizeof(char));
+    mock_stamp(ctime, MOCK_TIME_MAX, node->ctime);
+    mock_stamp(mtime, MOCK_TIME_MAX, node->mtime);
+    buf_printf(buf, "{\"kind\":\"drive#file\",\"id\":\"%s\",\"name\":\"%s\","
+            "\"mimeType\":\"%s\",\"createdTime\":\"%s\","
+            "\"modifiedTime\":\"%s\",\"trashed\":false",
+            node->id, node->name,
+            node->isdir ? MOCK_FOLDER : "application/octet-stream",
+            ctime, mtime);
+    if(!node->isdir) {
+        buf_printf(buf, ",\"size\":\"%lld\",\"md5Checksum\":\"%s\","
+                "\"headRevisionId\":\"%s-r%d\"", (long long)node->size,
+                mock_md5(node), node->id, node->version);
+    }
+    if(node->parent >= 0) {
+        buf_printf(buf, ",\"parents\":[\"%s\"]", nodes[node->parent].id);
+    }
+    buf_printf(buf, "}");
+}
+
+static void buf_printf(mock_buf_t *buf, const char *fmt, ...)
+{
+    va_list ap;
+    char *grown;
+    size_t cap;
+    int n;
+
+    for(;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(buf->data ? buf->data + buf->len : NULL,
+                buf->cap - buf->len, fmt, ap);
+        va_end(ap);
+        if((n < 0) || ((size_t)n < buf->cap - buf->len)) {
+            break;
+        }
+        cap = buf->cap ? 2 * buf->cap : 4096;
+        while(cap - buf->len <= (size_t)n) {
+            cap *= 2;
+        }
+        grown = realloc(buf->data, cap);
+        if(NULL == grown) {
+            return;
+        }
+        buf->data = grown;
+        buf->cap = cap;
+    }
+    if(n > 0) {
+        buf->len += (size_t)n;
+    }
+}
+
+static int query_get(const char *query, const char *key, char *val,
+        size_t len)
+{
+    const char *p;
+    size_t klen;
+    size_t n;
+
+    klen = strlen(key);
+    for(p = query; p && *p; p = strchr(p, '&'), p = p ? p + 1 : NULL) {
+        if((0 == strncmp(p, key, klen)) && ('=' == p[klen])) {
+            p += klen + 1;
+            n = strcspn(p, "&");
+            if(n > len) {
+                n = len;
+            }
+            memset(val, 0, (len + 1) * sizeof(char));
+            memcpy(val, p, n);
+            url_decode(val);
+            return 0;
+        }
+    }
+    return -ENOENT;
+}
+
+static void url_decode(char *s)
+{
+    char *d;
+    unsigned int c;
+
+    for(d = s; *s; s++, d++) {
+        if(('%' == *s) && s[1] && s[2] && (1 == sscanf(s + 1, "%2x", &c))) {
+            *d = (char)c;
+            s += 2;
+        } else if('+' == *s) {
+            *d = ' ';
+        } else {
+            *d = *s;
+        }
+    }
+    *d = 0;
+}
+
+static int read_request(int fd, char *buf, size_t *have, mock_request_t *req)
+{
+    char *end;
+    char *line;
+    char *next;
+    char target[MOCK_PATH_MAX + 1];
+    char *q;
+    size_t head;
+    size_t body;
+    ssize_t n;
+
+    /* one request per call, pipelined leftovers stay in buf */
+    for(;;) {
+        buf[*have] = 0;
+        end = strstr(buf, "\r\n\r\n");
+        if(end) {
+            break;
+        }
+        if(*have >= MOCK_REQ_MAX) {
+            return -E2BIG;
+        }
+        n = read(fd, buf + *have, MOCK_REQ_MAX - *have);
+        if(n <= 0) {
+            return -EPIPE;
+        }
+        *have += (size_t)n;
+    }
+    head = (size_t)(end - buf) + 4;
+    *end = 0;
+
+    memset(req, 0, sizeof(mock_request_t));
+    memset(target, 0, (MOCK_PATH_MAX + 1) * sizeof(char));
+    if(sscanf(buf, "%15s %2047s", req->method, target) != 2) {
+        return -EINVAL;
+    }
+    q = strchr(target, '?');
+    if(q) {
+        *q++ = 0;
+        strncpy(req->query, q, MOCK_PATH_MAX);
+    }
+    memcpy(req->path, target, MOCK_PATH_MAX);
+
+    for(line = strstr(buf, "\r\n"); line; line = next) {
+        line += 2;
+        next = strstr(line, "\r\n");
+        if(next) {
+            *next = 0;
+        }
+        if(0 == strncasecmp(line, "Authorization: Bearer ", 22)) {
+            strncpy(req->token, line + 22, MOCK_TOKEN_MAX);
+        } else if(0 == strncasecmp(line, "Range: bytes=", 13)) {
+            req->from = 0;
+            req->to = -1;
+            if(sscanf(line + 13, "%lld-%lld", (long long *)&req->from,
+                        (long long *)&req->to) >= 1) {
+                req->ranged = 1;
+            }
+        } else if(0 == strncasecmp(line, "Content-Length: ", 16)) {
+            req->length = (size_t)strtoul(line + 16, NULL, 10);
+        } else if(0 == strncasecmp(line, "Connection: close", 17)) {
+            req->close = 1;
+        }
+    }
+
+    /* bodies (the token form) are not needed, just skipped */
+    body = req->length;
+    if(head + body > *have) {
+        body -= *have - head;
+        *have = head;
+        while(body > 0) {
+            n = read(fd, target, body < MOCK_PATH_MAX ? body : MOCK_PATH_MAX);
+            if(n <= 0) {
+                return -EPIPE;
+            }
+            body -= (size_t)n;
+        }
+        body = 0;
+    }
+    head += body;
+    memmove(buf, buf + head, *have - head);
+    *have -= head;
+    return 0;
+}
+
+static int send_all(int fd, const char *data, size_t len)
+{
+    ssize_t n;
+
+    while(len > 0) {
+        n = write(fd, data, len);
+        if(n < 0) {
+            if(EINTR == errno) {
+                continue;
+            }
+            return -errno;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int send_paced(int fd, const char *data, size_t len)
+{
+    size_t n;
+    int rc;
+
+    /* per connection bandwidth cap, one chunk at a time */
+    while(len > 0) {
+        n = len < MOCK_CHUNK ? len : MOCK_CHUNK;
+        rc = send_all(fd, data, n);
+        if(rc != 0) {
+            return rc;
+        }
+        __atomic_add_fetch(&sent, n, __ATOMIC_RELAXED);
+        if(conf.bandwidth > 0) {
+            usleep((useconds_t)(n * 1000000 / conf.bandwidth));
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int reply_head(int fd, const mock_request_t *req, int status,
+        const char *reason, const char *extra, size_t len)
+{
+    char head[MOCK_PATH_MAX + 1];
+
+    memset(head, 0, (MOCK_PATH_MAX + 1) * sizeof(char));
+    snprintf(head, MOCK_PATH_MAX, "HTTP/1.1 %d %s\r\n"
+            "Content-Length: %zu\r\n"
+            "%s"
+            "%s"
+            "\r\n", status, reason, len,
+            req->close ? "Connection: close\r\n" : "",
+            extra ? extra : "");
+    if(conf.verbose) {
+        fprintf(stderr, "%s %s%s%s %d %zu\n", req->method, req->path,
+                req->query[0] ? "?" : "", req->query, status, len);
+    }
+    return send_all(fd, head, strlen(head));
+}
+
+static int reply(int fd, const mock_request_t *req, int status,
+        const char *reason, const char *extra, const char *body, size_t len)
+{
+    int rc;
+
+    rc = reply_head(fd, req, status, reason, extra, len);
+    if((0 == rc) && (len > 0) && strcmp(req->method, "HEAD")) {
+        rc = send_paced(fd, body, len);
+    }
+    return rc;
+}
+
+static int reply_error(int fd, const mock_request_t *req, int status,
+        const char *reason, const char *why)
+{
+    mock_buf_t buf;
+    int rc;
+
+    memset(&buf, 0, sizeof(mock_buf_t));
+    buf_printf(&buf, "{\"error\":{\"errors\":[{\"domain\":\"usageLimits\","
+            "\"reason\":\"%s\",\"message\":\"%s\"}],\"code\":%d,"
+            "\"message\":\"%s\"}}", why, reason, status, reason);
+    rc = reply(fd, req, status, reason,
+            "Content-Type: application/json\r\n"
+            "Retry-After: 1\r\n", buf.data, buf.len);
+    free(buf.data);
+    return rc;
+}
+
+static int admit(void)
+{
+    struct timespec now;
+    double elapsed;
+    int ok;
+
+    if(conf.qps <= 0.0) {
+        return 1;
+    }
+    pthread_mutex_lock(&mock_mutex);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (double)(now.tv_sec - refill.tv_sec) +
+            (double)(now.tv_nsec - refill.tv_nsec) / 1e9;
+    refill = now;
+    tokens += elapsed * conf.qps;
+    if(tokens > conf.qps) {
+        tokens = conf.qps;
+    }
+    ok = (tokens >= 1.0);
+    if(ok) {
+        tokens -= 1.0;
+    }
+    pthread_mutex_unlock(&mock_mutex);
+    return ok;
+}
+
+static int serve(int fd, const mock_request_t *req)
+{
+    char val[MOCK_PATH_MAX + 1];
+    char id[MOCK_ID_MAX + 1];
+    char token[MOCK_TOKEN_MAX + 1];
+    mock_node_t *node;
+    mock_node_t copy;
+    mock_buf_t buf;
+    const char *path;
+    time_t now;
+    int dice;
+    int from;
+    int page;
+    int i;
+    int rc;
+
+    if(0 == strcmp(req->path, "/mock/stats")) {
+        return serve_stats(fd, req);
+    }
+    if(conf.latency > 0) {
+        usleep((useconds_t)conf.latency * 1000);
+    }
+
+    pthread_mutex_lock(&mock_mutex);
+    served++;
+    dice = (int)(rand_r(&seed) % 100);
+    pthread_mutex_unlock(&mock_mutex);
+    if(dice < conf.errors) {
+        __atomic_add_fetch(&injected, 1, __ATOMIC_RELAXED);
+        return reply_error(fd, req, 500, "Internal Error", "backendError");
+    }
+    if(dice < conf.errors + conf.throttle) {
+        __atomic_add_fetch(&throttled, 1, __ATOMIC_RELAXED);
+        return reply_error(fd, req, 429, "Too Many Requests",
+                "rateLimitExceeded");
+    }
+    if(!admit()) {
+        __atomic_add_fetch(&throttled, 1, __ATOMIC_RELAXED);
+        return reply_error(fd, req, 403, "User Rate Limit Exceeded",
+                "userRateLimitExceeded");
+    }
+
+    memset(&buf, 0, sizeof(mock_buf_t));
+    time(&now);
+
+    if(0 == strcmp(req->path, MOCK_OAUTH "/token")) {
+        pthread_mutex_lock(&mock_mutex);
+        generation++;
+        issued = now;
+        buf_printf(&buf, "{\"access_token\":\"mock-%d\","
+                "\"token_type\":\"Bearer\",\"expires_in\":%d,"
+                "\"refresh_token\":\"mock-refresh\"}", generation,
+                conf.expiry);
+        pthread_mutex_unlock(&mock_mutex);
+        rc = reply(fd, req, 200, "OK", "Content-Type: application/json\r\n",
+                buf.data, buf.len);
+        free(buf.data);
+        return rc;
+    }
+
+    if(conf.auth) {
+        /* only the latest token is valid, and only until it expires */
+        memset(token, 0, (MOCK_TOKEN_MAX + 1) * sizeof(char));
+        pthread_mutex_lock(&mock_mutex);
+        snprintf(token, MOCK_TOKEN_MAX, "mock-%d", generation);
+        i = (0 == generation) || (now >= issued + conf.expiry);
+        pthread_mutex_unlock(&mock_mutex);
+        if(i || strcmp(req->token, token)) {
+            return reply_error(fd, req, 401, "Invalid Credentials",
+                    "authError");
+        }
+    }
+
+    if(strncmp(req->path, MOCK_API "/", strlen(MOCK_API) + 1)) {
+        return reply_error(fd, req, 404, "Not Found", "notFound");
+    }
+    path = req->path + strlen(MOCK_API);
+
+    if(0 == strcmp(path, "/changes/startPageToken")) {
+        pthread_mutex_lock(&mock_mutex);
+        buf_printf(&buf, "{\"kind\":\"drive#startPageToken\","
+                "\"startPageToken\":\"%d\"}", nchanges + 1);
+        pthread_mutex_unlock(&mock_mutex);
+    } else if(0 == strcmp(path, "/changes")) {
+        from = 1;
+        page = MOCK_PAGE;
+        if(0 == query_get(req->query, "pageToken", val, MOCK_PATH_MAX)) {
+            from = (int)strtol(val, NULL, 10);
+        }
+        if(0 == query_get(req->query, "pageSize", val, MOCK_PATH_MAX)) {
+            page = (int)strtol(val, NULL, 10);
+        }
+        if(from < 1) {
+            from = 1;
+        }
+        if(page < 1) {
+            page = MOCK_PAGE;
+        }
+        pthread_mutex_lock(&mock_mutex);
+        buf_printf(&buf, "{\"kind\":\"drive#changeList\",\"changes\":[");
+        for(i = from - 1; (i < nchanges) && (i < from - 1 + page); i++) {
+            node = &nodes[changes[i]];
+            buf_printf(&buf, "%s{\"kind\":\"drive#change\","
+                    "\"fileId\":\"%s\",\"removed\":false,\"file\":",
+                    (i > from - 1) ? "," : "", node->id);
+            mock_node_json(&buf, node);
+            buf_printf(&buf, "}");
+        }
+        if(i < nchanges) {
+            buf_printf(&buf, "],\"nextPageToken\":\"%d\"}", i + 1);
+        } else {
+            buf_printf(&buf, "],\"newStartPageToken\":\"%d\"}",
+                    nchanges + 1);
+        }
+        pthread_mutex_unlock(&mock_mutex);
+    } else if(0 == strcmp(path, "/files")) {
+        /* only the "'<id>' in parents" form of q is understood */
+        memset(id, 0, (MOCK_ID_MAX + 1) * sizeof(char));
+        if((query_get(req->query, "q", val, MOCK_PATH_MAX) != 0) ||
+                (sscanf(val, "'%31[^']' in parents", id) != 1)) {
+            return reply_error(fd, req, 400, "Invalid Value", "invalid");
+        }
+        pthread_mutex_lock(&mock_mutex);
+        node = mock_find(id);
+        buf_printf(&buf, "{\"kind\":\"drive#fileList\","
+                "\"incompleteSearch\":false,\"files\":[");
+        for(i = 1, from = 0; node && (i < nnodes); i++) {
+            if(&nodes[nodes[i].parent] == node) {
+                buf_printf(&buf, "%s", from++ ? "," : "");
+                mock_node_json(&buf, &nodes[i]);
+            }
+        }
+        buf_printf(&buf, "]}");
+        pthread_mutex_unlock(&mock_mutex);
+    } else if(0 == strncmp(path, "/files/", 7)) {
+        pthread_mutex_lock(&mock_mutex);
+        node = mock_find(path + 7);
+        if(node) {
+            memcpy(&copy, node, sizeof(mock_node_t));
+            if(0 == query_get(req->query, "alt", val, MOCK_PATH_MAX) &&
+                    (0 == strcmp(val, "media"))) {
+                pthread_mutex_unlock(&mock_mutex);
+                return serve_media(fd, req, &copy);
+            }
+            mock_node_json(&buf, node);
+        }
+        pthread_mutex_unlock(&mock_mutex);
+        if(NULL == node) {
+            return reply_error(fd, req, 404, "File not found", "notFound");
+        }
+    } else {
+        return reply_error(fd, req, 404, "Not Found", "notFound");
+    }
+
+    rc = reply(fd, req, 200, "OK", "Content-Type: application/json\r\n",
+            buf.data, buf.len);
+    free(buf.data);
+    return rc;
+}
+
+static int serve_stats(int fd, const mock_request_t *req)
+{
+    mock_buf_t buf;
+    int rc;
+
+    /* counters for benchmark harnesses, not part of drive */
+    memset(&buf, 0, sizeof(mock_buf_t));
+    pthread_mutex_lock(&mock_mutex);
+    buf_printf(&buf, "{\"requests\":%llu,\"failed\":%llu,"
+            "\"throttled\":%llu,\"bytes\":%llu,\"changes\":%d}\n",
+            (unsigned long long)served,
+            (unsigned long long)__atomic_load_n(&injected, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&throttled, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&sent, __ATOMIC_RELAXED),
+            nchanges);
+    pthread_mutex_unlock(&mock_mutex);
+    rc = reply(fd, req, 200, "OK", "Content-Type: application/json\r\n",
+            buf.data, buf.len);
+    free(buf.data);
+    return rc;
+}
+
+static int serve_media(int fd, const mock_request_t *req,
+        const mock_node_t *node)
+{
+    char extra[MOCK_PATH_MAX + 1];
+    char *data;
+    int64_t from;
+    int64_t to;
+    size_t n;
+    int rc;
+
+    if(node->isdir) {
+        return reply_error(fd, req, 403, "Only files with binary content "
+                "can be downloaded", "fileNotDownloadable");
+    }
+
+    from = 0;
+    to = node->size - 1;
+    if(req->ranged) {
+        from = req->from;
+        if((req->to >= 0) && (req->to < to)) {
+            to = req->to;
+        }
+        if(from > to) {
+            memset(extra, 0, (MOCK_PATH_MAX + 1) * sizeof(char));
+            snprintf(extra, MOCK_PATH_MAX, "Content-Range: bytes */%lld\r\n",
+                    (long long)node->size);
+            return reply(fd, req, 416, "Requested Range Not Satisfiable",
+                    extra, NULL, 0);
+        }
+    }
+
+    memset(extra, 0, (MOCK_PATH_MAX + 1) * sizeof(char));
+    if(req->ranged) {
+        snprintf(extra, MOCK_PATH_MAX, "Content-Type: "
+                "application/octet-stream\r\n"
+                "Content-Range: bytes %lld-%lld/%lld\r\n",
+                (long long)from, (long long)to, (long long)node->size);
+        rc = reply_head(fd, req, 206, "Partial Content", extra,
+                (size_t)(to - from + 1));
+    } else {
+        snprintf(extra, MOCK_PATH_MAX, "Content-Type: "
+                "application/octet-stream\r\n"
+                "Accept-Ranges: bytes\r\n");
+        rc = reply_head(fd, req, 200, "OK", extra, (size_t)(to - from + 1));
+    }
+    if((rc != 0) || (0 == strcmp(req->method, "HEAD"))) {
+        return rc;
+    }
+
+    /* generated a chunk at a time */
+    data = malloc(MOCK_CHUNK);
+    if(NULL == data) {
+        return -ENOMEM;
+    }
+    while((0 == rc) && (from <= to)) {
+        n = (to - from + 1 < MOCK_CHUNK) ? (size_t)(to - from + 1) :
+                MOCK_CHUNK;
+        mock_fill(node, from, data, n);
+        rc = send_paced(fd, data, n);
+        from += (int64_t)n;
+    }
+    free(data);
+    return rc;
+}
+
+static void *connection_run(void *opaque)
+{
+    char *buf;
+    mock_request_t req;
+    size_t have;
+    int fd;
+
+    fd = (int)(intptr_t)opaque;
+    buf = malloc(MOCK_REQ_MAX + 1);
+    if(buf) {
+        have = 0;
+        while(0 == read_request(fd, buf, &have, &req)) {
+            if((serve(fd, &req) != 0) || req.close) {
+                break;
+            }
+        }
+        free(buf);
+    }
+    close(fd);
+    return NULL;
+}
+
+static void *churn_run(void *opaque)
+{
+    mock_node_t *node;
+    int *grown;
+    int i;
+
+    (void)opaque;
+
+    /* every interval a random file gets new content, showing up in the
+     * change log */
+    for(;;) {
+        sleep((unsigned int)conf.churn);
+        pthread_mutex_lock(&mock_mutex);
+        for(i = 0; i < 16; i++) {
+            node = &nodes[rand_r(&seed) % (unsigned int)nnodes];
+            if(!node->isdir) {
+                break;
+            }
+        }
+        if(node->isdir) {
+            pthread_mutex_unlock(&mock_mutex);
+            continue;
+        }
+        if(nchanges >= changecap) {
+            grown = realloc(changes, (changecap ? 2 * changecap : 256) *
+                    sizeof(int));
+            if(NULL == grown) {
+                pthread_mutex_unlock(&mock_mutex);
+                continue;
+            }
+            changes = grown;
+            changecap = changecap ? 2 * changecap : 256;
+        }
+        node->version++;
+        time(&node->mtime);
+        if(conf.size > 0) {
+            node->size = conf.size / 2 + (int64_t)(mock_hash(node->id,
+                        node->version) % (uint64_t)(conf.size + 1));
+        }
+        changes[nchanges++] = (int)(node - nodes);
+        if(conf.verbose) {
+            fprintf(stderr, "changed %s to version %d (%llu served, %llu "
+                    "failed, %llu throttled)\n", node->id, node->version,
+                    (unsigned long long)served,
+                    (unsigned long long)injected,
+                    (unsigned long long)throttled);
+        }
+        pthread_mutex_unlock(&mock_mutex);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,495 @@
+This file is part of drive-fuse-sync.
+
+drive-fuse-sync is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+drive-fuse-sync is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with drive-fuse-sync.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* load generator for a mounted tree: runs one scripted workload with a
+ * number of threads for a fixed time and prints ops/s, latency percentiles
+ * and bytes read on a single line
+ *
+ *   find   walk the whole tree, an op is one stat (single thread)
+ *   stat   lstat of random entries
+ *   ls     ls -l of the largest directory, an op is one whole listing
+ *   small  read whole random files below the small size
+ *   seq    sequential 1 MiB reads of the large files, one per thread
+ *   rand   4 KiB preads at random offsets of the large files
+ *   mix    build-like: stats (a fifth of them misses), small reads,
+ *          listings and open/close probes */
+
+#define LOAD_SMALL      (1024 * 1024)
+#define LOAD_SEQ_BLOCK  (1024 * 1024)
+#define LOAD_RAND_BLOCK 4096
+#define LOAD_SAMPLES    (1 << 20)
+
+struct _load_list
+{
+    char **path;
+    int64_t *size;
+    int n;
+    int cap;
+};
+typedef struct _load_list load_list_t;
+
+struct _load_thread
+{
+    pthread_t thread;
+    int index;
+    unsigned int seed;
+    int64_t *lat;
+    int64_t nlat;
+    int64_t ops;
+    int64_t bytes;
+    int64_t errors;
+    char *buf;
+};
+typedef struct _load_thread load_thread_t;
+
+static const char *workload = "stat";
+static const char *root = NULL;
+static int nthreads = 4;
+static int duration = 10;
+static int64_t deadline;
+
+static load_list_t all;
+static load_list_t dirs;
+static load_list_t small;
+static load_list_t large;
+static const char *biggest = NULL;
+
+static int64_t now_ns(void);
+static int list_add(load_list_t *, const char *, int64_t);
+static int scan(const char *, const struct stat *, int, struct FTW *);
+static int64_t timed_find(load_thread_t *);
+static void record(load_thread_t *, int64_t);
+static int do_stat(load_thread_t *, const char *);
+static int do_ls(load_thread_t *, const char *);
+static int do_read(load_thread_t *, const char *);
+static int do_probe(load_thread_t *, const char *);
+static void *load_run(void *);
+static int cmp_lat(const void *, const void *);
+
+int main(int argc, char *argv[])
+{
+    load_thread_t *threads;
+    int64_t *lat;
+    int64_t nlat;
+    int64_t ops;
+    int64_t bytes;
+    int64_t errors;
+    int64_t start;
+    int64_t elapsed;
+    int o;
+    int i;
+    int j;
+
+    for(;;) {
+        o = getopt(argc, argv, "w:t:d:h");
+        if(-1 == o) {
+            break;
+        }
+        switch(o) {
+        case 'w':
+            workload = optarg;
+            break;
+        case 't':
+            nthreads = (int)strtol(optarg, NULL, 10);
+            break;
+        case 'd':
+            duration = (int)strtol(optarg, NULL, 10);
+            break;
+        default:
+            printf("usage: %s [-w find|stat|ls|small|seq|rand|mix] "
+                    "[-t <THREADS>] [-d <SECONDS>] <ROOT>\n", argv[0]);
+            exit('h' == o ? 0 : 1);
+        }
+    }
+    if((optind >= argc) || (nthreads < 1)) {
+        fprintf(stderr, "no root given\n");
+        exit(1);
+    }
+    root = argv[optind];
+    if(0 == strcmp(workload, "find")) {
+        nthreads = 1;
+    }
+
+    /* the inventory walk also warms the metadata cache, so only the
+     * find workload sees cold metadata */
+    if(strcmp(workload, "find")) {
+        if(nftw(root, scan, 64, FTW_PHYS) != 0) {
+            perror(root);
+            exit(1);
+        }
+    }
+
+    threads = malloc(nthreads * sizeof(load_thread_t));
+    if(NULL == threads) {
+        exit(1);
+    }
+    memset(threads, 0, nthreads * sizeof(load_thread_t));
+    start = now_ns();
+    deadline = start + (int64_t)duration * 1000000000LL;
+    for(i = 0; i < nthreads; i++) {
+        threads[i].index = i;
+        threads[i].seed = (unsigned int)(i + 1) * 2654435761u;
+        threads[i].lat = malloc(LOAD_SAMPLES * sizeof(int64_t));
+        threads[i].buf = malloc(LOAD_SEQ_BLOCK);
+        if((NULL == threads[i].lat) || (NULL == threads[i].buf)) {
+            exit(1);
+        }
+        pthread_create(&threads[i].thread, NULL, load_run, &threads[i]);
+    }
+
+    nlat = 0;
+    ops = 0;
+    bytes = 0;
+    errors = 0;
+    for(i = 0; i < nthreads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        nlat += threads[i].nlat;
+        ops += threads[i].ops;
+        bytes += threads[i].bytes;
+        errors += threads[i].errors;
+    }
+    elapsed = now_ns() - start;
+
+    lat = malloc((nlat + 1) * sizeof(int64_t));
+    if(NULL == lat) {
+        exit(1);
+    }
+    for(i = 0, nlat = 0; i < nthreads; i++) {
+        for(j = 0; j < threads[i].nlat; j++) {
+            lat[nlat++] = threads[i].lat[j];
+        }
+        free(threads[i].lat);
+        free(threads[i].buf);
+    }
+    qsort(lat, nlat, sizeof(int64_t), cmp_lat);
+
+    printf("%-6s %3d %10lld %12.1f %10.1f %10.1f %10.1f %12lld %9.1f %6lld\n",
+            workload, nthreads, (long long)ops,
+            (double)ops * 1e9 / (double)elapsed,
+            nlat ? (double)lat[nlat / 2] / 1e3 : 0.0,
+            nlat ? (double)lat[(nlat * 99) / 100] / 1e3 : 0.0,
+            nlat ? (double)lat[nlat - 1] / 1e3 : 0.0,
+            (long long)bytes,
+            (double)bytes / (double)elapsed * 1e9 / (1024.0 * 1024.0),
+            (long long)errors);
+
+    free(lat);
+    free(threads);
+    return 0;
+}
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int list_add(load_list_t *list, const char *path, int64_t size)
+{
+    char **grown;
+    int64_t *sizes;
+
+    if(list->n >= list->cap) {
+        list->cap = list->cap ? 2 * list->cap : 1024;
+        grown = realloc(list->path, list->cap * sizeof(char *));
+        sizes = realloc(list->size, list->cap * sizeof(int64_t));
+        if((NULL == grown) || (NULL == sizes)) {
+            return -ENOMEM;
+        }
+        list->path = grown;
+        list->size = sizes;
+    }
+    list->path[list->n] = strdup(path);
+    list->size[list->n] = size;
+    list->n++;
+    return 0;
+}
+
+static int scan(const char *path, const struct stat *st, int flag,
+        struct FTW *ftw)
+{
+    static int most = -1;
+    int n;
+    DIR *dir;
+
+    (void)ftw;
+    list_add(&all, path, st->st_size);
+    if(FTW_D == flag) {
+        list_add(&dirs, path, 0);
+        /* st_nlink is not kept up by the daemon, count instead */
+        n = 0;
+        dir = opendir(path);
+        if(dir) {
+            while(readdir(dir)) {
+                n++;
+            }
+            closedir(dir);
+        }
+        if(n > most) {
+            most = n;
+            biggest = dirs.path[dirs.n - 1];
+        }
+    } else if(FTW_F == flag) {
+        if(st->st_size < LOAD_SMALL) {
+            list_add(&small, path, st->st_size);
+        } else {
+            list_add(&large, path, st->st_size);
+        }
+    }
+    return 0;
+}
+
+static load_thread_t *find_thread;
+static int64_t find_last;
+
+static int find_one(const char *path, const struct stat *st, int flag,
+        struct FTW *ftw)
+{
+    int64_t t;
+
+    (void)path;
+    (void)st;
+    (void)ftw;
+    /* an op is whatever it took to get from one entry to the next */
+    t = now_ns();
+    record(find_thread, t - find_last);
+    find_last = t;
+    if((FTW_NS == flag) || (FTW_DNR == flag)) {
+        find_thread->errors++;
+    }
+    return (t < deadline) ? 0 : 1;
+}
+
+static int64_t timed_find(load_thread_t *self)
+{
+    /* repeated walks, the first one sees cold metadata */
+    find_thread = self;
+    while(now_ns() < deadline) {
+        find_last = now_ns();
+        if(nftw(root, find_one, 64, FTW_PHYS) < 0) {
+            self->errors++;
+            break;
+        }
+    }
+    return 0;
+}
+
+static void record(load_thread_t *self, int64_t ns)
+{
+    if(self->nlat < LOAD_SAMPLES) {
+        self->lat[self->nlat++] = ns;
+    }
+    self->ops++;
+}
+
+static int do_stat(load_thread_t *self, const char *path)
+{
+    struct stat st;
+
+    (void)self;
+    return lstat(path, &st);
+}
+
+static int do_ls(load_thread_t *self, const char *path)
+{
+    char entry[PATH_MAX + 1];
+    struct dirent *de;
+    struct stat st;
+    DIR *dir;
+
+    (void)self;
+    dir = opendir(path);
+    if(NULL == dir) {
+        return -1;
+    }
+    while((de = readdir(dir))) {
+        memset(entry, 0, (PATH_MAX + 1) * sizeof(char));
+        snprintf(entry, PATH_MAX, "%s/%s", path, de->d_name);
+        lstat(entry, &st);
+    }
+    closedir(dir);
+    return 0;
+}
+
+static int do_read(load_thread_t *self, const char *path)
+{
+    ssize_t n;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return -1;
+    }
+    while((n = read(fd, self->buf, LOAD_SEQ_BLOCK)) > 0) {
+        self->bytes += n;
+    }
+    close(fd);
+    return (n < 0) ? -1 : 0;
+}
+
+static int do_probe(load_thread_t *self, const char *path)
+{
+    int fd;
+
+    (void)self;
+    fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+static void *load_run(void *opaque)
+{
+    char miss[PATH_MAX + 1];
+    load_thread_t *self;
+    const char *path;
+    int64_t off;
+    int64_t t;
+    ssize_t n;
+    int dice;
+    int fd;
+    int i;
+    int rc;
+
+    self = (load_thread_t *)opaque;
+
+    if(0 == strcmp(workload, "find")) {
+        timed_find(self);
+        return NULL;
+    }
+
+    if(0 == strcmp(workload, "seq")) {
+        /* each thread streams its own large file, wrapping around */
+        fd = -1;
+        i = self->index;
+        while((large.n > 0) && (now_ns() < deadline)) {
+            if(fd < 0) {
+                fd = open(large.path[i % large.n], O_RDONLY);
+                if(fd < 0) {
+                    self->errors++;
+                    break;
+                }
+                i += nthreads;
+            }
+            t = now_ns();
+            n = read(fd, self->buf, LOAD_SEQ_BLOCK);
+            record(self, now_ns() - t);
+            if(n <= 0) {
+                if(n < 0) {
+                    self->errors++;
+                }
+                close(fd);
+                fd = -1;
+                continue;
+            }
+            self->bytes += n;
+        }
+        if(fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    while(now_ns() < deadline) {
+        rc = 0;
+        t = now_ns();
+        if(0 == strcmp(workload, "stat")) {
+            rc = do_stat(self, all.path[rand_r(&self->seed) % all.n]);
+        } else if(0 == strcmp(workload, "ls")) {
+            rc = do_ls(self, biggest ? biggest : root);
+        } else if(0 == strcmp(workload, "small")) {
+            if(0 == small.n) {
+                break;
+            }
+            rc = do_read(self, small.path[rand_r(&self->seed) % small.n]);
+        } else if(0 == strcmp(workload, "rand")) {
+            if(0 == large.n) {
+                break;
+            }
+            i = rand_r(&self->seed) % large.n;
+            off = ((int64_t)rand_r(&self->seed) << 16 ^ rand_r(&self->seed)) %
+                    (large.size[i] / LOAD_RAND_BLOCK) * LOAD_RAND_BLOCK;
+            rc = -1;
+            fd = open(large.path[i], O_RDONLY);
+            if(fd >= 0) {
+                n = pread(fd, self->buf, LOAD_RAND_BLOCK, off);
+                if(n >= 0) {
+                    self->bytes += n;
+                    rc = 0;
+                }
+                close(fd);
+            }
+        } else if(0 == strcmp(workload, "mix")) {
+            dice = rand_r(&self->seed) % 100;
+            path = all.path[rand_r(&self->seed) % all.n];
+            if(dice < 48) {
+                rc = do_stat(self, path);
+            } else if(dice < 60) {
+                /* include path searches mostly miss */
+                memset(miss, 0, (PATH_MAX + 1) * sizeof(char));
+                snprintf(miss, PATH_MAX, "%s.h", path);
+                do_stat(self, miss);
+            } else if(dice < 85) {
+                if(small.n > 0) {
+                    rc = do_read(self,
+                            small.path[rand_r(&self->seed) % small.n]);
+                }
+            } else if(dice < 95) {
+                rc = do_ls(self, dirs.path[rand_r(&self->seed) % dirs.n]);
+            } else {
+                rc = do_probe(self, path);
+            }
+        } else {
+            fprintf(stderr, "unknown workload %s\n", workload);
+            break;
+        }
+        record(self, now_ns() - t);
+        if(rc != 0) {
+            self->errors++;
+        }
+    }
+
+    return NULL;
+}
+
+static int cmp_lat(const void *a, const void *b)
+{
+    int64_t x;
+    int64_t y;
+
+    x = *(const int64_t *)a;
+    y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
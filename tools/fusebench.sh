@@ -0,0 +1,107 @@
+#!/bin/sh
+#
+# end-to-end workload benchmark: serves a synthetic drive from drivemock,
+# mounts drivefusesync against it and runs each fsload workload in turn,
+# one result line per workload with the bytes and requests the backend
+# served meanwhile
+#
+# environment:
+#   WORKLOADS   find stat ls small seq rand mix
+#   THREADS     load threads per workload, 8
+#   DURATION    seconds per workload, 10
+#   PORT        drivemock port, 18080
+#   MOCKOPTS    drivemock tree shape and network knobs
+#   DAEMONOPTS  extra drivefusesync options
+#   KEEP        set to keep the scratch directory
+
+TOOLS=$(cd "$(dirname "$0")" && pwd)
+BUILD=${BUILD:-$(pwd)}
+DAEMON=${DAEMON:-$BUILD/../src/drivefusesync}
+MOCK=${MOCK:-$BUILD/drivemock}
+LOAD=${LOAD:-$BUILD/fsload}
+PORT=${PORT:-18080}
+THREADS=${THREADS:-8}
+DURATION=${DURATION:-10}
+WORKLOADS=${WORKLOADS:-"find stat ls small seq rand mix"}
+MOCKOPTS=${MOCKOPTS:-"-n 3 -w 6 -f 48 -s 16384 -g 4 -G 64 -L 20 -B 20480"}
+DAEMONOPTS=${DAEMONOPTS:-}
+
+for bin in "$DAEMON" "$MOCK" "$LOAD"; do
+    if [ ! -x "$bin" ]; then
+        echo "missing $bin, build with make check first" >&2
+        exit 1
+    fi
+done
+
+WORK=$(mktemp -d /tmp/fusebench.XXXXXX)
+MNT=$WORK/mnt
+URL=http://127.0.0.1:$PORT
+MOCKPID=
+DAEMONPID=
+
+cleanup()
+{
+    if mountpoint -q "$MNT" 2>/dev/null; then
+        fusermount -u "$MNT"
+    fi
+    [ -n "$DAEMONPID" ] && wait "$DAEMONPID" 2>/dev/null
+    [ -n "$MOCKPID" ] && kill "$MOCKPID" 2>/dev/null
+    if [ -z "$KEEP" ]; then
+        rm -rf "$WORK"
+    else
+        echo "# scratch kept in $WORK" >&2
+    fi
+}
+trap cleanup EXIT INT TERM
+
+counter()
+{
+    curl -s "$URL/mock/stats" | sed -n "s/.*\"$1\":\([0-9]*\).*/\1/p"
+}
+
+# shellcheck disable=SC2086
+"$MOCK" -p "$PORT" $MOCKOPTS 2>"$WORK/mock.log" &
+MOCKPID=$!
+sleep 1
+
+# setup reads an authorization code from stdin, the mock takes any
+mkdir -p "$MNT"
+# shellcheck disable=SC2086
+echo bench | "$DAEMON" -s -u bench -b "$WORK" -m "$MNT" \
+    -A "$URL/drive/v3" -O "$URL/oauth2" $DAEMONOPTS \
+    >"$WORK/daemon.log" 2>&1 &
+DAEMONPID=$!
+
+i=0
+while ! mountpoint -q "$MNT"; do
+    i=$((i + 1))
+    if [ $i -gt 60 ]; then
+        echo "mount did not come up, see $WORK/daemon.log" >&2
+        KEEP=1
+        exit 1
+    fi
+    sleep 1
+done
+
+# the initial crawl is done when the tree stops growing
+last=-1
+count=0
+while [ "$count" != "$last" ]; do
+    last=$count
+    sleep 2
+    count=$(find "$MNT" 2>/dev/null | wc -l)
+done
+echo "# $(git -C "$TOOLS/.." describe --always --dirty 2>/dev/null)" \
+    "$(date -u +%Y-%m-%dT%H:%M:%SZ) entries=$count threads=$THREADS" \
+    "duration=$DURATION mock=\"$MOCKOPTS\""
+printf "%-6s %3s %10s %12s %10s %10s %10s %12s %9s %6s %12s %8s\n" \
+    workload thr ops ops/s "p50(us)" "p99(us)" "max(us)" bytes "MB/s" \
+    errors "drive-bytes" "drive-rq"
+
+for w in $WORKLOADS; do
+    bytes=$(counter bytes)
+    reqs=$(counter requests)
+    line=$("$LOAD" -w "$w" -t "$THREADS" -d "$DURATION" "$MNT")
+    printf "%s %12d %8d\n" "$line" $(($(counter bytes) - bytes)) \
+        $(($(counter requests) - reqs))
+done